@@ -0,0 +1,1190 @@
+/**
+ *  @file bench.c Benchmarks for the image library.
+ *
+ *  Build with "make bench" and run:
+ *
+ *    ./bench suite [--json out.json] [--sizes VGA,HD,...] [--ops gauss,...]
+ *                      runs every operation of image.c on deterministic
+ *                      synthetic images from VGA to 8K, grey and RGB, and on
+ *                      papai_noel.bmp. For each one it reports the median and
+ *                      95th percentile time, megapixels per second and the
+ *                      bytes allocated per call, and optionally writes the
+ *                      results as JSON.
+ *
+ *    ./bench golden [--update] [--json out.json] [--ops gauss,...]
+ *                      runs every filter on papai_noel.bmp and on generated
+ *                      patterns and checks the results against the golden
+ *                      outputs, within the tolerance of each filter (see
+ *                      golden_filters), reporting the time of each filter
+ *                      as well. Exits with 1 on any failure. The outputs
+ *                      themselves are kept in golden/, which is not in the
+ *                      repository; golden.sum, which is, keeps a hash and a
+ *                      grid of block means of each one and is used for the
+ *                      outputs missing from golden/, so a fresh checkout is
+ *                      checked too. With --update the results of the current
+ *                      build are written to both as the new golden outputs:
+ *                      run it on a build known to be correct before changing
+ *                      a filter, and commit golden.sum.
+ *
+ *    ./bench compare base.json new.json [percent]
+ *                      lists the operations whose median time grew more than
+ *                      percent (default 10) and exits with 1 if there is any.
+ *
+ *    ./bench conv      times imgConvolve with each method for square
+ *                      kernels from 3x3 to 63x63 and reports where the
+ *                      FFT path starts to beat the direct sum.
+ *
+ *    ./bench pipe [chain [in.bmp [out.bmp]]]
+ *                      runs a chain of filters such as
+ *                      "grey,gauss,sobel,threshold=0.5" tile by tile with
+ *                      pipeRun, and times it against running each step over
+ *                      the whole image. Without in.bmp a 4K RGB image is used.
+ *                      Steps: grey, gauss, median, sobel, box=<k>,
+ *                      threshold=<t>, sauvola=<k>, bradley=<t> (the last
+ *                      two with a 31x31 window).
+ *
+ *  Every mode except compare starts by printing the SIMD variant of the
+ *  image.c kernels selected for this processor; set IMG_SIMD to sse2, avx2
+ *  or avx512 to force one. The JSON records carry it as "simd".
+ *
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image.h"
+
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <time.h>
+	#include <sys/stat.h>
+#endif
+
+/* bytes requested from malloc, calloc and realloc; counted only when the
+ * Makefile links with -Wl,--wrap for them (see BENCH_LDFLAGS) */
+static size_t allocated;
+
+#ifdef BENCH_WRAP_MALLOC
+void *__real_malloc(size_t n);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t n);
+
+void *__wrap_malloc(size_t n)
+{
+#pragma omp atomic
+	allocated += n;
+	return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+#pragma omp atomic
+	allocated += n*size;
+	return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t n)
+{
+#pragma omp atomic
+	allocated += n;
+	return __real_realloc(p, n);
+}
+#endif
+
+/* wall clock time in seconds */
+static double now(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER f, c;
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (double)c.QuadPart/(double)f.QuadPart;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+#endif
+}
+
+/* deterministic pseudo random numbers, so every run sees the same data */
+static unsigned int seed = 12345;
+static float rnd(void)
+{
+	seed = seed*1103515245u + 12345u;
+	return (float)((seed>>8) & 0xFFFF)/65535.f;
+}
+
+static Image *synthetic_image(int w, int h, int dcs)
+{
+	Image *img = imgCreate(w, h, dcs);
+	float *buf = imgGetData(img);
+	int i;
+
+	for (i=0; i<w*h*dcs; i++)
+		buf[i] = rnd();
+	return img;
+}
+
+/* best of n runs of imgConvolve, in milliseconds */
+static double time_convolve(Image *img, float *kernel, int k, int method, int n)
+{
+	double best = 1e30;
+	int i;
+
+	for (i=0; i<n; i++) {
+		double t0 = now();
+		Image *out = imgConvolve(img, kernel, k, k, IMG_BORDA_ESPELHO, method);
+		double t = (now()-t0)*1e3;
+		imgDestroy(out);
+		if (t < best) best = t;
+	}
+	return best;
+}
+
+static int bench_conv(void)
+{
+	int sizes[] = { 3, 5, 7, 9, 11, 13, 15, 21, 27, 31, 35, 39, 45, 63 };
+	int nsizes = sizeof(sizes)/sizeof(*sizes);
+	Image *img = synthetic_image(1024, 1024, 3);
+	int i, j, crossover = 0;
+
+	printf("imgConvolve on 1024x1024 RGB, mirror border (best of 3, ms)\n");
+	printf("%7s %10s %10s %10s\n", "kernel", "direct", "separable", "fft");
+
+	for (i=0; i<nsizes; i++) {
+		int k = sizes[i];
+		float *rank1 = malloc(k*k*sizeof(float));
+		float *full = malloc(k*k*sizeof(float));
+		double td, ts, tf;
+
+		/* a box filter is rank 1; a random kernel is not */
+		for (j=0; j<k*k; j++) {
+			rank1[j] = 1.f/(k*k);
+			full[j] = rnd()/(k*k);
+		}
+
+		td = time_convolve(img, full, k, IMG_CONV_DIRETA, 3);
+		ts = time_convolve(img, rank1, k, IMG_CONV_SEPARAVEL, 3);
+		tf = time_convolve(img, full, k, IMG_CONV_FFT, 3);
+		printf("%3dx%-3d %10.1f %10.1f %10.1f\n", k, k, td, ts, tf);
+
+		if (!crossover && tf < td)
+			crossover = k;
+
+		free(rank1);
+		free(full);
+	}
+
+	if (crossover)
+		printf("fft beats direct from %dx%d\n", crossover, crossover);
+	else
+		printf("fft never beat direct\n");
+
+	imgDestroy(img);
+	return 0;
+}
+
+/* appends one step of a chain ("gauss", "threshold=0.5", ...); 0 if unknown */
+static int add_step(Pipeline *pl, const char *step)
+{
+	const char *arg = strchr(step, '=');
+	int len = arg ? (int)(arg - step) : (int)strlen(step);
+
+	if (len == 4 && !strncmp(step, "grey", 4))
+		pipeGrey(pl);
+	else if (len == 5 && !strncmp(step, "gauss", 5))
+		pipeGauss(pl);
+	else if (len == 6 && !strncmp(step, "median", 6))
+		pipeMedian(pl);
+	else if (len == 5 && !strncmp(step, "sobel", 5))
+		pipeSobel(pl);
+	else if (len == 9 && !strncmp(step, "threshold", 9) && arg)
+		pipeThreshold(pl, (float)atof(arg+1));
+	else if (len == 7 && !strncmp(step, "sauvola", 7) && arg)
+		pipeSauvola(pl, 31, (float)atof(arg+1));
+	else if (len == 7 && !strncmp(step, "bradley", 7) && arg)
+		pipeBradley(pl, 31, (float)atof(arg+1));
+	else if (len == 3 && !strncmp(step, "box", 3) && arg && atoi(arg+1) > 0) {
+		int k = atoi(arg+1), i;
+		float *kernel = malloc(k*k*sizeof(float));
+		for (i=0; i<k*k; i++)
+			kernel[i] = 1.f/(k*k);
+		pipeConvolve(pl, kernel, k, k);
+		free(kernel);
+	} else
+		return 0;
+	return 1;
+}
+
+static int bench_pipe(const char *chain, char *in, char *out)
+{
+	char steps[32][64];
+	int nsteps = 0, i, j;
+	const char *p = chain;
+	Pipeline *fused = pipeCreate(IMG_BORDA_REPETE);
+	Image *img, *res = NULL;
+	double tf = 1e30, ts = 1e30;
+
+	/* split the chain on commas */
+	while (*p && nsteps < 32) {
+		int len = (int)strcspn(p, ",");
+		if (len >= 64) len = 63;
+		memcpy(steps[nsteps], p, len);
+		steps[nsteps][len] = 0;
+		if (!add_step(fused, steps[nsteps])) {
+			fprintf(stderr, "unknown step \"%s\"\n", steps[nsteps]);
+			pipeDestroy(fused);
+			return 1;
+		}
+		nsteps++;
+		p += strcspn(p, ",");
+		if (*p) p++;
+	}
+
+	img = in ? imgReadBMP(in) : synthetic_image(3840, 2160, 3);
+	if (!img) {
+		fprintf(stderr, "cannot read %s\n", in);
+		pipeDestroy(fused);
+		return 1;
+	}
+
+	for (i=0; i<3; i++) {
+		double t0 = now(), t;
+		Image *cur = img;
+
+		/* one step at a time, each writing a full-size intermediate */
+		for (j=0; j<nsteps; j++) {
+			Pipeline *one = pipeCreate(IMG_BORDA_REPETE);
+			Image *next;
+			add_step(one, steps[j]);
+			next = pipeRun(one, cur);
+			pipeDestroy(one);
+			if (cur != img) imgDestroy(cur);
+			cur = next;
+		}
+		t = (now()-t0)*1e3;
+		if (t < ts) ts = t;
+		if (cur != img) imgDestroy(cur);
+
+		t0 = now();
+		if (res) imgDestroy(res);
+		res = pipeRun(fused, img);
+		t = (now()-t0)*1e3;
+		if (t < tf) tf = t;
+	}
+
+	printf("%s on %dx%d (best of 3, ms)\n", chain, imgGetWidth(img), imgGetHeight(img));
+	printf("%10s %10s\n", "stepwise", "tiled");
+	printf("%10.1f %10.1f\n", ts, tf);
+
+	if (out)
+		imgWriteBMP(out, res);
+
+	imgDestroy(res);
+	imgDestroy(img);
+	pipeDestroy(fused);
+	return 0;
+}
+
+/*- Suite of every operation -------------------------------------------*/
+
+#define MAX_RUNS 15
+#define MIN_RUNS 3
+#define TIME_BUDGET 1.0    /* seconds per operation and image, after MIN_RUNS */
+#define TMP_BMP "bench_tmp.bmp"
+
+typedef struct {
+	Image *img;      /* input */
+	Image8 *img8;    /* the same input with 8-bit components */
+	Image *edges;    /* imgEdges of the input, an output of its size and */
+	Image *out;      /* the compiled highlight expression, made only */
+	PointProgram *highlight; /* when "highlight" is selected */
+} BenchInput;
+
+typedef struct {
+	const char *name;
+	void (*run)(BenchInput *in);
+	int dcs;         /* 1 or 3: only runs on inputs with this many components; 0: both */
+	double max_mp;   /* largest input it runs on, in megapixels (0: no limit) */
+} BenchOp;
+
+static void op_copy(BenchInput *in)     { imgDestroy(imgCopy(in->img)); }
+static void op_grey(BenchInput *in)     { imgDestroy(imgGrey(in->img)); }
+static void op_edges(BenchInput *in)    { imgDestroy(imgEdges(in->img, IMG_BORDA_REPETE)); }
+static void op_canny(BenchInput *in)    { bmpDestroy(imgCanny(in->img, 0.1f, 0.3f)); }
+static void op_binarize(BenchInput *in) { bmpDestroy(imgBinarize(in->img, 0.5f)); }
+static void op_otsu_multi(BenchInput *in) { imgDestroy(imgOtsuMulti(in->img, 3, 0)); }
+static void op_sauvola(BenchInput *in)  { bmpDestroy(imgBinSauvola(in->img, 31, 0.2f)); }
+static void op_bradley(BenchInput *in)  { bmpDestroy(imgBinBradley(in->img, 31, 0.15f)); }
+static void op_img8_grey(BenchInput *in) { img8Destroy(img8Grey(in->img8)); }
+static void op_img8_otsu(BenchInput *in) { bmpDestroy(img8Binarize(in->img8, img8OtsuThreshold(in->img8))); }
+static void op_to_img8(BenchInput *in)  { img8Destroy(imgToImage8(in->img)); }
+
+static void op_resize_half(BenchInput *in)
+{
+	Image *img = in->img;
+	imgDestroy(imgResize(img, imgGetWidth(img)/2, imgGetHeight(img)/2, IMG_FILTRO_AREA));
+}
+
+static void op_resize_bicubic(BenchInput *in)
+{
+	Image *img = in->img;
+	imgDestroy(imgResize(img, imgGetWidth(img)*3/4, imgGetHeight(img)*3/4, IMG_FILTRO_BICUBICO));
+}
+
+static void op_gauss(BenchInput *in)
+{
+	Image *img = in->img;
+	Image *dst = imgCreate(imgGetWidth(img), imgGetHeight(img), imgGetDimColorSpace(img));
+	imgGauss(dst, img, IMG_BORDA_REPETE);
+	imgDestroy(dst);
+}
+
+/* includes the copy, since imgMedian works in place */
+static void op_median(BenchInput *in)
+{
+	Image *dst = imgCopy(in->img);
+	imgMedian(dst, IMG_BORDA_REPETE);
+	imgDestroy(dst);
+}
+
+static void op_pixelize(BenchInput *in)
+{
+	Image *dst = imgCreate(imgGetWidth(in->img), imgGetHeight(in->img), imgGetDimColorSpace(in->img));
+	imgPixelize(in->img, dst, 64);
+	imgDestroy(dst);
+}
+
+static void op_convolve5(BenchInput *in)
+{
+	static const float kernel[25] = {
+		1, 2, 3, 2, 1,  2, 4, 6, 4, 2,  3, 6, 9, 6, 3,  2, 4, 6, 4, 2,  1, 2, 3, 2, 0 };
+	imgDestroy(imgConvolve(in->img, kernel, 5, 5, IMG_BORDA_ESPELHO, IMG_CONV_AUTO));
+}
+
+/* imgGetData drops the cached statistics, so they are computed every time */
+static void op_stats(BenchInput *in)
+{
+	imgGetData(in->img);
+	imgGetStats(in->img);
+}
+
+static void op_otsu(BenchInput *in)
+{
+	imgGetData(in->img);
+	imgDestroy(imgBinOtsu(in->img));
+}
+
+static void op_ohbuchi(BenchInput *in)
+{
+	imgGetData(in->img);
+	imgDestroy(imgBinOhbuchi(in->img));
+}
+
+static void op_reduce(BenchInput *in)
+{
+	Image *dst = imgCopy(in->img);
+	imgReduceColors(in->img, dst, 255);
+	imgDestroy(dst);
+}
+
+static void op_pointop(BenchInput *in)
+{
+	float k[2] = { 1.2f, 0.1f };
+	imgDestroy(imgPointOp("clamp(a*k0 - k1, 0, 1)", &in->img, 1, k, 2));
+}
+
+/* the viewer's Highlight slider: reruns a compiled expression into an existing image */
+static void op_highlight(BenchInput *in)
+{
+	Image *imgs[2];
+	float k = 0.1f;
+
+	imgs[0] = in->img;
+	imgs[1] = in->edges;
+	imgPointOpRun(in->highlight, imgs, &k, in->out, 0, 0, imgGetWidth(in->img), imgGetHeight(in->img));
+}
+
+/* against itself: the time is the same as for a different image of equal size */
+static void op_compare(BenchInput *in)
+{
+	ImageMetrics m;
+	imgCompare(in->img, in->img, &m, NULL);
+}
+
+static void op_pipe(BenchInput *in)
+{
+	Pipeline *pl = pipeCreate(IMG_BORDA_REPETE);
+	pipeGrey(pl);
+	pipeGauss(pl);
+	pipeSobel(pl);
+	pipeThreshold(pl, 0.5f);
+	imgDestroy(pipeRun(pl, in->img));
+	pipeDestroy(pl);
+}
+
+static void op_pyramid(BenchInput *in)
+{
+	pyrDestroy(pyrCreate(in->img, IMG_PIRAMIDE_GAUSS));
+}
+
+static void op_bmp_write(BenchInput *in) { imgWriteBMP(TMP_BMP, in->img); }
+static void op_bmp_read(BenchInput *in)  { imgDestroy(imgReadBMP(TMP_BMP)); }
+static void op_img8_write(BenchInput *in) { img8WriteBMP(TMP_BMP, in->img8); }
+static void op_img8_read(BenchInput *in)  { img8Destroy(img8ReadBMP(TMP_BMP)); }
+
+/* the codecs run in pairs: each read uses the file the previous write left */
+static BenchOp ops[] = {
+	{ "copy",           op_copy,           0, 0 },
+	{ "grey",           op_grey,           3, 0 },
+	{ "to_img8",        op_to_img8,        0, 0 },
+	{ "resize_half",    op_resize_half,    0, 0 },
+	{ "resize_bicubic", op_resize_bicubic, 0, 0 },
+	{ "pyramid",        op_pyramid,        0, 0 },
+	{ "stats",          op_stats,          0, 0 },
+	{ "gauss",          op_gauss,          0, 0 },
+	{ "median",         op_median,         0, 0 },
+	{ "pixelize",       op_pixelize,       0, 0 },
+	{ "edges",          op_edges,          0, 0 },
+	{ "convolve5",      op_convolve5,      0, 0 },
+	{ "canny",          op_canny,          0, 0 },
+	{ "pointop",        op_pointop,        0, 0 },
+	{ "highlight",      op_highlight,      0, 0 },
+	{ "compare",        op_compare,        0, 0 },
+	{ "pipe",           op_pipe,           0, 0 },
+	{ "binarize",       op_binarize,       0, 0 },
+	{ "otsu",           op_otsu,           0, 0 },
+	{ "ohbuchi",        op_ohbuchi,        0, 0 },
+	{ "otsu_multi",     op_otsu_multi,     0, 0 },
+	{ "sauvola",        op_sauvola,        1, 0 },
+	{ "bradley",        op_bradley,        1, 0 },
+	{ "reduce",         op_reduce,         3, 2.1 },
+	{ "img8_grey",      op_img8_grey,      3, 0 },
+	{ "img8_otsu",      op_img8_otsu,      0, 0 },
+	{ "bmp_write",      op_bmp_write,      3, 0 },
+	{ "bmp_read",       op_bmp_read,       3, 0 },
+	{ "img8_write",     op_img8_write,     3, 0 },
+	{ "img8_read",      op_img8_read,      3, 0 },
+};
+
+typedef struct {
+	const char *name;
+	int w, h;
+} BenchSize;
+
+static BenchSize sizes[] = {
+	{ "VGA",  640,  480 },
+	{ "HD",  1280,  720 },
+	{ "FHD", 1920, 1080 },
+	{ "4K",  3840, 2160 },
+	{ "8K",  7680, 4320 },
+};
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* comma separated list filter; an empty list accepts everything */
+static int selected(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *p = list;
+
+	if (!list) return 1;
+	while ((p = strstr(p, name)) != NULL) {
+		if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == 0))
+			return 1;
+		p += len;
+	}
+	return 0;
+}
+
+static void bench_input(FILE *json, int *first, const char *ops_list,
+		const char *size_name, Image *img)
+{
+	BenchInput in;
+	int w = imgGetWidth(img), h = imgGetHeight(img), dcs = imgGetDimColorSpace(img);
+	double mp = w*(double)h/1e6;
+	int i;
+
+	in.img = img;
+	in.img8 = imgToImage8(img);
+	in.edges = in.out = NULL;
+	in.highlight = NULL;
+	if (selected(ops_list, "highlight")) {
+		in.edges = imgEdges(img, IMG_BORDA_REPETE);
+		in.out = imgCreate(w, h, dcs);
+		in.highlight = imgPointOpCompile("clamp(a - k0*b, 0, 1)", 2, 1);
+	}
+
+	for (i=0; i<(int)(sizeof(ops)/sizeof(*ops)); i++) {
+		BenchOp *op = &ops[i];
+		double t[MAX_RUNS], total = 0, median, p95;
+		size_t bytes;
+		int runs = 0;
+
+		if (!selected(ops_list, op->name)) continue;
+		if (op->dcs && op->dcs != dcs) continue;
+		if (op->max_mp && mp > op->max_mp) continue;
+
+		/* one warm-up run, which also measures the allocations */
+		allocated = 0;
+		op->run(&in);
+		bytes = allocated;
+		while (runs < MAX_RUNS && (runs < MIN_RUNS || total < TIME_BUDGET)) {
+			double t0 = now();
+			op->run(&in);
+			t[runs] = now() - t0;
+			total += t[runs++];
+		}
+
+		qsort(t, runs, sizeof(double), compare_double);
+		median = (runs % 2) ? t[runs/2] : 0.5*(t[runs/2-1] + t[runs/2]);
+		p95 = t[(int)ceil(0.95*runs) - 1];
+
+		printf("%-15s %-10s %5dx%-5d %d %3d %10.2f %10.2f %9.1f %12lu\n",
+				op->name, size_name, w, h, dcs, runs, median*1e3, p95*1e3,
+				mp/median, (unsigned long)bytes);
+		fflush(stdout);
+		if (json) {
+			fprintf(json, "%s\n  {\"op\":\"%s\",\"size\":\"%s\",\"w\":%d,\"h\":%d,\"dcs\":%d,"
+					"\"runs\":%d,\"median_ms\":%.4f,\"p95_ms\":%.4f,\"mpix_s\":%.2f,\"bytes\":%lu,"
+					"\"simd\":\"%s\"}",
+					*first ? "" : ",", op->name, size_name, w, h, dcs, runs,
+					median*1e3, p95*1e3, mp/median, (unsigned long)bytes, imgSimdPath());
+			*first = 0;
+		}
+	}
+	img8Destroy(in.img8);
+	imgDestroy(in.edges);
+	imgDestroy(in.out);
+	imgPointOpDestroy(in.highlight);
+	remove(TMP_BMP);
+}
+
+static int bench_suite(int argc, char *argv[])
+{
+	const char *json_name = NULL, *sizes_list = NULL, *ops_list = NULL;
+	FILE *json = NULL;
+	int first = 1, i, dcs;
+
+	for (i=0; i<argc; i++) {
+		if (!strcmp(argv[i], "--json") && i+1 < argc)
+			json_name = argv[++i];
+		else if (!strcmp(argv[i], "--sizes") && i+1 < argc)
+			sizes_list = argv[++i];
+		else if (!strcmp(argv[i], "--ops") && i+1 < argc)
+			ops_list = argv[++i];
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (json_name && !(json = fopen(json_name, "w"))) {
+		fprintf(stderr, "cannot write %s\n", json_name);
+		return 1;
+	}
+	if (json)
+		fprintf(json, "[");
+
+	printf("%-15s %-10s %11s %s %3s %10s %10s %9s %12s\n", "op", "size", "pixels",
+			"c", "n", "median ms", "p95 ms", "MP/s", "bytes");
+
+	for (i=0; i<(int)(sizeof(sizes)/sizeof(*sizes)); i++) {
+		if (!selected(sizes_list, sizes[i].name)) continue;
+		for (dcs=1; dcs<=3; dcs+=2) {
+			Image *img = synthetic_image(sizes[i].w, sizes[i].h, dcs);
+			bench_input(json, &first, ops_list, sizes[i].name, img);
+			imgDestroy(img);
+		}
+	}
+
+	/* a real photograph, whose histogram and colors are not uniform noise */
+	if (selected(sizes_list, "papai_noel")) {
+		Image *img;
+		img = imgReadBMP("papai_noel.bmp");
+		if (img) {
+			Image *grey = imgGrey(img);
+			bench_input(json, &first, ops_list, "papai_noel", grey);
+			bench_input(json, &first, ops_list, "papai_noel", img);
+			imgDestroy(grey);
+			imgDestroy(img);
+		} else
+			fprintf(stderr, "papai_noel.bmp not found, skipped\n");
+	}
+
+	if (json) {
+		fprintf(json, "\n]\n");
+		fclose(json);
+	}
+	return 0;
+}
+
+/*- Comparison of two runs --------------------------------------------*/
+
+typedef struct {
+	char op[32], size[16];
+	int dcs;
+	double median;
+} BenchRecord;
+
+/* reads the records written by bench_suite; returns how many */
+static int read_records(const char *name, BenchRecord *rec, int max)
+{
+	FILE *f = fopen(name, "r");
+	char line[512];
+	int n = 0;
+
+	if (!f) {
+		fprintf(stderr, "cannot read %s\n", name);
+		return -1;
+	}
+	while (n < max && fgets(line, sizeof(line), f)) {
+		const char *p = strchr(line, '{');
+		int w, h, runs;
+		if (p && sscanf(p, "{\"op\":\"%31[^\"]\",\"size\":\"%15[^\"]\",\"w\":%d,\"h\":%d,"
+					"\"dcs\":%d,\"runs\":%d,\"median_ms\":%lf",
+					rec[n].op, rec[n].size, &w, &h, &rec[n].dcs, &runs, &rec[n].median) == 7)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+#define MAX_RECORDS 4096
+
+static int bench_compare(const char *base_name, const char *new_name, double percent)
+{
+	static BenchRecord base[MAX_RECORDS], cur[MAX_RECORDS];
+	int nb = read_records(base_name, base, MAX_RECORDS);
+	int nc = read_records(new_name, cur, MAX_RECORDS);
+	int i, j, regressions = 0;
+
+	if (nb < 0 || nc < 0) return 1;
+
+	printf("%-15s %-10s %s %10s %10s %8s\n", "op", "size", "c", "base ms", "new ms", "change");
+	for (i=0; i<nc; i++) {
+		for (j=0; j<nb; j++)
+			if (!strcmp(base[j].op, cur[i].op) && !strcmp(base[j].size, cur[i].size) &&
+					base[j].dcs == cur[i].dcs)
+				break;
+		if (j == nb || base[j].median <= 0) continue;
+		{
+			double change = 100*(cur[i].median/base[j].median - 1);
+			int slower = change > percent;
+			printf("%-15s %-10s %d %10.2f %10.2f %+7.1f%%%s\n", cur[i].op, cur[i].size,
+					cur[i].dcs, base[j].median, cur[i].median, change,
+					slower ? "  REGRESSION" : "");
+			regressions += slower;
+		}
+	}
+	printf("%d regression(s) above %.0f%%\n", regressions, percent);
+	return regressions ? 1 : 0;
+}
+
+/*- Golden outputs ----------------------------------------------------*/
+
+#define GOLDEN_DIR "golden"
+#define GOLDEN_SUM "golden.sum"
+#define GOLDEN_RUNS 5
+#define SUM_GRID 4    /* block means per side kept in GOLDEN_SUM */
+
+typedef struct {
+	const char *name;
+	Image *(*run)(Image *img);
+	double max_err;    /* largest absolute error accepted per component */
+	double min_ssim;   /* smallest SSIM accepted */
+} GoldenFilter;
+
+static Image *gf_grey(Image *img)   { return imgGrey(img); }
+static Image *gf_edges(Image *img)  { return imgEdges(img, IMG_BORDA_REPETE); }
+static Image *gf_pyramid(Image *img)
+{
+	Pyramid *pyr = pyrCreate(img, IMG_PIRAMIDE_GAUSS);
+	Image *level = imgCopy(pyrGetLevel(pyr, pyrGetLevels(pyr) > 2 ? 2 : 0));
+	pyrDestroy(pyr);
+	return level;
+}
+
+static Image *gauss_border(Image *img, int borda)
+{
+	Image *dst = imgCreate(imgGetWidth(img), imgGetHeight(img), imgGetDimColorSpace(img));
+	imgGauss(dst, img, borda);
+	return dst;
+}
+static Image *gf_gauss(Image *img)        { return gauss_border(img, IMG_BORDA_REPETE); }
+static Image *gf_gauss_mirror(Image *img) { return gauss_border(img, IMG_BORDA_ESPELHO); }
+static Image *gf_gauss_wrap(Image *img)   { return gauss_border(img, IMG_BORDA_CIRCULAR); }
+static Image *gf_gauss_zero(Image *img)   { return gauss_border(img, IMG_BORDA_CONSTANTE); }
+
+static Image *gf_median(Image *img)
+{
+	Image *dst = imgCopy(img);
+	imgMedian(dst, IMG_BORDA_REPETE);
+	return dst;
+}
+
+/* 7 divides neither side of the inputs, so the edge blocks are partial */
+static Image *gf_pixelize(Image *img)
+{
+	Image *dst = imgCreate(imgGetWidth(img), imgGetHeight(img), imgGetDimColorSpace(img));
+	imgPixelize(img, dst, 7);
+	return dst;
+}
+
+static const float kernel5[25] = {
+	1, 2, 3, 2, 1,  2, 4, 6, 4, 2,  3, 6, 9, 6, 3,  2, 4, 6, 4, 2,  1, 2, 3, 2, 0 };
+static Image *gf_conv_direct(Image *img) { return imgConvolve(img, kernel5, 5, 5, IMG_BORDA_ESPELHO, IMG_CONV_DIRETA); }
+static Image *gf_conv_fft(Image *img)    { return imgConvolve(img, kernel5, 5, 5, IMG_BORDA_ESPELHO, IMG_CONV_FFT); }
+
+static Image *gf_resize_area(Image *img)
+{
+	return imgResize(img, imgGetWidth(img)/2, imgGetHeight(img)/2, IMG_FILTRO_AREA);
+}
+static Image *gf_resize_bicubic(Image *img)
+{
+	return imgResize(img, imgGetWidth(img)*3/4, imgGetHeight(img)*3/4, IMG_FILTRO_BICUBICO);
+}
+static Image *gf_resize_up(Image *img)
+{
+	return imgResize(img, imgGetWidth(img)*3/2, imgGetHeight(img)*3/2, IMG_FILTRO_BILINEAR);
+}
+
+static Image *bitmap_image(Bitmap *bmp)
+{
+	Image *img = bmpToImage(bmp);
+	bmpDestroy(bmp);
+	return img;
+}
+static Image *gf_canny(Image *img)    { return bitmap_image(imgCanny(img, 0.1f, 0.3f)); }
+static Image *gf_binarize(Image *img) { return bitmap_image(imgBinarize(img, 0.5f)); }
+
+/* the thresholding methods expect a grey image */
+static Image *with_grey(Image *img, Image *(*f)(Image *))
+{
+	Image *grey = imgGetDimColorSpace(img) == 1 ? img : imgGrey(img);
+	Image *out = f(grey);
+	if (grey != img) imgDestroy(grey);
+	return out;
+}
+static Image *sauvola(Image *grey) { return bitmap_image(imgBinSauvola(grey, 31, 0.2f)); }
+static Image *bradley(Image *grey) { return bitmap_image(imgBinBradley(grey, 31, 0.15f)); }
+static Image *gf_otsu(Image *img)    { return with_grey(img, imgBinOtsu); }
+static Image *gf_ohbuchi(Image *img) { return with_grey(img, imgBinOhbuchi); }
+static Image *gf_sauvola(Image *img) { return with_grey(img, sauvola); }
+static Image *gf_bradley(Image *img) { return with_grey(img, bradley); }
+static Image *gf_otsu_multi(Image *img) { return imgOtsuMulti(img, 3, 0); }
+
+static Image *gf_reduce(Image *img)
+{
+	Image *dst = imgCopy(img);
+	imgReduceColors(img, dst, 64);
+	return dst;
+}
+
+static Image *gf_pointop(Image *img)
+{
+	float k[2] = { 1.2f, 0.1f };
+	return imgPointOp("clamp(a*k0 - k1, 0, 1)", &img, 1, k, 2);
+}
+
+/* the viewer's highlight: orig - th*sobel */
+static Image *gf_highlight(Image *img)
+{
+	Image *imgs[2];
+	Image *out;
+	float k = 0.5f;
+
+	imgs[0] = img;
+	imgs[1] = imgEdges(img, IMG_BORDA_REPETE);
+	out = imgPointOp("clamp(a - k0*b, 0, 1)", imgs, 2, &k, 1);
+	imgDestroy(imgs[1]);
+	return out;
+}
+
+static Image *gf_pipe(Image *img)
+{
+	Pipeline *pl = pipeCreate(IMG_BORDA_REPETE);
+	Image *out;
+	pipeGrey(pl);
+	pipeGauss(pl);
+	pipeMedian(pl);
+	pipeSobel(pl);
+	out = pipeRun(pl, img);
+	pipeDestroy(pl);
+	return out;
+}
+
+static Image *gf_img8(Image *img)
+{
+	Image8 *img8 = imgToImage8(img);
+	Image8 *grey = img8Grey(img8);
+	Image *out = img8ToImage(grey);
+	img8Destroy(grey);
+	img8Destroy(img8);
+	return out;
+}
+
+/* max_err is what decides: 0 for binary, label and 8-bit outputs and for
+ * the median, which only moves values around and must match bit for bit;
+ * 1e-6 for the float filters, whose sums a kernel or compiler change may
+ * reorder; 1e-5 for the longer sums of the 5x5 kernel and the resamplers
+ * and 1e-4 for the FFT. min_ssim stays just below 1 so it only catches a
+ * structural change that max_err would let through */
+static GoldenFilter golden_filters[] = {
+	{ "grey",           gf_grey,           1e-6, 0.99999 },
+	{ "gauss",          gf_gauss,          1e-6, 0.99999 },
+	{ "gauss_mirror",   gf_gauss_mirror,   1e-6, 0.99999 },
+	{ "gauss_wrap",     gf_gauss_wrap,     1e-6, 0.99999 },
+	{ "gauss_zero",     gf_gauss_zero,     1e-6, 0.99999 },
+	{ "median",         gf_median,         0,    0.99999 },
+	{ "pixelize",       gf_pixelize,       1e-6, 0.99999 },
+	{ "edges",          gf_edges,          1e-6, 0.99999 },
+	{ "conv_direct",    gf_conv_direct,    1e-5, 0.99999 },
+	{ "conv_fft",       gf_conv_fft,       1e-4, 0.9999 },
+	{ "resize_area",    gf_resize_area,    1e-5, 0.99999 },
+	{ "resize_bicubic", gf_resize_bicubic, 1e-5, 0.99999 },
+	{ "resize_up",      gf_resize_up,      1e-5, 0.99999 },
+	{ "pyramid",        gf_pyramid,        1e-5, 0.99999 },
+	{ "canny",          gf_canny,          0,    0.99999 },
+	{ "binarize",       gf_binarize,       0,    0.99999 },
+	{ "otsu",           gf_otsu,           0,    0.99999 },
+	{ "ohbuchi",        gf_ohbuchi,        0,    0.99999 },
+	{ "otsu_multi",     gf_otsu_multi,     0,    0.99999 },
+	{ "sauvola",        gf_sauvola,        0,    0.99999 },
+	{ "bradley",        gf_bradley,        0,    0.99999 },
+	{ "reduce",         gf_reduce,         1e-6, 0.99999 },
+	{ "pointop",        gf_pointop,        1e-6, 0.99999 },
+	{ "highlight",      gf_highlight,      1e-6, 0.99999 },
+	{ "pipe",           gf_pipe,           1e-6, 0.99999 },
+	{ "img8",           gf_img8,           0,    0.99999 },
+};
+
+/* gradients, a checkerboard and a disc: edges in every direction, flat
+ * areas and a smooth ramp, with sizes that are not multiples of a tile */
+static Image *pattern_image(int w, int h, int dcs)
+{
+	Image *img = imgCreate(w, h, dcs);
+	float *buf = imgGetData(img);
+	int x, y, c;
+
+	for (y=0; y<h; y++)
+		for (x=0; x<w; x++) {
+			float dx = x - 0.6f*w, dy = y - 0.4f*h;
+			float disc = dx*dx + dy*dy < 0.08f*w*h ? 1.f : 0.f;
+			float check = ((x/7 + y/5) & 1) ? 0.75f : 0.25f;
+			float rgb[3];
+			rgb[0] = (float)x/(w-1);
+			rgb[1] = x < w/2 ? check : (float)y/(h-1);
+			rgb[2] = 0.5f*disc + 0.5f*(y < h/2 ? check : 1.f - (float)x/(w-1));
+			for (c=0; c<dcs; c++)
+				buf[(y*w + x)*dcs + c] = dcs == 3 ? rgb[c] : (rgb[0] + rgb[1] + rgb[2])/3;
+		}
+	return img;
+}
+
+/* the golden files are PFM, which always has three components */
+static Image *to_rgb(Image *img)
+{
+	int w = imgGetWidth(img), h = imgGetHeight(img), y, x;
+	Image *rgb;
+
+	if (imgGetDimColorSpace(img) == 3) return imgCopy(img);
+	rgb = imgCreate(w, h, 3);
+	for (y=0; y<h; y++) {
+		const float *src = imgGetRowConst(img, y);
+		float *dst = imgGetRow(rgb, y);
+		for (x=0; x<w; x++)
+			dst[3*x] = dst[3*x+1] = dst[3*x+2] = src[x];
+	}
+	return rgb;
+}
+
+static int file_exists(const char *name)
+{
+	FILE *f = fopen(name, "rb");
+	if (f) fclose(f);
+	return f != NULL;
+}
+
+/* what GOLDEN_SUM keeps of a golden output: its size, an FNV-1a hash of its
+ * floats and the mean of each component over a SUM_GRID x SUM_GRID grid of
+ * blocks. A result within max_err of the golden output has every mean
+ * within max_err of the golden one, so the means check the tolerance
+ * without the output itself, if less strictly than golden/ */
+typedef struct {
+	char key[64];    /* filter/input */
+	int w, h;
+	unsigned long long hash;
+	double mean[SUM_GRID*SUM_GRID*3];
+} GoldenSum;
+
+static GoldenSum *sums;
+static int nsums;
+
+static void summarize(Image *rgb, const char *key, GoldenSum *s)
+{
+	int w = imgGetWidth(rgb), h = imgGetHeight(rgb), x, y, c, i;
+	double n[SUM_GRID*SUM_GRID];
+
+	memset(s, 0, sizeof(*s));
+	memset(n, 0, sizeof(n));
+	strcpy(s->key, key);
+	s->w = w;
+	s->h = h;
+	s->hash = 14695981039346656037ULL;
+	for (y=0; y<h; y++) {
+		const float *row = imgGetRowConst(rgb, y);
+		const unsigned char *bytes = (const unsigned char *)row;
+		for (i=0; i<w*3*(int)sizeof(float); i++) {
+			s->hash ^= bytes[i];
+			s->hash *= 1099511628211ULL;
+		}
+		for (x=0; x<w; x++) {
+			int k = (y*SUM_GRID/h)*SUM_GRID + x*SUM_GRID/w;
+			for (c=0; c<3; c++)
+				s->mean[3*k + c] += row[3*x + c];
+			n[k]++;
+		}
+	}
+	for (i=0; i<SUM_GRID*SUM_GRID; i++)
+		for (c=0; c<3; c++)
+			if (n[i]) s->mean[3*i + c] /= n[i];
+}
+
+static GoldenSum *find_sum(const char *key)
+{
+	int i;
+	for (i=0; i<nsums; i++)
+		if (!strcmp(sums[i].key, key))
+			return &sums[i];
+	return NULL;
+}
+
+/* reads GOLDEN_SUM: one line per output with the key, the size, the hash
+ * in hex and the means */
+static void read_sums(void)
+{
+	FILE *f = fopen(GOLDEN_SUM, "r");
+	GoldenSum s;
+	int i;
+
+	if (!f) return;
+	while (fscanf(f, "%63s %d %d %llx", s.key, &s.w, &s.h, &s.hash) == 4) {
+		for (i=0; i<SUM_GRID*SUM_GRID*3; i++)
+			if (fscanf(f, "%lf", &s.mean[i]) != 1) break;
+		if (i < SUM_GRID*SUM_GRID*3) break;
+		sums = realloc(sums, (nsums+1)*sizeof(GoldenSum));
+		sums[nsums++] = s;
+	}
+	fclose(f);
+}
+
+static int write_sums(void)
+{
+	FILE *f = fopen(GOLDEN_SUM, "w");
+	int i, j;
+
+	if (!f) return 0;
+	for (i=0; i<nsums; i++) {
+		fprintf(f, "%s %d %d %016llx", sums[i].key, sums[i].w, sums[i].h, sums[i].hash);
+		for (j=0; j<SUM_GRID*SUM_GRID*3; j++)
+			fprintf(f, " %.9g", sums[i].mean[j]);
+		fprintf(f, "\n");
+	}
+	return fclose(f) == 0;
+}
+
+/* largest difference between the block means of two summaries */
+static double sum_diff(const GoldenSum *a, const GoldenSum *b)
+{
+	double d = 0;
+	int i;
+	for (i=0; i<SUM_GRID*SUM_GRID*3; i++)
+		if (fabs(a->mean[i] - b->mean[i]) > d)
+			d = fabs(a->mean[i] - b->mean[i]);
+	return d;
+}
+
+/* runs every filter on a fixed corpus and checks the results against the
+ * golden outputs in GOLDEN_DIR; with --update the outputs become the new
+ * golden files instead */
+static int bench_golden(int argc, char *argv[])
+{
+	const char *json_name = NULL, *ops_list = NULL;
+	int update = 0, first = 1, failures = 0, missing = 0, checked = 0;
+	Image *corpus[5];
+	const char *corpus_names[5] = { "papai_noel", "papai_noel_grey", "pattern", "pattern_grey", "noise" };
+	int ncorpus = 0, i, j, k;
+	FILE *json = NULL;
+
+	for (i=0; i<argc; i++) {
+		if (!strcmp(argv[i], "--update"))
+			update = 1;
+		else if (!strcmp(argv[i], "--json") && i+1 < argc)
+			json_name = argv[++i];
+		else if (!strcmp(argv[i], "--ops") && i+1 < argc)
+			ops_list = argv[++i];
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	corpus[0] = imgReadBMP("papai_noel.bmp");
+	if (!corpus[0]) {
+		fprintf(stderr, "papai_noel.bmp not found\n");
+		return 1;
+	}
+	corpus[1] = imgGrey(corpus[0]);
+	corpus[2] = pattern_image(203, 117, 3);
+	corpus[3] = pattern_image(203, 117, 1);
+	seed = 12345;
+	corpus[4] = synthetic_image(61, 43, 3);
+	ncorpus = 5;
+	read_sums();
+
+	if (json_name && !(json = fopen(json_name, "w"))) {
+		fprintf(stderr, "cannot write %s\n", json_name);
+		return 1;
+	}
+	if (json)
+		fprintf(json, "[");
+
+#ifdef WIN32
+	CreateDirectory(GOLDEN_DIR, NULL);
+#else
+	mkdir(GOLDEN_DIR, 0777);
+#endif
+
+	printf("%-15s %-16s %10s %12s %9s %8s  %s\n", "filter", "input", "median ms",
+			"max err", "psnr", "ssim", "result");
+	for (i=0; i<(int)(sizeof(golden_filters)/sizeof(*golden_filters)); i++) {
+		GoldenFilter *gf = &golden_filters[i];
+		if (!selected(ops_list, gf->name)) continue;
+
+		for (j=0; j<ncorpus; j++) {
+			Image *in = corpus[j], *out = NULL, *rgb;
+			char name[256], key[64];
+			GoldenSum sum, *ref;
+			double t[GOLDEN_RUNS], median;
+			ImageMetrics m;
+			const char *result;
+
+			/* the output of every run is kept until the last one, which is checked */
+			for (k=0; k<GOLDEN_RUNS; k++) {
+				double t0;
+				imgDestroy(out);
+				t0 = now();
+				out = gf->run(in);
+				t[k] = now() - t0;
+			}
+			qsort(t, GOLDEN_RUNS, sizeof(double), compare_double);
+			median = t[GOLDEN_RUNS/2];
+
+			rgb = to_rgb(out);
+			sprintf(name, "%s/%s_%s.pfm", GOLDEN_DIR, gf->name, corpus_names[j]);
+			sprintf(key, "%s/%s", gf->name, corpus_names[j]);
+			summarize(rgb, key, &sum);
+			ref = find_sum(key);
+			m.max_err = m.psnr = m.ssim = 0;
+			if (update) {
+				if (!ref) {
+					sums = realloc(sums, (nsums+1)*sizeof(GoldenSum));
+					ref = &sums[nsums++];
+				}
+				*ref = sum;
+				result = imgWritePFM(name, rgb) ? "written" : "WRITE FAILED";
+			} else if (!file_exists(name) && ref) {
+				/* only the summary: the error shown is that of the block means */
+				checked++;
+				if (ref->w != sum.w || ref->h != sum.h)
+					result = "FAIL (size)";
+				else if (ref->hash == sum.hash)
+					result = "ok (sum)";
+				else {
+					m.max_err = sum_diff(ref, &sum);
+					result = (gf->max_err > 0 && m.max_err <= gf->max_err) ? "ok (sum)" : "FAIL";
+				}
+				if (strncmp(result, "ok", 2)) failures++;
+			} else if (!file_exists(name)) {
+				result = "NO GOLDEN";
+				missing++;
+			} else {
+				Image *golden;
+				golden = imgReadPFM(name);
+				checked++;
+				if (!golden || !imgCompare(golden, rgb, &m, NULL))
+					result = "FAIL (size)";
+				else if (m.max_err > gf->max_err || m.ssim < gf->min_ssim)
+					result = "FAIL";
+				else
+					result = "ok";
+				if (strcmp(result, "ok")) failures++;
+				imgDestroy(golden);
+			}
+			printf("%-15s %-16s %10.3f %12.3g %9.2f %8.6f  %s\n", gf->name, corpus_names[j],
+					median*1e3, m.max_err, m.psnr, m.ssim, result);
+
+			/* the same records as the suite, so "bench compare" reads them */
+			if (json) {
+				fprintf(json, "%s\n  {\"op\":\"%s\",\"size\":\"%s\",\"w\":%d,\"h\":%d,\"dcs\":%d,"
+						"\"runs\":%d,\"median_ms\":%.4f,\"max_err\":%g,\"ssim\":%.6f,\"result\":\"%s\","
+						"\"simd\":\"%s\"}",
+						first ? "" : ",", gf->name, corpus_names[j], imgGetWidth(in),
+						imgGetHeight(in), imgGetDimColorSpace(in), GOLDEN_RUNS, median*1e3,
+						m.max_err, m.ssim, result, imgSimdPath());
+				first = 0;
+			}
+			imgDestroy(rgb);
+			imgDestroy(out);
+		}
+	}
+
+	if (json) {
+		fprintf(json, "\n]\n");
+		fclose(json);
+	}
+	for (j=0; j<ncorpus; j++)
+		imgDestroy(corpus[j]);
+
+	if (update) {
+		if (!write_sums()) {
+			fprintf(stderr, "cannot write %s\n", GOLDEN_SUM);
+			return 1;
+		}
+		return 0;
+	}
+	printf("%d checked, %d failed, %d without golden output\n", checked, failures, missing);
+	return failures || missing ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	/* the kernel variant picked by image.c for this machine (or forced by IMG_SIMD) */
+	if (argc > 1 && strcmp(argv[1], "compare"))
+		printf("simd path: %s\n", imgSimdPath());
+
+	if (argc > 1 && !strcmp(argv[1], "suite"))
+		return bench_suite(argc-2, argv+2);
+	if (argc > 1 && !strcmp(argv[1], "golden"))
+		return bench_golden(argc-2, argv+2);
+	if (argc > 3 && !strcmp(argv[1], "compare"))
+		return bench_compare(argv[2], argv[3], argc > 4 ? atof(argv[4]) : 10.0);
+	if (argc > 1 && !strcmp(argv[1], "conv"))
+		return bench_conv();
+	if (argc > 1 && !strcmp(argv[1], "pipe"))
+		return bench_pipe(argc > 2 ? argv[2] : "grey,gauss,sobel,threshold=0.5",
+		                  argc > 3 ? argv[3] : NULL, argc > 4 ? argv[4] : NULL);
+
+	fprintf(stderr, "usage: %s suite [--json out.json] [--sizes list] [--ops list]\n"
+			"       %s golden [--update] [--json out.json] [--ops list]\n"
+			"       %s compare base.json new.json [percent]\n"
+			"       %s conv\n"
+			"       %s pipe [chain [in.bmp [out.bmp]]]\n", argv[0], argv[0], argv[0], argv[0], argv[0]);
+	return 1;
+}
@@ -39,11 +39,22 @@
 #include <assert.h>
 #include <math.h>
 #include <float.h>
+#include <limits.h>
+#include <ctype.h>
 #include <memory.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "image.h"
 
 #define ROUND(_) (int)floor( (_) + 0.5 )
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 #define N_CORES   256
 #define MAIOR_COR 255
 
@@ -57,6 +68,23 @@ struct Image_imp {
                    /* de cada pixel a partir do canto inferior esquerdo da imagem.  */
                    /* A posicao das componentes de cor do pixel (x,y) fica armazenada */
                    /* a partir da posicao: (y*width*dcs) + (x*dcs)  */
+   ImageStats *stats; /* cache das estatisticas (NULL enquanto nao calculadas) */
+   int stats_ok;      /* 1 se o cache corresponde ao conteudo atual do buf     */
+};
+
+struct Bitmap_imp {
+   int width;            /* numero de pixels na direcao horizontal da imagem */
+   int height;           /* numero de pixels na direcao vertical da imagem   */
+   int stride;           /* numero de bytes de cada linha                    */
+   unsigned char *bits;  /* linhas de stride bytes, a partir do canto inferior esquerdo; */
+                         /* o pixel (x,y) e' o bit (7 - x%8) do byte y*stride + x/8     */
+};
+
+struct Image8_imp {
+   int dcs;              /* dimensao do espaco de cor: 3=RGB, 1=luminancia   */
+   int width;            /* numero de pixels na direcao horizontal da imagem */
+   int height;           /* numero de pixels na direcao vertical da imagem   */
+   unsigned char *buf;   /* componentes de cor, na mesma ordem de Image::buf */
 };
 
 
@@ -230,9 +258,172 @@ static int putdword(FILE *output, unsigned long int dword)
 
 static float luminance(float red, float green, float blue)
 {
- return 0.2126f*red +0.7152f*green+0.0722f*blue;
+ return imgLuminance(red, green, blue);
+}
+
+/*- Variantes por conjunto de instrucoes --------------------------------*/
+/* O mesmo binario roda em maquinas diferentes: cada kernel e' compilado
+   tambem para AVX2 e AVX-512 (atributo target do gcc, o corpo e' o mesmo)
+   e a variante usada e' escolhida uma vez, pela cpuid. A variavel de
+   ambiente IMG_SIMD (sse2, avx2 ou avx512) forca uma variante, desde que o
+   processador a suporte. Sem contracao em FMA todas as variantes dao
+   exatamente o mesmo resultado; as funcoes chamadas pelos kernels sao
+   KERNEL_INLINE, senao o gcc nao as expande nas variantes com target. */
+#define SIMD_BASE   0
+#define SIMD_AVX2   1
+#define SIMD_AVX512 2
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_DESPACHO
+#define SIMD_NOME_BASE   "sse2"
+#define SIMD_ALVO_AVX2   __attribute__((target("avx2"), optimize("fp-contract=off")))
+#define SIMD_ALVO_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl"), optimize("fp-contract=off")))
+#define KERNEL_INLINE    static inline __attribute__((always_inline))
+#else
+#define SIMD_NOME_BASE   "generico"
+#define KERNEL_INLINE    static
+#endif
+
+static const char* simdNomes[] = { SIMD_NOME_BASE, "avx2", "avx512" };
+
+/* maior kernel (em elementos) que IMG_CONV_AUTO aplica por soma direta em cada variante;
+   acima dele a FFT por blocos, que quase nao depende da variante, e' mais rapida. A soma
+   direta ganha com vetores mais largos, entao o limite cresce: medido com "bench conv"
+   numa imagem RGB 1024x1024, a FFT passa a ganhar perto de 29x29 em sse2, 35x35 em avx2
+   e 37x37 em avx512. */
+static const int convMaxDireta[] = { 27*27, 33*33, 35*35 };
+static int simdCaminho = -1;
+
+/* melhor variante suportada pelo processador, ou a pedida em IMG_SIMD. Os
+   seletores a chamam dentro de regioes paralelas: com o gcc ela e' resolvida
+   antes de main (construtor abaixo), sem ele a primeira chamada e' protegida
+   por uma secao critica */
+static int SimdCaminho(void)
+{
+#ifndef __GNUC__
+#pragma omp critical(simd_caminho)
+#endif
+    if (simdCaminho<0) {
+        const char* pedido = getenv("IMG_SIMD");
+        int melhor = SIMD_BASE, i;
+
+#ifdef SIMD_DESPACHO
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512vl"))
+            melhor = SIMD_AVX512;
+        else if (__builtin_cpu_supports("avx2"))
+            melhor = SIMD_AVX2;
+#endif
+        if (pedido && *pedido) {
+            for (i=SIMD_BASE;i<=SIMD_AVX512;i++)
+                if (!strcmp(pedido, simdNomes[i])) break;
+            if (i>SIMD_AVX512)
+                fprintf(stderr, "IMG_SIMD=%s desconhecido, usando %s\n", pedido, simdNomes[melhor]);
+            else if (i>melhor)
+                fprintf(stderr, "IMG_SIMD=%s nao suportado pelo processador, usando %s\n", pedido, simdNomes[melhor]);
+            else
+                melhor = i;
+        }
+        simdCaminho = melhor;
+    }
+    return simdCaminho;
+}
+
+#ifdef __GNUC__
+static void __attribute__((constructor)) SimdInicia(void)
+{
+    SimdCaminho();
+}
+#endif
+
+const char* imgSimdPath(void)
+{
+    return simdNomes[SimdCaminho()];
 }
 
+/*- Kernels especializados pelo numero de componentes -------------------*/
+/* Os lacos internos sao escritos uma unica vez como macros DEF(D, T, nome),
+   sobre D componentes por pixel (constante de compilacao, logo sem testes de
+   dcs dentro do laco) e amostras do tipo T. KERNEL_CANAIS instancia
+   nome_isa_D_T para cada numero de componentes de KERNEL_DCS e cada variante
+   de KERNEL_ISAS, e KERNEL_SELETOR gera a funcao que escolhe a instancia
+   pelo dcs da imagem e pelo SimdCaminho, uma vez por imagem ou linha.
+   Imagens RGBA ou de 16 bits pedem so mais uma instanciacao; kernels que
+   nao dependem do dcs usam KERNEL_ISAS e KERNEL_SELETOR_ISA com D=1. */
+#define KERNEL_DCS(X, DEF, T, nome) X(DEF, 1, T, nome) X(DEF, 3, T, nome)
+#define KERNEL_NOME(nome, D, T) nome##_##D##_##T
+
+#ifdef SIMD_DESPACHO
+#define KERNEL_ISAS(DEF, D, T, nome)               \
+    DEF(D, T, nome##_base)                         \
+    SIMD_ALVO_AVX2 DEF(D, T, nome##_avx2)          \
+    SIMD_ALVO_AVX512 DEF(D, T, nome##_avx512)
+#define KERNEL_ISA(nome, D, T, simd)                        \
+    ((simd)==SIMD_AVX512 ? KERNEL_NOME(nome##_avx512, D, T) : \
+     (simd)==SIMD_AVX2   ? KERNEL_NOME(nome##_avx2, D, T)   : \
+                           KERNEL_NOME(nome##_base, D, T))
+#else
+#define KERNEL_ISAS(DEF, D, T, nome) DEF(D, T, nome##_base)
+#define KERNEL_ISA(nome, D, T, simd) KERNEL_NOME(nome##_base, D, T)
+#endif
+
+#define KERNEL_CANAIS(DEF, T, nome) KERNEL_DCS(KERNEL_ISAS, DEF, T, nome)
+#define KERNEL_CASO(DEF, D, T, nome) case D: return KERNEL_ISA(nome, D, T, SimdCaminho());
+#define KERNEL_SELETOR(tipo, seletor, nome, T) \
+static tipo seletor(int dcs)                    \
+{                                               \
+    switch (dcs) {                              \
+    KERNEL_DCS(KERNEL_CASO, 0, T, nome)         \
+    }                                           \
+    assert(!"dcs sem kernel");                  \
+    return NULL;                                \
+}
+#define KERNEL_SELETOR_ISA(tipo, seletor, nome, T) \
+static tipo seletor(void)                           \
+{                                                   \
+    return KERNEL_ISA(nome, 1, T, SimdCaminho());   \
+}
+
+/* luminancia do pixel p de D componentes */
+#define KERNEL_LUMA(p, D) \
+    ((D)>=3 ? luminance((float)(p)[0],(float)(p)[1],(float)(p)[2]) : (float)(p)[0])
+
+/* luminancia de uma linha de w pixels */
+typedef void (*KernelLuma)(const float* src, float* luma, int w);
+
+#define DEF_LINHA_LUMA(D, T, nome)                                  \
+static void KERNEL_NOME(nome, D, T)(const T* src, float* luma, int w) \
+{                                                                   \
+    int x;                                                          \
+    for (x=0;x<w;x++)                                               \
+        luma[x] = KERNEL_LUMA(src+(size_t)x*D, D);                  \
+}
+
+KERNEL_CANAIS(DEF_LINHA_LUMA, float, LinhaLuma)
+KERNEL_SELETOR(KernelLuma, EscolheLinhaLuma, LinhaLuma, float)
+
+/* luminancia da linha y da imagem (imagens de luminancia sao copiadas) */
+static void LinhaLuminancia(Image* img, int y, float* luma)
+{
+    EscolheLinhaLuma(img->dcs)(img->buf + (size_t)y*img->width*img->dcs, luma, img->width);
+}
+
+/* acc[i] += p*s[i] para i em [0,n): o laco interno das convolucoes
+   e da pixelizacao */
+typedef void (*KernelAcumula)(float* acc, const float* s, float p, int n);
+
+#define DEF_ACUMULA(D, T, nome)                                        \
+static void KERNEL_NOME(nome, D, T)(T* acc, const T* s, T p, int n)    \
+{                                                                      \
+    int i;                                                             \
+    _Pragma("omp simd")                                                \
+    for (i=0;i<n;i++) acc[i] += p*s[i];                                \
+}
+
+KERNEL_ISAS(DEF_ACUMULA, 1, float, Acumula)
+KERNEL_SELETOR_ISA(KernelAcumula, EscolheAcumula, Acumula, float)
+
 
 /************************************************************************/
 /* Definicao das Funcoes Exportadas                                     */
@@ -247,6 +438,8 @@ Image* imgCreate(int w, int h, int dcs)
    image->dcs = dcs;
    image->buf = calloc (w * h * dcs , sizeof(float));
    assert(image->buf);
+   image->stats = NULL;
+   image->stats_ok = 0;
    return image;
 }
 
@@ -255,26 +448,16 @@ void imgDestroy(Image* image)
    if (image)
    {
       if (image->buf) free (image->buf);
+      if (image->stats) free (image->stats);
       free(image);
    }
 }
 
 Image* imgCopy(Image* image)
 {
-   int w = imgGetWidth(image);
-   int h = imgGetHeight(image);
-   int dcs = imgGetDimColorSpace(image);
-   Image* img1=imgCreate(w,h,dcs);
-   int x,y;
-   float rgb[3];
-
-   for (y=0;y<h;y++){
-      for (x=0;x<w;x++) {
-         imgGetPixel3fv(image,x,y,rgb);
-         imgSetPixel3fv(img1,x,y,rgb);
-      }
-   }
+   Image* img1=imgCreate(image->width,image->height,image->dcs);
 
+   memcpy(img1->buf, image->buf, (size_t)image->width*image->height*image->dcs*sizeof(float));
    return img1;
 }
 
@@ -284,87 +467,347 @@ Image* imgGrey(Image* image)
 {
    int w = imgGetWidth(image);
    int h = imgGetHeight(image);
+   int dcs = imgGetDimColorSpace(image);
    Image* img1=imgCreate(w,h,1);
-   int x,y;
-   float rgb[3],grey[3];
+   KernelLuma luma = EscolheLinhaLuma(dcs);
+   int y;
+
+   /* uma imagem de luminancia passa pela mesma conta de um pixel RGB cinza,
+      luminance(v,v,v), que nao e' exatamente v */
+   #pragma omp parallel for
+   for (y=0;y<h;y++) {
+      const float* src = imgGetRowConst(image,y);
+      float* dst = img1->buf + (size_t)y*w;
+      int x;
+      if (dcs==1)
+         for (x=0;x<w;x++) dst[x] = luminance(src[x],src[x],src[x]);
+      else
+         luma(src, dst, w);
+   }
+   return img1;
+}
 
-   for (y=0;y<h;y++){
-      for (x=0;x<w;x++) {
-         imgGetPixel3fv(image,x,y,rgb);
-         grey[0]=luminance(rgb[0],rgb[1],rgb[2]);
-         grey[1]=grey[0];
-         grey[2]=grey[0];
-         imgSetPixel3fv(img1,x,y,grey);
+/* Tabela de pesos de um eixo: o elemento i da saida e' a soma de n[i] elementos da
+   entrada a partir de inicio[i], com os pesos pesos[i*max .. i*max+n[i]-1]. */
+typedef struct {
+   int*   inicio;
+   int*   n;
+   float* pesos;
+   int    max;
+} TabelaPesos;
+
+static float PesoFiltro(int filtro, float t)
+{
+   t = (float)fabs(t);
+   if (filtro==IMG_FILTRO_BILINEAR)
+      return (t<1.f) ? 1.f-t : 0.f;
+   /* bicubico de Keys com a=-0.5 */
+   if (t<1.f) return (1.5f*t-2.5f)*t*t+1.f;
+   if (t<2.f) return ((-0.5f*t+2.5f)*t-4.f)*t+2.f;
+   return 0.f;
+}
+
+/* Calcula os pesos para levar n0 amostras a n1. Na reducao o filtro e' alargado pela
+   escala, de modo que todas as amostras da entrada contribuem (sem aliasing). */
+static void CriaTabelaPesos(TabelaPesos* tab, int n0, int n1, int filtro)
+{
+   double escala = (double)n0/n1;
+   double largura = (escala>1.) ? escala : 1.;
+   double suporte;
+   int i, j;
+
+   switch (filtro) {
+      case IMG_FILTRO_VIZINHO:  suporte = 0.; break;
+      case IMG_FILTRO_BILINEAR: suporte = largura; break;
+      case IMG_FILTRO_BICUBICO: suporte = 2.*largura; break;
+      default:                  suporte = 0.5*escala+0.5; break;   /* area */
+   }
+   tab->max = (filtro==IMG_FILTRO_VIZINHO) ? 1 : (int)ceil(2.*suporte)+1;
+   tab->inicio = (int*)malloc(n1*sizeof(int));
+   tab->n = (int*)malloc(n1*sizeof(int));
+   tab->pesos = (float*)malloc((size_t)n1*tab->max*sizeof(float));
+   assert(tab->inicio && tab->n && tab->pesos);
+
+   for (i=0;i<n1;i++) {
+      double centro = (i+0.5)*escala;   /* em coordenadas da entrada */
+      float* p = tab->pesos + (size_t)i*tab->max;
+      int j0, j1;
+      double soma = 0.;
+
+      if (filtro==IMG_FILTRO_VIZINHO) {
+         j0 = (int)centro;
+         tab->inicio[i] = (j0<n0) ? j0 : n0-1;
+         tab->n[i] = 1;
+         p[0] = 1.f;
+         continue;
+      }
+
+      j0 = (int)floor(centro-suporte);
+      j1 = (int)ceil(centro+suporte);
+      if (j0<0) j0 = 0;
+      if (j1>n0) j1 = n0;
+      if (j1-j0>tab->max) j1 = j0+tab->max;
+
+      for (j=j0;j<j1;j++) {
+         double w;
+         if (filtro==IMG_FILTRO_AREA) {
+            /* comprimento da intersecao do pixel [j,j+1) com [centro-escala/2, centro+escala/2) */
+            double a = centro-0.5*escala, b = centro+0.5*escala;
+            if (a<j) a = j;
+            if (b>j+1) b = j+1;
+            w = (b>a) ? b-a : 0.;
+         } else
+            w = PesoFiltro(filtro, (float)((j+0.5-centro)/largura));
+         p[j-j0] = (float)w;
+         soma += w;
       }
+      /* as amostras fora da imagem sao descartadas e os pesos renormalizados */
+      if (soma!=0.)
+         for (j=j0;j<j1;j++) p[j-j0] = (float)(p[j-j0]/soma);
+      tab->inicio[i] = j0;
+      tab->n[i] = j1-j0;
    }
-   return img1;
 }
 
-Image* imgResize(Image* img0, int w1, int h1) 
+static void LiberaTabelaPesos(TabelaPesos* tab)
 {
-   Image* img1 = imgCreate(w1,h1,img0->dcs);
-   float w0 = (float) img0->width;  /* passa para float para fazer contas */
-   float h0 = (float) img0->height;
-
-   int x0,y0,x1,y1;
-   float color[3];
-
-   for (y1=0;y1<h1;y1++)
-      for (x1=0;x1<w1;x1++)
-      {
-         x0=ROUND(w0*x1/w1);   /* pega a cor do pixel mais proxima */
-         y0=ROUND(h0*y1/h1);
-         imgGetPixel3fv(img0,x0,y0,color);
-         imgGetPixel3fv(img1,x1,y1,color);
+   free(tab->inicio);
+   free(tab->n);
+   free(tab->pesos);
+}
+
+/* Intervalo [*a,*b) da entrada lido pelos elementos [i0,i1) da saida. */
+static void EntradaDaTabela(const TabelaPesos* tab, int i0, int i1, int* a, int* b)
+{
+   int i;
+   *a = tab->inicio[i0];
+   *b = *a;
+   for (i=i0;i<i1;i++)
+      if (tab->inicio[i]+tab->n[i]>*b) *b = tab->inicio[i]+tab->n[i];
+}
+
+/* Calcula o retangulo [x0,x1)x[y0,y1) de img1 a partir de img0 com as tabelas dos
+   dois eixos. Cada pixel sai com as mesmas operacoes, na mesma ordem, qualquer que
+   seja o retangulo. */
+static void Reamostra(Image* img0, Image* img1, const TabelaPesos* tx, const TabelaPesos* ty,
+                      int x0, int y0, int x1, int y1)
+{
+   int w0 = img0->width, w1 = img1->width, dcs = img0->dcs;
+   int a, b, y;
+
+   if (x0>=x1 || y0>=y1) return;
+   EntradaDaTabela(tx, x0, x1, &a, &b);
+
+   /* cada linha da saida: combina as linhas da entrada (passada vertical, laco continuo
+      sobre as colunas lidas) e depois reamostra a linha combinada na horizontal */
+#pragma omp parallel
+   {
+      int nl = (b-a)*dcs;
+      float* linha = (float*)malloc((size_t)nl*sizeof(float));
+      assert(linha);
+
+#pragma omp for schedule(static)
+      for (y=y0;y<y1;y++) {
+         const float* py = ty->pesos + (size_t)y*ty->max;
+         float* dst = img1->buf + (size_t)y*w1*dcs;
+         int t, n, x, c;
+
+         if (ty->n[y]==1 && py[0]==1.f)
+            memcpy(linha, img0->buf + ((size_t)ty->inicio[y]*w0 + a)*dcs, (size_t)nl*sizeof(float));
+         else {
+            memset(linha, 0, (size_t)nl*sizeof(float));
+            for (t=0;t<ty->n[y];t++) {
+               const float* src = img0->buf + ((size_t)(ty->inicio[y]+t)*w0 + a)*dcs;
+               float p = py[t];
+#pragma omp simd
+               for (n=0;n<nl;n++) linha[n] += p*src[n];
+            }
+         }
+
+         for (x=x0;x<x1;x++) {
+            const float* px = tx->pesos + (size_t)x*tx->max;
+            const float* src = linha + (size_t)(tx->inicio[x]-a)*dcs;
+            for (c=0;c<dcs;c++) {
+               float soma = 0.f;
+               for (t=0;t<tx->n[x];t++) soma += px[t]*src[t*dcs+c];
+               dst[x*dcs+c] = soma;
+            }
+         }
       }
-      return img1;
+      free(linha);
+   }
+   img1->stats_ok = 0;
+}
+
+Image* imgResize(Image* img0, int w1, int h1, int filtro)
+{
+   Image* img1 = imgCreate(w1,h1,img0->dcs);
+   TabelaPesos tx, ty;
+
+   CriaTabelaPesos(&tx, img0->width, w1, filtro);
+   CriaTabelaPesos(&ty, img0->height, h1, filtro);
+   Reamostra(img0, img1, &tx, &ty, 0, 0, w1, h1);
+   LiberaTabelaPesos(&tx);
+   LiberaTabelaPesos(&ty);
+   return img1;
 }
 
 Image* imgAdjust2eN(Image*img0)
 {
    Image* img1;
-   int i=0,valid[14]={1,2,4,8,16,32,64,128,512,1024,2048,4096,8192,16384};
    int w0=img0->width;
    int h0=img0->height;
-   int w1,h1;
-   int x,y;
-   float rgb[3],black[3]={0.f,0.f,0.f};
+   int dcs=img0->dcs;
+   int w1=1,h1=1;
+   int y;
 
-   for (i=0;i<14&&valid[i]<w0;i++);
-   w1=valid[i];
+   while (w1<w0) w1*=2;
+   while (h1<h0) h1*=2;
 
-   for (i=0;i<14&&valid[i]<h0;i++);
-   h1=valid[i];
+   /* a imagem nova ja' vem preta (imgCreate zera o buffer): copia apenas as linhas */
+   img1=imgCreate(w1,h1,dcs);
+   for (y=0;y<h0;y++)
+      memcpy(img1->buf+(size_t)y*w1*dcs, img0->buf+(size_t)y*w0*dcs, (size_t)w0*dcs*sizeof(float));
 
-   img1=imgCreate(w1,h1, img0->dcs);
+   return img1;
+}
 
-   for (y=0;y<h1;y++){
-      for (x=0;x<w1;x++) {
-         if (x<w0&&y<h0) {
-            imgGetPixel3fv(img0,x,y,rgb);
-            imgSetPixel3fv(img1,x,y,rgb);
-         }
-         else
-            imgSetPixel3fv(img1,x,y,black);
+/*- Piramide de imagens ----------------------------------------------------*/
+
+struct Pyramid_imp {
+   int          niveis;
+   Image**      img;      /* img[0] e' a imagem original */
+   TabelaPesos* tx;       /* tx[i], ty[i]: reducao do nivel i-1 para o nivel i */
+   TabelaPesos* ty;
+};
+
+Pyramid* pyrCreate(Image* image, int filtro)
+{
+   Pyramid* pyr = (Pyramid*)malloc(sizeof(Pyramid));
+   int w = image->width, h = image->height, n = 1, i;
+
+   while (w>1 || h>1) { w = (w+1)/2; h = (h+1)/2; n++; }
+
+   assert(pyr);
+   pyr->niveis = n;
+   pyr->img = (Image**)malloc(n*sizeof(Image*));
+   pyr->tx = (TabelaPesos*)malloc(n*sizeof(TabelaPesos));
+   pyr->ty = (TabelaPesos*)malloc(n*sizeof(TabelaPesos));
+   assert(pyr->img && pyr->tx && pyr->ty);
+   pyr->img[0] = image;
+
+   /* a reducao 2:1 por area e' a media dos blocos 2x2; a bilinear alargada pela
+      escala tem pesos 1 3 3 1 (/8), uma aproximacao da gaussiana. As tabelas ficam
+      na piramide para pyrUpdateRect. */
+   for (i=1;i<n;i++) {
+      Image* ant = pyr->img[i-1];
+      int wi = (ant->width+1)/2, hi = (ant->height+1)/2;
+      int f = (filtro==IMG_PIRAMIDE_GAUSS) ? IMG_FILTRO_BILINEAR : IMG_FILTRO_AREA;
+
+      CriaTabelaPesos(&pyr->tx[i], ant->width, wi, f);
+      CriaTabelaPesos(&pyr->ty[i], ant->height, hi, f);
+      pyr->img[i] = imgCreate(wi, hi, ant->dcs);
+      Reamostra(ant, pyr->img[i], &pyr->tx[i], &pyr->ty[i], 0, 0, wi, hi);
+   }
+   return pyr;
+}
+
+void pyrDestroy(Pyramid* pyr)
+{
+   int i;
+   if (!pyr) return;
+   for (i=1;i<pyr->niveis;i++) {
+      imgDestroy(pyr->img[i]);
+      LiberaTabelaPesos(&pyr->tx[i]);
+      LiberaTabelaPesos(&pyr->ty[i]);
+   }
+   free(pyr->img);
+   free(pyr->tx);
+   free(pyr->ty);
+   free(pyr);
+}
+
+/* Intervalo [*i0,*i1) da saida que le algum elemento de [a,b) da entrada. */
+static void SaidaDaTabela(const TabelaPesos* tab, int n1, int a, int b, int* i0, int* i1)
+{
+   int i;
+   *i0 = n1;
+   *i1 = 0;
+   for (i=0;i<n1;i++)
+      if (tab->inicio[i]<b && tab->inicio[i]+tab->n[i]>a) {
+         if (i<*i0) *i0 = i;
+         *i1 = i+1;
       }
+}
+
+void pyrUpdateRect(Pyramid* pyr, int x, int y, int w, int h)
+{
+   int x1 = x+w, y1 = y+h, i;
+
+   for (i=1;i<pyr->niveis;i++) {
+      Image* nivel = pyr->img[i];
+      if (x<0) x = 0;
+      if (y<0) y = 0;
+      if (x1>pyr->img[i-1]->width) x1 = pyr->img[i-1]->width;
+      if (y1>pyr->img[i-1]->height) y1 = pyr->img[i-1]->height;
+      if (x>=x1 || y>=y1) return;
+
+      SaidaDaTabela(&pyr->tx[i], nivel->width, x, x1, &x, &x1);
+      SaidaDaTabela(&pyr->ty[i], nivel->height, y, y1, &y, &y1);
+      Reamostra(pyr->img[i-1], nivel, &pyr->tx[i], &pyr->ty[i], x, y, x1, y1);
    }
+}
 
-   return img1;
+int pyrGetLevels(Pyramid* pyr)
+{
+   return pyr->niveis;
+}
+
+Image* pyrGetLevel(Pyramid* pyr, int nivel)
+{
+   if (nivel<0) nivel = 0;
+   if (nivel>=pyr->niveis) nivel = pyr->niveis-1;
+   return pyr->img[nivel];
+}
+
+int pyrLevelForScale(Pyramid* pyr, float escala)
+{
+   int nivel = 0;
+
+   /* o nivel k tem escala 2^-k; desce enquanto o proximo ainda cobre a tela */
+   while (nivel+1<pyr->niveis && escala>0.f && escala*(1<<(nivel+1))<=1.f)
+      nivel++;
+   return nivel;
+}
+
+Image* pyrGetCoarse(Pyramid* pyr, int maxPixels)
+{
+   int nivel = 0;
+
+   while (nivel+1<pyr->niveis &&
+          (long)pyr->img[nivel]->width*pyr->img[nivel]->height > maxPixels)
+      nivel++;
+   return pyr->img[nivel];
 }
 
 float imgDif(Image*img0, Image*img1, float gamma)
 {
    int w = imgGetWidth(img0);
    int h = imgGetHeight(img0);
+   int dcs0 = imgGetDimColorSpace(img0);
+   int dcs1 = imgGetDimColorSpace(img1);
    int x,y;
-   float rgb[3],rgb0[3],rgb1[3],avg=0.f,tot=0.f;
+   float rgb[3],rgb0[3],rgb1[3];
+   double avg=0.0,tot=0.0;  /* em float a soma perde precisao em imagens grandes */
 
    for (y=0;y<h;y++){
+      float* row0 = imgGetRow(img0,y);
+      const float* row1 = imgGetRowConst(img1,y);
       for (x=0;x<w;x++) {
             float lum,new_lum,ratio;
          
-            imgGetPixel3fv(img0,x,y,rgb0);
-            imgGetPixel3fv(img1,x,y,rgb1);
+            imgRowGet3fv(row0,dcs0,x,rgb0);
+            imgRowGet3fv(row1,dcs1,x,rgb1);
 
             /* calcula o modulo da diferenca */
             rgb[0]=(rgb1[0]>rgb0[0])? rgb1[0]-rgb0[0] : rgb0[0]-rgb1[0] ;
@@ -381,24 +824,29 @@ float imgDif(Image*img0, Image*img1, float gamma)
             ratio = new_lum/lum;
             rgb[0]*=ratio; rgb[1]*=ratio; rgb[2]*=ratio;
 
-            imgSetPixel3fv(img0,x,y,rgb);
+            imgRowSet3fv(row0,dcs0,x,rgb);
       }
    }
     avg=100*avg/tot;
-    return avg;
+    return (float)avg;
 }
 
 float imgErr(Image*img0, Image*img1)
 {
    int w = imgGetWidth(img0);
    int h = imgGetHeight(img0);
+   int dcs0 = imgGetDimColorSpace(img0);
+   int dcs1 = imgGetDimColorSpace(img1);
    int x,y;
-   float rgb0[3],rgb1[3],delta_rgb[3],avg=0.f,tot=0.f;
+   float rgb0[3],rgb1[3],delta_rgb[3];
+   double avg=0.0,tot=0.0;
 
    for (y=0;y<h;y++){
+      const float* row0 = imgGetRowConst(img0,y);
+      const float* row1 = imgGetRowConst(img1,y);
       for (x=0;x<w;x++) {
-            imgGetPixel3fv(img0,x,y,rgb0);
-            imgGetPixel3fv(img1,x,y,rgb1);
+            imgRowGet3fv(row0,dcs0,x,rgb0);
+            imgRowGet3fv(row1,dcs1,x,rgb1);
 
             /* calcula o modulo da diferenca */
             delta_rgb[0]=(rgb1[0]>rgb0[0])? rgb1[0]-rgb0[0] : rgb0[0]-rgb1[0] ;
@@ -411,7 +859,184 @@ float imgErr(Image*img0, Image*img1)
       }
    }
    avg=avg/tot;
-   return 100*avg;
+   return (float)(100*avg);
+}
+
+
+/*- Metricas de comparacao ----------------------------------------------*/
+
+#define SSIM_JANELA 8              /* lado das janelas do SSIM           */
+#define SSIM_PASSO  4              /* distancia entre janelas vizinhas   */
+#define SSIM_C1     (0.01*0.01)    /* constantes para valores em [0,1]   */
+#define SSIM_C2     (0.03*0.03)
+
+/* soma em pares: o erro cresce com log(n) em vez de n */
+static double SomaPares(const double* v, int n)
+{
+    double s = 0.0;
+    int i;
+
+    if (n > 8)
+        return SomaPares(v, n/2) + SomaPares(v+n/2, n-n/2);
+    for (i=0;i<n;i++) s += v[i];
+    return s;
+}
+
+/* soma |a-b| e (a-b)^2 de n componentes, opcionalmente guardando |a-b| em d;
+   devolve o maior |a-b| */
+static float ErroLinha(const float* a, const float* b, float* d, int n, double* soma, double* soma2)
+{
+    double s1 = 0.0, s2 = 0.0;
+    float emax = 0.f;
+    int i = 0;
+
+#ifdef __SSE2__
+    {
+        const __m128 mascara = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 vmax = _mm_setzero_ps();
+        __m128d v1 = _mm_setzero_pd(), v2 = _mm_setzero_pd();
+        double t[2];
+        float m[4];
+
+        for (; i+4<=n; i+=4) {
+            __m128 e = _mm_and_ps(_mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)), mascara);
+            __m128d lo = _mm_cvtps_pd(e);
+            __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(e, e));
+            if (d) _mm_storeu_ps(d+i, e);
+            vmax = _mm_max_ps(vmax, e);
+            v1 = _mm_add_pd(v1, _mm_add_pd(lo, hi));
+            v2 = _mm_add_pd(v2, _mm_add_pd(_mm_mul_pd(lo, lo), _mm_mul_pd(hi, hi)));
+        }
+        _mm_storeu_pd(t, v1); s1 = t[0] + t[1];
+        _mm_storeu_pd(t, v2); s2 = t[0] + t[1];
+        _mm_storeu_ps(m, vmax);
+        emax = m[0];
+        for (i=1; i<4; i++) if (m[i] > emax) emax = m[i];
+        i = n & ~3;
+    }
+#endif
+    for (; i<n; i++) {
+        float e = (float)fabs(a[i]-b[i]);
+        if (d) d[i] = e;
+        s1 += e;
+        s2 += (double)e*e;
+        if (e > emax) emax = e;
+    }
+    *soma = s1;
+    *soma2 = s2;
+    return emax;
+}
+
+/* SSIM somado sobre as janelas de uma faixa de linhas: lum0 e lum1 tem jh linhas de
+   w pixels; col recebe as somas de x, y, x^2, y^2 e xy de cada coluna (5*w doubles),
+   reaproveitadas pelas janelas que se sobrepoem */
+static double SsimFaixa(const float* lum0, const float* lum1, int w, int jh, double* col, int* njanelas)
+{
+    int jw = w < SSIM_JANELA ? w : SSIM_JANELA;
+    double *cx = col, *cy = col+w, *cxx = col+2*w, *cyy = col+3*w, *cxy = col+4*w;
+    double soma = 0.0;
+    int x, i, j, n = 0;
+
+    memset(col, 0, 5*(size_t)w*sizeof(double));
+    for (j=0;j<jh;j++) {
+        const float* a = lum0 + (size_t)j*w;
+        const float* b = lum1 + (size_t)j*w;
+        for (i=0;i<w;i++) {
+            cx[i]  += a[i];
+            cy[i]  += b[i];
+            cxx[i] += (double)a[i]*a[i];
+            cyy[i] += (double)b[i]*b[i];
+            cxy[i] += (double)a[i]*b[i];
+        }
+    }
+
+    for (x=0; x+jw<=w; x+=SSIM_PASSO) {
+        double sx=0, sy=0, sxx=0, syy=0, sxy=0, np = (double)jw*jh;
+        double mx, my, vx, vy, cov;
+
+        for (i=x;i<x+jw;i++) {
+            sx  += cx[i];
+            sy  += cy[i];
+            sxx += cxx[i];
+            syy += cyy[i];
+            sxy += cxy[i];
+        }
+        mx = sx/np; my = sy/np;
+        vx = sxx/np - mx*mx;
+        vy = syy/np - my*my;
+        cov = sxy/np - mx*my;
+        soma += ((2*mx*my + SSIM_C1)*(2*cov + SSIM_C2)) /
+                ((mx*mx + my*my + SSIM_C1)*(vx + vy + SSIM_C2));
+        n++;
+        if (jw==w) break;
+    }
+    *njanelas = n;
+    return soma;
+}
+
+int imgCompare(Image* img0, Image* img1, ImageMetrics* m, Image* diff)
+{
+    int w = img0->width, h = img0->height, dcs = img0->dcs;
+    int jh = h < SSIM_JANELA ? h : SSIM_JANELA;
+    int nfaixas = (h - jh)/SSIM_PASSO + 1;
+    double *soma, *soma2, *emax, *ssim;
+    int *njanelas, y, ntot = 0;
+    double n = (double)w*h*dcs;
+
+    if (img1->width!=w || img1->height!=h || img1->dcs!=dcs ||
+        (diff && (diff->width!=w || diff->height!=h || diff->dcs!=dcs))) {
+        fprintf(stderr, "imgCompare: imagens de tamanhos ou espacos de cor diferentes\n");
+        return 0;
+    }
+    if (diff) diff->stats_ok = 0;
+
+    soma  = (double*)malloc((3*h + nfaixas)*sizeof(double));
+    soma2 = soma + h;
+    emax  = soma2 + h;
+    ssim  = emax + h;
+    njanelas = (int*)malloc(nfaixas*sizeof(int));
+    assert(soma && njanelas);
+
+    #pragma omp parallel
+    {
+        float* lum = (float*)malloc(2*(size_t)w*jh*sizeof(float));
+        double* col = (double*)malloc(5*(size_t)w*sizeof(double));
+        int f, j;
+        assert(lum && col);
+
+        #pragma omp for schedule(static)
+        for (y=0;y<h;y++) {
+            size_t pos = (size_t)y*w*dcs;
+            emax[y] = ErroLinha(img0->buf+pos, img1->buf+pos, diff ? diff->buf+pos : NULL,
+                                w*dcs, &soma[y], &soma2[y]);
+        }
+
+        /* cada faixa de SSIM_JANELA linhas, a cada SSIM_PASSO linhas */
+        #pragma omp for schedule(dynamic)
+        for (f=0;f<nfaixas;f++) {
+            for (j=0;j<jh;j++) {
+                LinhaLuminancia(img0, f*SSIM_PASSO+j, lum + (size_t)j*w);
+                LinhaLuminancia(img1, f*SSIM_PASSO+j, lum + (size_t)(jh+j)*w);
+            }
+            ssim[f] = SsimFaixa(lum, lum + (size_t)jh*w, w, jh, col, &njanelas[f]);
+        }
+        free(col);
+        free(lum);
+    }
+
+    m->mae = SomaPares(soma, h)/n;
+    m->mse = SomaPares(soma2, h)/n;
+    m->psnr = m->mse > 0 ? 10*log10(1/m->mse) : HUGE_VAL;
+    m->max_err = 0;
+    for (y=0;y<h;y++) {
+        if (emax[y] > m->max_err) m->max_err = emax[y];
+    }
+    for (y=0;y<nfaixas;y++) ntot += njanelas[y];
+    m->ssim = ntot ? SomaPares(ssim, nfaixas)/ntot : 1.0;
+
+    free(njanelas);
+    free(soma);
+    return 1;
 }
 
 int imgGetWidth(Image* image)
@@ -431,12 +1056,32 @@ int imgGetDimColorSpace(Image* image)
 
 float* imgGetData(Image* image)
 {
+   /* o chamador pode escrever no buffer */
+   image->stats_ok = 0;
    return image->buf;
 }
 
+float* imgGetRow(Image* image, int y)
+{
+   /* o chamador pode escrever na linha */
+   image->stats_ok = 0;
+   return image->buf + (size_t)y*image->width*image->dcs;
+}
+
+const float* imgGetRowConst(Image* image, int y)
+{
+   return image->buf + (size_t)y*image->width*image->dcs;
+}
+
+int imgGetStride(Image* image)
+{
+   return image->width*image->dcs;
+}
+
 void imgSetPixel3fv(Image* image, int x, int y, float*  color)
 {
    int pos = (y*image->width*image->dcs) + (x*image->dcs);
+   image->stats_ok = 0;
    switch (image->dcs) {
       case 3:
          image->buf[pos  ] = color[0];
@@ -454,6 +1099,7 @@ void imgSetPixel3fv(Image* image, int x, int y, float*  color)
 void imgSetPixel3f(Image* image, int x, int y, float R, float G, float B)
 {
    int pos = (y*image->width*image->dcs) + (x*image->dcs);
+   image->stats_ok = 0;
    switch (image->dcs) {
       case 3:
          image->buf[pos  ] = R;
@@ -510,6 +1156,7 @@ void imgGetPixel3f(Image* image, int x, int y, float* R, float* G, float* B)
 void imgSetPixel3ubv(Image* image, int x, int y, unsigned char * color)
 {
    int pos = (y*image->width*image->dcs) + (x*image->dcs);
+   image->stats_ok = 0;
    switch (image->dcs) {
       case 3:
          image->buf[pos  ] = (float)(color[0]/255.);
@@ -564,6 +1211,7 @@ Image* imgReadTGA(char *filename)
 
    unsigned char ucharSkip;      /* dado lixo unsigned char */
    short int     sintSkip;       /* dado lixo short int */
+   TRC_INICIO(t);
 
    /* abre o arquivo com a imagem TGA */
    filePtr = fopen(filename, "rb");
@@ -571,10 +1219,10 @@ Image* imgReadTGA(char *filename)
 
    /* pula os primeiros dois bytes que devem ter valor zero */
    ucharSkip = getc(filePtr); /* tamanho do descritor da imagem (0) */
-   if (ucharSkip != 0) printf("erro na leitura de %s: imagem com descritor\n", filename);
+   if (ucharSkip != 0) fprintf(stderr, "erro na leitura de %s: imagem com descritor\n", filename);
 
    ucharSkip = getc(filePtr); 
-   if (ucharSkip != 0) printf("erro na leitura de %s: imagem com tabela de cores\n", filename);
+   if (ucharSkip != 0) fprintf(stderr, "erro na leitura de %s: imagem com tabela de cores\n", filename);
 
    /* le o tipo de imagem (que deve ser obrigatoriamente 2).  
    nao estamos tratando dos outros tipos */
@@ -599,6 +1247,7 @@ Image* imgReadTGA(char *filename)
 
    /* read 1 byte of garbage data */
    ucharSkip = getc(filePtr); 
+   TRC_FIM(t, "tga.cabecalho");
 
    /* cria uma instancia do tipo Imagem */
    image = imgCreate(imageWidth,imageHeight,3);
@@ -607,19 +1256,24 @@ Image* imgReadTGA(char *filename)
    assert(buffer);
 
    /* read in image data */
+   TRC_REINICIA(t);
    fread(buffer, sizeof(unsigned char), 3*imageWidth*imageHeight, filePtr);
+   TRC_FIM(t, "tga.leitura");
 
    /* copia e troca as compontes de BGR para RGB */
+   TRC_REINICIA(t);
    for (y=0;y<imageHeight;y++) {
+      float* row = imgGetRow(image,y);
       for (x=0;x<imageWidth;x++) {
          unsigned char color[3];
          int pos = (y*imageWidth*3) + (x*3);
          color[0] = buffer[pos+2];
          color[1] = buffer[pos+1];
          color[2] = buffer[pos  ];
-         imgSetPixel3ubv(image,x,y,color);
+         imgRowSet3ubv(row,3,x,color);
       }
    }
+   TRC_FIM(t, "tga.conversao");
    free(buffer);
    fclose(filePtr);
    return image;
@@ -636,6 +1290,7 @@ int imgWriteTGA(char *filename, Image* image)
 
    unsigned char byteZero=0;      /* usado para escrever um byte zero no arquivo      */
    short int     shortZero=0;     /* usado para escrever um short int zero no arquivo */
+   TRC_INICIO(t);
 
    if (!image) return 0;
 
@@ -649,15 +1304,18 @@ int imgWriteTGA(char *filename, Image* image)
 
    /* copia e troca as compontes de BGR para RGB */
    for (y=0;y<image->height;y++) {
+      const float* row = imgGetRowConst(image,y);
       for (x=0;x<image->width;x++) {
          unsigned char color[3];
          int pos = (y*image->width*3) + (x*3);
-         imgGetPixel3ubv(image,x,y,color);
+         imgRowGet3ubv(row,image->dcs,x,color);
          buffer[pos+2] = color[0];
          buffer[pos+1] = color[1];
          buffer[pos  ] = color[2];
       }
    }
+   TRC_FIM(t, "tga.conversao");
+   TRC_REINICIA(t);
 
    /* escreve o cabecalho */
    putc(byteZero,filePtr);          /* 0, no. de caracteres no campo de id da imagem     */
@@ -678,6 +1336,7 @@ int imgWriteTGA(char *filename, Image* image)
 
    free(buffer);
    fclose(filePtr);
+   TRC_FIM(t, "tga.escrita");
    return 1;
 }
 
@@ -690,15 +1349,12 @@ typedef long int LONG;
 typedef unsigned long int DWORD;
 
 
-Image* imgReadBMP(char *filename)
+/* abre um BMP de 24 bits e le os cabecalhos, deixando o arquivo posicionado no inicio dos pixels */
+static FILE* getBMPHeader(char *filename, LONG *biWidth, LONG *biHeight)
 {
    FILE  *filePtr;            /* ponteiro do arquivo */
-   Image*image;            /* imagem a ser criada */
-   BYTE *linedata;
 
    USHORT  bfType;             /* "BM" = 19788           */
-   LONG    biWidth;            /* image width in pixels  */
-   LONG    biHeight;           /* image height in pixels */
    WORD    biBitCount;         /* bitmap color depth     */
    DWORD   bfSize;
 
@@ -707,8 +1363,6 @@ Image* imgReadBMP(char *filename)
    LONG    longSkip;         /* dado lixo LONG   */
    WORD    wordSkip;         /* dado lixo WORD   */
 
-   LONG i, j, k, l, linesize, got;
-
    /* abre o arquivo com a imagem BMP */
    filePtr = fopen(filename, "rb");
    assert(filePtr);
@@ -733,8 +1387,8 @@ Image* imgReadBMP(char *filename)
    assert(dwordSkip == 40);
 
    /* pega largura e altura da imagem */
-   getlong(filePtr, &biWidth);
-   getlong(filePtr, &biHeight);
+   getlong(filePtr, biWidth);
+   getlong(filePtr, biHeight);
 
    /* verifica que o numero de quadros eh igual a 1 */
    getword(filePtr, &wordSkip);
@@ -746,7 +1400,7 @@ Image* imgReadBMP(char *filename)
    {
       fprintf(stderr, "imgReadBMP: Not a bitmap 24 bits file.\n");      
       fclose(filePtr);
-      return (NULL);
+      return NULL;
    }
 
    /* pula os demais bytes do infoheader */
@@ -758,7 +1412,28 @@ Image* imgReadBMP(char *filename)
    getdword(filePtr, &dwordSkip);
    getdword(filePtr, &dwordSkip);
 
+   return filePtr;
+}
+
+Image* imgReadBMP(char *filename)
+{
+   FILE  *filePtr;            /* ponteiro do arquivo */
+   Image*image;            /* imagem a ser criada */
+   BYTE *linedata;
+
+   LONG    biWidth;            /* image width in pixels  */
+   LONG    biHeight;           /* image height in pixels */
+
+   LONG i, j, k, l, linesize, got;
+   TRC_INICIO(t);
+
+   filePtr = getBMPHeader(filename, &biWidth, &biHeight);
+   TRC_FIM(t, "bmp.cabecalho");
+   if (!filePtr) return NULL;
+
+   TRC_REINICIA(t);
    image = imgCreate(biWidth, biHeight,3);
+   TRC_FIM(t, "bmp.alocacao");
 
    /* a linha deve terminar em uma fronteira de dword */
    linesize = 3*image->width;
@@ -775,6 +1450,7 @@ Image* imgReadBMP(char *filename)
    }
 
    /* pega as componentes de cada pixel */
+   TRC_REINICIA(t);
    for (k=0, i=0; i<image->height; i++) {
       got = (unsigned long int)fread(linedata, linesize, 1, filePtr);
       if (got != 1) {
@@ -787,38 +1463,23 @@ Image* imgReadBMP(char *filename)
          image->buf[k++] = (float)(linedata[l-1]/255.);
       }
    }
+   TRC_FIM(t, "bmp.pixels");
+   TRC_CONTA("bmp.bytes", (double)linesize*image->height);
 
    free(linedata);
    fclose(filePtr);
    return image;
 }
 
-int imgWriteBMP(char *filename, Image* bmp)
+/* escreve os cabecalhos (FileHeader e InfoHeader) de um BMP de 24 bits */
+static void putBMPHeader(FILE *filePtr, int width, int height, int linesize)
 {
-   FILE          *filePtr;         /* ponteiro do arquivo */
-   unsigned char *filedata;
    DWORD bfSize;
-   int i, k, l;
-
-   int linesize, put;
-
-   if (!bmp) return 0;
-
-   /* cria um novo arquivo binario */
-   filePtr = fopen(filename, "wb");
-   assert(filePtr);
-
-   /* a linha deve terminar em uma double word boundary */
-   linesize = bmp->width * 3;
-   if (linesize & 3) {
-      linesize |= 3;
-      linesize ++;
-   }
 
    /* calcula o tamanho do arquivo em bytes */
    bfSize = 14 +                     /* file header size */
       40 +                     /* info header size */
-      bmp->height * linesize;       /* image data  size */
+      height * linesize;       /* image data  size */
 
    /* Preenche o cabealho -> FileHeader e InfoHeader */
    putuint(19778, filePtr);              /* type = "BM" = 19788                             */
@@ -828,8 +1489,8 @@ int imgWriteBMP(char *filename, Image* bmp)
    putdword(filePtr, 54);                /* bfOffBits -> offset in bits to data             */
 
    putdword(filePtr, 40);                /* biSize -> structure size in bytes                 */
-   putlong(filePtr, bmp->width);         /* biWidth -> image width in pixels                  */         
-   putlong(filePtr, bmp->height);        /* biHeight -> image height in pixels                */
+   putlong(filePtr, width);              /* biWidth -> image width in pixels                  */         
+   putlong(filePtr, height);             /* biHeight -> image height in pixels                */
    putword(filePtr, 1);                  /* biPlanes, must be 1                               */
    putword(filePtr, 24);                 /* biBitCount, 24 para 24 bits -> bitmap color depth */
    putdword(filePtr, 0);                 /* biCompression, compression type -> no compression */
@@ -838,6 +1499,32 @@ int imgWriteBMP(char *filename, Image* bmp)
    putlong(filePtr, 0);                  /* biYPelsPerMeter                                   */
    putdword(filePtr, 0);                 /* biClrUsed, numero de cores na palheta             */
    putdword(filePtr, 0);                 /* biClrImportant, 0 pq todas sao importantes        */
+}
+
+int imgWriteBMP(char *filename, Image* bmp)
+{
+   FILE          *filePtr;         /* ponteiro do arquivo */
+   unsigned char *filedata;
+   int i, k, l;
+
+   int linesize, put;
+   TRC_INICIO(t);
+
+   if (!bmp) return 0;
+
+   /* cria um novo arquivo binario */
+   filePtr = fopen(filename, "wb");
+   assert(filePtr);
+
+   /* a linha deve terminar em uma double word boundary */
+   linesize = bmp->width * 3;
+   if (linesize & 3) {
+      linesize |= 3;
+      linesize ++;
+   }
+
+   putBMPHeader(filePtr, bmp->width, bmp->height, linesize);
+   TRC_FIM(t, "bmp.cabecalho");
 
    /* aloca espacco para a area de trabalho */
    filedata = (unsigned char *) malloc(linesize);
@@ -847,14 +1534,16 @@ int imgWriteBMP(char *filename, Image* bmp)
    for (i=0; i<(linesize-(3*bmp->width)); i++) 
       filedata[linesize-1-i] = 0;
 
+   TRC_REINICIA(t);
    for (k=0; k<bmp->height;k++)
    {
+      const float* row = imgGetRowConst(bmp,k);
       l = 1;
       /* coloca as componentes BGR no buffer */    
       for (i=0; i<bmp->width; i++) {
          unsigned char color[3];
          int r,g,b;
-         imgGetPixel3ubv(bmp,i,k,color);
+         imgRowGet3ubv(row,bmp->dcs,i,color);
          r= color[0];
          g= color[1];
          b= color[2];
@@ -873,10 +1562,12 @@ int imgWriteBMP(char *filename, Image* bmp)
       }
    }
 
-   /* operacao executada com sucesso */
-   fprintf(stdout,"imgWriteBMP: %s successfuly generated\n",filename);
+   TRC_FIM(t, "bmp.pixels");
+
    free(filedata);
+   TRC_REINICIA(t);
    fclose(filePtr);
+   TRC_FIM(t, "bmp.fechamento");
    return 1;
 }
 
@@ -891,9 +1582,10 @@ Image* imgReadPFM(char *filename)
   int w,h;
 
   char line[256];
+  TRC_INICIO(t);
  
   fp = fopen(filename, "rb");
-  if (fp == NULL) {  printf("%s nao pode ser aberto\n",filename); return NULL;}
+  if (fp == NULL) {  fprintf(stderr,"%s nao pode ser aberto\n",filename); return NULL;}
 
   fgets(line,256,fp);
 
@@ -910,11 +1602,13 @@ Image* imgReadPFM(char *filename)
      fgets(line, 256, fp);
 
   fgetc(fp);
+  TRC_FIM(t, "pfm.cabecalho");
 
+  TRC_REINICIA(t);
   img = imgCreate(w,h,3);
   fread( img->buf, 3*w*h, sizeof(float), fp );
+  TRC_FIM(t, "pfm.pixels");
 
-   fprintf(stdout,"imgReadPFM: %s successfuly loaded\n",filename);
   fclose(fp);
   return img;
 }
@@ -925,9 +1619,10 @@ int imgWritePFM(char * filename, Image* img)
 {
   FILE * fp;
   float  scale=1.f;
+  TRC_INICIO(t);
  
   if ((fp = fopen(filename, "wb")) == NULL) {
-    printf("\nNo foi possivel abrir o arquivo %s\n",filename);
+    fprintf(stderr,"\nNo foi possivel abrir o arquivo %s\n",filename);
     return 0;
   }
 
@@ -936,8 +1631,8 @@ int imgWritePFM(char * filename, Image* img)
 
   fwrite( img->buf, 3*img->width*img->height, sizeof(float), fp );
 
-  fprintf(stdout,"imgWritePFM: %s successfuly created\n",filename);
   fclose(fp);
+  TRC_FIM(t, "pfm.escrita");
   return 1;
 }
 
@@ -983,10 +1678,32 @@ int imgCountColor(Image * img, float tol)
    int w = imgGetWidth(img);
    int h = imgGetHeight(img);
    int dcs = imgGetDimColorSpace(img);
-   float* buf=imgGetData(img);
-   int *vet=(int*) malloc(3*w*h*sizeof(int));
+   float* buf=img->buf;
+   int *vet;
    int i;
 
+   /* Em luminancia, a faixa de valores quantizados e' conhecida pelo minimo e
+    maximo do cache de estatisticas: basta marcar os valores presentes numa
+    tabela, sem ordenar */
+   if (dcs==1) {
+      const ImageStats* st = imgGetStats(img);
+      int qmin = (int)(st->grey_min/tol+0.5);
+      int qmax = (int)(st->grey_max/tol+0.5);
+      if (qmax-qmin < (1<<24)) {
+         unsigned char* presente = (unsigned char*) calloc(qmax-qmin+1,1);
+         assert(presente);
+         numCor = 0;
+         for (i=0;i<w*h;i++) {
+            int q = (int)(buf[i]/tol+0.5)-qmin;
+            numCor += !presente[q];
+            presente[q] = 1;
+         }
+         free(presente);
+         return numCor;
+      }
+   }
+
+   vet=(int*) malloc(3*w*h*sizeof(int));
 
    /* copia o buffer da imagem no vetor de floats fazendo 
     uma quantizacao para (1/tol) tons de cada componente de cor */
@@ -1027,709 +1744,3131 @@ int imgCountColor(Image * img, float tol)
 
 
 
-static float apply(float c[9], float v[9])
+/*- Operacoes pontuais descritas por expressoes ----------------------------*/
+
+/* A expressao e' compilada para um programa de pilha; o programa e' executado sobre
+   blocos de EXPR_BLOCO componentes consecutivas da imagem de saida, e cada instrucao
+   e' um laco simples sobre o bloco inteiro, que o compilador vetoriza. */
+#define EXPR_BLOCO   1024
+#define EXPR_PILHA   16
+#define EXPR_MAX_OPS 256
+
+enum {
+    OP_CONST, OP_K, OP_IMG, OP_LUMA,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_NEG,
+    OP_LT, OP_GT, OP_LE, OP_GE,
+    OP_MIN, OP_MAX, OP_POW, OP_ABS, OP_SQRT, OP_CLAMP, OP_SELECT
+};
+
+typedef struct {
+    int op;
+    int arg;       /* indice da imagem em OP_IMG e OP_LUMA, da constante em OP_K */
+    float valor;   /* OP_CONST */
+} ExprOp;
+
+typedef struct {
+    const char* s;      /* proximo caractere a ler */
+    int nimgs, nk;
+    ExprOp ops[EXPR_MAX_OPS];
+    int n;
+    int prof, prof_max; /* profundidade da pilha durante a compilacao */
+    int erro;
+} Expr;
+
+static void ExprEmite(Expr* e, int op, int arg, float valor, int consome)
 {
-    return c[0]*v[0]+c[1]*v[1]+c[2]*v[2]+c[3]*v[3]+c[4]*v[4]+c[5]*v[5]+c[6]*v[6]+c[7]*v[7]+c[8]*v[8];
+    if (e->n>=EXPR_MAX_OPS) { e->erro = 1; return; }
+    e->ops[e->n].op = op;
+    e->ops[e->n].arg = arg;
+    e->ops[e->n].valor = valor;
+    e->n++;
+    e->prof += 1-consome;
+    if (e->prof>e->prof_max) e->prof_max = e->prof;
 }
-static float applyV(float c[9], float v[3*9], float out[3])
+
+static void ExprEspacos(Expr* e)
 {
-    out[0]= c[0]*v[0*3  ]+c[1]*v[1*3  ]+c[2]*v[2*3  ]+c[3]*v[3*3  ]+c[4]*v[4*3  ]+c[5]*v[5*3  ]+c[6]*v[6*3  ]+c[7]*v[7*3  ]+c[8]*v[8*3  ];
-    out[0]= c[0]*v[0*3+1]+c[1]*v[1*3+1]+c[2]*v[2*3+1]+c[3]*v[3*3+1]+c[4]*v[4*3+1]+c[5]*v[5*3+1]+c[6]*v[6*3+1]+c[7]*v[7*3+1]+c[8]*v[8*3+1];
-    out[0]= c[0]*v[0*3+2]+c[1]*v[1*3+2]+c[2]*v[2*3+2]+c[3]*v[3*3+2]+c[4]*v[4*3+2]+c[5]*v[5*3+2]+c[6]*v[6*3+2]+c[7]*v[7*3+2]+c[8]*v[8*3+2];
+    while (*e->s==' ' || *e->s=='\t') e->s++;
 }
 
-static float gauss[9]={1.f/16, 2.f/16, 1.f/16,  2.f/16, 4.f/16, 2.f/16,  1.f/16, 2.f/16, 1.f/16 };
-static float sobel_x[9]={-1, 0, 1,  -2, 0, 2,  -1, 0, 1 };
-static float sobel_y[9]={1, 2, 1,  0, 0, 0,  -1, -2, -1 };
-
+static int ExprAceita(Expr* e, char c)
+{
+    ExprEspacos(e);
+    if (*e->s!=c) return 0;
+    e->s++;
+    return 1;
+}
 
-void imgGauss(Image* img_dst, Image* img_src) 
+static void ExprExige(Expr* e, char c)
 {
-    int w   = imgGetWidth(img_dst);
-    int h   = imgGetHeight(img_dst);
-    int dcs = imgGetDimColorSpace(img_dst);
+    if (!ExprAceita(e, c)) e->erro = 1;
+}
 
-    float* src_buffer = imgGetData(img_src);
-    float* dst_buffer = imgGetData(img_dst);
-    int x,y;
+static void ExprCompara(Expr* e);
 
+/* fator: numero, imagem (a..d), constante (k0..k9), funcao(...) ou (expressao) */
+static void ExprFator(Expr* e)
+{
+    static const struct { const char* nome; int op, nargs; } funcoes[] = {
+        {"min",OP_MIN,2}, {"max",OP_MAX,2}, {"pow",OP_POW,2}, {"abs",OP_ABS,1},
+        {"sqrt",OP_SQRT,1}, {"clamp",OP_CLAMP,3}, {"select",OP_SELECT,3}
+    };
+    char nome[16];
+    int len = 0, i;
+
+    ExprEspacos(e);
+    if (e->erro) return;
+
+    if (isdigit((unsigned char)*e->s) || *e->s=='.') {
+        char* fim;
+        float v = (float)strtod(e->s, &fim);
+        e->s = fim;
+        ExprEmite(e, OP_CONST, 0, v, 0);
+        return;
+    }
+    if (ExprAceita(e, '(')) {
+        ExprCompara(e);
+        ExprExige(e, ')');
+        return;
+    }
 
-    if (dcs==1) {
-        for (y=1;y<h-1;y++){
-            for (x=1;x<w-1;x++) {
-                int k = y*w+x;
-                float v[9] = {src_buffer[k+w-1], src_buffer[k+w],src_buffer[k+w+1],
-                    src_buffer[k-1],src_buffer[k],src_buffer[k+1],
-                    src_buffer[k-w-1],src_buffer[k-w],src_buffer[k-w+1]};
-                    dst_buffer[k] = apply(gauss,v);
-            }
-        }
-    } else {
-        for (y=1;y<h-1;y+=1){
-            for (x=1;x<w-1;x+=1) {
-                int k0 = y*w*3+x*3;
-                int k1 = k0+1;
-                int k2 = k0+2;
-                float r[9] = {src_buffer[k0+3*w-3],src_buffer[k0+3*w],src_buffer[k0+3*w+3],
-                    src_buffer[k0-3]    ,src_buffer[k0]    ,src_buffer[k0+3],
-                    src_buffer[k0-3*w-3],src_buffer[k0-3*w],src_buffer[k0-3*w+3]};
-                float g[9] = {src_buffer[k1+3*w-3],src_buffer[k1+3*w],src_buffer[k1+3*w+3],
-                    src_buffer[k1-3]    ,src_buffer[k1]    ,src_buffer[k1+3],
-                    src_buffer[k1-3*w-3],src_buffer[k1-3*w],src_buffer[k1-3*w+3]};
-                float b[9] = {src_buffer[k2+3*w-3],src_buffer[k2+3*w],src_buffer[k2+3*w+3],
-                    src_buffer[k2-3]    ,src_buffer[k2]    ,src_buffer[k2+3],
-                    src_buffer[k2-3*w-3],src_buffer[k2-3*w],src_buffer[k2-3*w+3]};
-
-                dst_buffer[k0] = apply(gauss,r);
-                dst_buffer[k1] = apply(gauss,g);
-                dst_buffer[k2] = apply(gauss,b);
-            }
+    while (isalnum((unsigned char)e->s[len]) && len<15) len++;
+    if (len==0) { e->erro = 1; return; }
+    memcpy(nome, e->s, len);
+    nome[len] = 0;
+    e->s += len;
+
+    if (len==1 && nome[0]>='a' && nome[0]-'a'<e->nimgs) {
+        ExprEmite(e, OP_IMG, nome[0]-'a', 0, 0);
+        return;
+    }
+    if (len==2 && nome[0]=='k' && isdigit((unsigned char)nome[1]) && nome[1]-'0'<e->nk) {
+        ExprEmite(e, OP_K, nome[1]-'0', 0, 0);
+        return;
+    }
+    if (!strcmp(nome, "luma")) {
+        /* luma(x): luminancia do pixel da imagem x, igual em todas as componentes */
+        ExprExige(e, '(');
+        ExprEspacos(e);
+        if (*e->s<'a' || *e->s-'a'>=e->nimgs) { e->erro = 1; return; }
+        ExprEmite(e, OP_LUMA, *e->s-'a', 0, 0);
+        e->s++;
+        ExprExige(e, ')');
+        return;
+    }
+    for (i=0;i<(int)(sizeof(funcoes)/sizeof(*funcoes));i++) {
+        int a;
+        if (strcmp(nome, funcoes[i].nome)) continue;
+        ExprExige(e, '(');
+        for (a=0;a<funcoes[i].nargs;a++) {
+            if (a>0) ExprExige(e, ',');
+            ExprCompara(e);
         }
+        ExprExige(e, ')');
+        ExprEmite(e, funcoes[i].op, 0, 0, funcoes[i].nargs);
+        return;
     }
+    e->erro = 1;
 }
 
+static void ExprUnario(Expr* e)
+{
+    if (ExprAceita(e, '-')) {
+        ExprUnario(e);
+        ExprEmite(e, OP_NEG, 0, 0, 1);
+    } else
+        ExprFator(e);
+}
 
-
-/*
-* The following routines have been built from knowledge gathered
-* around the Web. I am not aware of any copyright problem with
-* them, so use it as you want.
-* N. Devillard - 1998
-*/
-typedef float pixelvalue ;
-#define PIX_SORT(a,b) { if ((a)>(b)) PIX_SWAP((a),(b)); }
-#define PIX_SWAP(a,b) { pixelvalue temp=(a);(a)=(b);(b)=temp; }
-
-/*----------------------------------------------------------------------------
-Function : opt_med9()
-In : pointer to an array of 9 pixelvalues
-Out : a pixelvalue
-Job : optimized search of the median of 9 pixelvalues
-Notice : in theory, cannot go faster without assumptions on the
-signal.
-Formula from:
-XILINX XCELL magazine, vol. 23 by John L. Smith
-The input array is modified in the process
-The result array is guaranteed to contain the median
-value
-in middle position, but other elements are NOT sorted.
----------------------------------------------------------------------------*/
-static pixelvalue opt_med9(pixelvalue * p)
-{
-    PIX_SORT(p[1], p[2]) ; PIX_SORT(p[4], p[5]) ; PIX_SORT(p[7], p[8]) ;
-    PIX_SORT(p[0], p[1]) ; PIX_SORT(p[3], p[4]) ; PIX_SORT(p[6], p[7]) ;
-    PIX_SORT(p[1], p[2]) ; PIX_SORT(p[4], p[5]) ; PIX_SORT(p[7], p[8]) ;
-    PIX_SORT(p[0], p[3]) ; PIX_SORT(p[5], p[8]) ; PIX_SORT(p[4], p[7]) ;
-    PIX_SORT(p[3], p[6]) ; PIX_SORT(p[1], p[4]) ; PIX_SORT(p[2], p[5]) ;
-    PIX_SORT(p[4], p[7]) ; PIX_SORT(p[4], p[2]) ; PIX_SORT(p[6], p[4]) ;
-    PIX_SORT(p[4], p[2]) ; return(p[4]) ;
-}
-
-
-#undef PIX_SORT
-#undef PIX_SWAP
-
-
-void imgMedian(Image* image) 
+static void ExprProduto(Expr* e)
 {
-    int w = imgGetWidth(image);
-    int h = imgGetHeight(image);
-    int dcs = imgGetDimColorSpace(image);
-    Image* img = imgCopy(image);  
-    float* image_buf = imgGetData(image);
-    float* img_buf = imgGetData(img);
-    int x,y;
-
-    if (dcs==1) {
-        for (y=1;y<h-1;y++){
-            for (x=1;x<w-1;x++) {
-                int k = y*w+x;
-                float v[9] = {img_buf[k+w-1], img_buf[k+w],img_buf[k+w+1],
-                    img_buf[k-1],img_buf[k],img_buf[k+1],
-                    img_buf[k-w-1],img_buf[k-w],img_buf[k-w+1]};
-                image_buf[k]= opt_med9(v);
-            }
-        }
-    } else {
-        for (y=1;y<h-1;y+=1){
-            for (x=1;x<w-1;x+=1) {
-                int k0 = y*w*3+x*3;
-                int k1 = k0+1;
-                int k2 = k0+2;
-                float r[9] = {img_buf[k0+3*w-3],img_buf[k0+3*w],img_buf[k0+3*w+3],
-                    img_buf[k0-3]    ,img_buf[k0]    ,img_buf[k0+3],
-                    img_buf[k0-3*w-3],img_buf[k0-3*w],img_buf[k0-3*w+3]};
-                float g[9] = {img_buf[k1+3*w-3],img_buf[k1+3*w],img_buf[k1+3*w+3],
-                    img_buf[k1-3]    ,img_buf[k1]    ,img_buf[k1+3],
-                    img_buf[k1-3*w-3],img_buf[k1-3*w],img_buf[k1-3*w+3]};
-                float b[9] = {img_buf[k2+3*w-3],img_buf[k2+3*w],img_buf[k2+3*w+3],
-                    img_buf[k2-3]    ,img_buf[k2]    ,img_buf[k2+3],
-                    img_buf[k2-3*w-3],img_buf[k2-3*w],img_buf[k2-3*w+3]};
-                image_buf[k0] = opt_med9(r);
-                image_buf[k1] = opt_med9(g);
-                image_buf[k2] = opt_med9(b);
-            }
-        }
+    ExprUnario(e);
+    while (!e->erro) {
+        if (ExprAceita(e, '*'))      { ExprUnario(e); ExprEmite(e, OP_MUL, 0, 0, 2); }
+        else if (ExprAceita(e, '/')) { ExprUnario(e); ExprEmite(e, OP_DIV, 0, 0, 2); }
+        else break;
     }
-    imgDestroy(img);
 }
 
-Image* imgEdges(Image* imgIn)
+static void ExprSoma(Expr* e)
 {
-    int w = imgGetWidth(imgIn);
-    int h = imgGetHeight(imgIn);
-    int dcs = imgGetDimColorSpace(imgIn);
-    Image* imgOut = imgCreate(w,h,1);
-    int x,y;
-    Image* img;
-    float max=0,inv;
+    ExprProduto(e);
+    while (!e->erro) {
+        if (ExprAceita(e, '+'))      { ExprProduto(e); ExprEmite(e, OP_ADD, 0, 0, 2); }
+        else if (ExprAceita(e, '-')) { ExprProduto(e); ExprEmite(e, OP_SUB, 0, 0, 2); }
+        else break;
+    }
+}
 
-    float* imgOut_buf = imgGetData(imgOut);
+/* comparacoes valem 1 ou 0 */
+static void ExprCompara(Expr* e)
+{
+    ExprSoma(e);
+    while (!e->erro) {
+        int op;
+        if (ExprAceita(e, '<'))      op = ExprAceita(e, '=') ? OP_LE : OP_LT;
+        else if (ExprAceita(e, '>')) op = ExprAceita(e, '=') ? OP_GE : OP_GT;
+        else break;
+        ExprSoma(e);
+        ExprEmite(e, op, 0, 0, 2);
+    }
+}
 
-    float* img_buf;
-    if (dcs==1) 
-        img = imgIn;
-    else 
-        img = imgGrey(imgIn);
-    img_buf=imgGetData(img);
+/* Carrega em r as componentes [n0,n0+len) da saida (com dcs componentes por pixel)
+   lidas da imagem img: imagens de uma componente sao repetidas em todas as componentes. */
+static void ExprCarrega(float* r, Image* img, int luma, int dcs, long n0, int len)
+{
+    const float* buf = img->buf;
 
-    for (y=1;y<h-1;y++){
-        for (x=1;x<w-1;x++) {
-            int k = y*w+x;
-            float v[9] = {img_buf[k+w-1], img_buf[k+w],img_buf[k+w+1],
-                img_buf[k-1],img_buf[k],img_buf[k+1],
-                img_buf[k-w-1],img_buf[k-w],img_buf[k-w+1]};
-            float dx = apply(sobel_x,v);
-            float dy = apply(sobel_y,v);
-            float val = (float)sqrt(dx*dx+dy*dy);
-            max = (max>val)?max:val;
-            imgOut_buf[k] = val;
-        }
-    }
+    /* pixel e componente da posicao n0, avancados juntos (sem uma divisao por elemento) */
+    long p = n0/dcs;
+    int c = (int)(n0%dcs), j;
 
-    inv = (max==0)? 1.f : 1.f/max;
-    /* arruma a imagem */
-    for (y=0;y<h;y++) {
-        for (x=0;x<w;x++) {
-            int k=y*w+x;
-            if ((y==0)||(y==(h-1))||(x==0)||(x==(w-1))) /* borda */
-                imgOut_buf[x]=0.f;
-            else
-                imgOut_buf[x]/=inv;
+    if (luma && img->dcs==3) {
+        for (j=0;j<len;j++) {
+            const float* q = buf + p*3;
+            r[j] = luminance(q[0],q[1],q[2]);
+            if (++c==dcs) { c = 0; p++; }
+        }
+    } else if (img->dcs==dcs) {
+        memcpy(r, buf+n0, len*sizeof(float));
+    } else {
+        for (j=0;j<len;j++) {
+            r[j] = buf[p];
+            if (++c==dcs) { c = 0; p++; }
         }
     }
-    return imgOut;
 }
 
-/* implementacao da reducao de cores por median cut */
-typedef struct
+/* Compila a expressao para nimgs imagens e nk constantes; devolve 0 (e avisa) se ela
+   for invalida. */
+static int ExprCompila(Expr* e, const char* expr, int nimgs, int nk)
 {
-    float r, g, b;
-} color;
+    assert(nimgs>0 && nimgs<=26 && nk<=10);
+    memset(e, 0, sizeof(Expr));
+    e->s = expr;
+    e->nimgs = nimgs;
+    e->nk = nk;
+    ExprCompara(e);
+    ExprEspacos(e);
+    if (e->erro || *e->s || e->prof_max>EXPR_PILHA) {
+        fprintf(stderr, "imgPointOp: expressao invalida perto de \"%s\"\n", e->s);
+        return 0;
+    }
+    return 1;
+}
 
-typedef struct
+/* Confere que as imagens tem o mesmo tamanho; em *dcs fica o numero de componentes
+   do resultado. */
+static int ExprDcs(Image** imgs, int nimgs, int* dcs)
 {
-    color max;     /* maximos R's, G's e B's */
-    color min;	   /* minimos R's, G's e B's */
-    float var;	   /* variacao em cada cubo  */
-    int ini;	   /* final do cubo  */
-    int fim;       /* inicio do cubo */
-    int maiorDim;  /* R=0, G=1, B=2  */
-    int checked;
-} colorCube;
+    int i;
 
-static int comparaR(const void * p1, const void * p2)
-{
-    color *color1 = (color *) p1;
-    color *color2 = (color *) p2;
+    *dcs = 1;
+    for (i=0;i<nimgs;i++) {
+        if (imgs[i]->width!=imgs[0]->width || imgs[i]->height!=imgs[0]->height) {
+            fprintf(stderr, "imgPointOp: imagens de tamanhos diferentes\n");
+            return 0;
+        }
+        if (imgs[i]->dcs>*dcs) *dcs = imgs[i]->dcs;
+    }
+    return 1;
+}
 
-    color c1 = *color1;
-    color c2 = *color2;
+/* laco de uma instrucao sobre o bloco; os operandos sao blocos distintos da pilha */
+#define EXPR_LACO _Pragma("omp simd") for (j=0;j<len;j++)
 
-    if (c1.r < c2.r) return -1;
-    if (c1.r > c2.r) return  1;
+/* Executa o programa sobre as componentes [n0,n0+len) da saida, len <= EXPR_BLOCO;
+   pilha tem prof_max*EXPR_BLOCO floats e k os valores de k0, k1, ... */
+static void ExprExecuta(const Expr* e, Image** imgs, const float* k, int dcs, float* out, long n0, int len, float* pilha)
+{
+    float *x, *y, *z, cte;
+    int topo = 0, o, j;
+
+    for (o=0;o<e->n;o++) {
+        const ExprOp* op = &e->ops[o];
+        switch (op->op) {
+        case OP_CONST:
+        case OP_K:
+            x = pilha + (topo++)*EXPR_BLOCO;
+            cte = (op->op==OP_K) ? k[op->arg] : op->valor;
+            EXPR_LACO x[j] = cte;
+            continue;
+        case OP_IMG:
+        case OP_LUMA:
+            x = pilha + (topo++)*EXPR_BLOCO;
+            ExprCarrega(x, imgs[op->arg], op->op==OP_LUMA, dcs, n0, len);
+            continue;
+        }
 
-    return 0;
+        /* operandos x (primeiro), y e z; o resultado fica em x */
+        switch (op->op) {
+        case OP_NEG: case OP_ABS: case OP_SQRT:
+            x = pilha + (topo-1)*EXPR_BLOCO;
+            if (op->op==OP_NEG)      { EXPR_LACO x[j] = -x[j]; }
+            else if (op->op==OP_ABS) { EXPR_LACO x[j] = fabsf(x[j]); }
+            else                     { EXPR_LACO x[j] = sqrtf(x[j]); }
+            break;
+        case OP_CLAMP: case OP_SELECT:
+            topo -= 2;
+            x = pilha + (topo-1)*EXPR_BLOCO;
+            y = x + EXPR_BLOCO;
+            z = y + EXPR_BLOCO;
+            if (op->op==OP_CLAMP) {
+                EXPR_LACO {
+                    float v = (x[j]<y[j]) ? y[j] : x[j];
+                    x[j] = (v>z[j]) ? z[j] : v;
+                }
+            } else {
+                EXPR_LACO x[j] = (x[j]!=0) ? y[j] : z[j];
+            }
+            break;
+        default:
+            topo--;
+            x = pilha + (topo-1)*EXPR_BLOCO;
+            y = x + EXPR_BLOCO;
+            switch (op->op) {
+            case OP_ADD: EXPR_LACO x[j] += y[j]; break;
+            case OP_SUB: EXPR_LACO x[j] -= y[j]; break;
+            case OP_MUL: EXPR_LACO x[j] *= y[j]; break;
+            case OP_DIV: EXPR_LACO x[j] /= y[j]; break;
+            case OP_LT:  EXPR_LACO x[j] = (float)(x[j]<y[j]); break;
+            case OP_GT:  EXPR_LACO x[j] = (float)(x[j]>y[j]); break;
+            case OP_LE:  EXPR_LACO x[j] = (float)(x[j]<=y[j]); break;
+            case OP_GE:  EXPR_LACO x[j] = (float)(x[j]>=y[j]); break;
+            case OP_MIN: EXPR_LACO x[j] = (x[j]<y[j]) ? x[j] : y[j]; break;
+            case OP_MAX: EXPR_LACO x[j] = (x[j]>y[j]) ? x[j] : y[j]; break;
+            case OP_POW: EXPR_LACO x[j] = powf(x[j], y[j]); break;
+            }
+            break;
+        }
+    }
+    memcpy(out+n0, pilha, len*sizeof(float));
 }
 
-static int comparaG(const void * p1, const void * p2)
-{
-    color *color1 = (color *) p1;
-    color *color2 = (color *) p2;
-
-    color c1 = *color1;
-    color c2 = *color2;
+/* Programa compilado com as pilhas de todas as threads, alocadas uma unica vez: quem
+   refaz a mesma operacao muitas vezes (o slider do visualizador) so paga a execucao. */
+struct PointProgram_imp {
+    Expr e;
+    int npilhas;    /* uma pilha por thread */
+    size_t tam;     /* floats em cada pilha */
+    float* pilhas;
+};
 
-    if (c1.g < c2.g) return -1;
-    if (c1.g > c2.g) return  1;
+PointProgram* imgPointOpCompile(const char* expr, int nimgs, int nk)
+{
+    PointProgram* p = (PointProgram*)malloc(sizeof(PointProgram));
 
-    return 0;
+    assert(p);
+    if (!ExprCompila(&p->e, expr, nimgs, nk)) {
+        free(p);
+        return NULL;
+    }
+    p->npilhas = 1;
+#ifdef _OPENMP
+    p->npilhas = omp_get_max_threads();
+#endif
+    p->tam = (size_t)p->e.prof_max*EXPR_BLOCO;
+    p->pilhas = (float*)malloc(p->npilhas*p->tam*sizeof(float));
+    assert(p->pilhas);
+    return p;
 }
 
-static int comparaB(const void * p1, const void * p2)
+void imgPointOpDestroy(PointProgram* p)
 {
-    color *color1 = (color *) p1;
-    color *color2 = (color *) p2;
-
-    color c1 = *color1;
-    color c2 = *color2;
+    if (!p) return;
+    free(p->pilhas);
+    free(p);
+}
 
-    if (c1.b < c2.b) return -1;
-    if (c1.b > c2.b) return  1;
+int imgPointOpRun(PointProgram* p, Image** imgs, const float* k, Image* out, int x0, int y0, int rw, int rh)
+{
+    const Expr* e = &p->e;
+    int W, H, dcs, y;
+
+    if (!ExprDcs(imgs, e->nimgs, &dcs))
+        return 0;
+    W = imgs[0]->width;
+    H = imgs[0]->height;
+    assert(out->width==W && out->height==H && out->dcs==dcs);
+
+    /* recorta o retangulo pela imagem */
+    if (x0<0) { rw += x0; x0 = 0; }
+    if (y0<0) { rh += y0; y0 = 0; }
+    if (x0+rw>W) rw = W-x0;
+    if (y0+rh>H) rh = H-y0;
+    if (rw<=0 || rh<=0) return 1;
+
+    /* com o retangulo na largura toda, as linhas sao contiguas e sao tratadas como uma so */
+    if (x0==0 && rw==W) {
+        rw *= rh;
+        rh = 1;
+    }
 
-    return 0;
+#pragma omp parallel num_threads(p->npilhas)
+    {
+        float* pilha = p->pilhas;
+        long total = (long)rw*dcs, nblocos = (total+EXPR_BLOCO-1)/EXPR_BLOCO, b;
+
+#ifdef _OPENMP
+        pilha += (size_t)omp_get_thread_num()*p->tam;
+#endif
+#pragma omp for collapse(2) schedule(static)
+        for (y=0;y<rh;y++)
+            for (b=0;b<nblocos;b++) {
+                long n0 = ((long)(y0+y)*W + x0)*dcs + b*EXPR_BLOCO;
+                int len = (int)((total-b*EXPR_BLOCO<EXPR_BLOCO) ? total-b*EXPR_BLOCO : EXPR_BLOCO);
+                ExprExecuta(e, imgs, k, dcs, out->buf, n0, len, pilha);
+            }
+    }
+    out->stats_ok = 0;
+    return 1;
 }
 
-static void caixaEnvolvente(colorCube* cube, color* colorVec)
+Image* imgPointOp(const char* expr, Image** imgs, int nimgs, const float* k, int nk)
 {
-    float r,g,b;
-    int i; 
-
-    /* inicializa com o pior caso */
-    cube->min.r = cube->min.g = cube->min.b = 1.0; 
-    cube->max.r = cube->max.g = cube->max.b = 0.0;
+    PointProgram* p = imgPointOpCompile(expr, nimgs, nk);
+    Image* out = NULL;
+    int dcs;
 
-    /* percorre o cubo ajustando o domnio das cores */
-    for (i=cube->ini;i<=cube->fim;i++){
-        r = colorVec[i].r;
-        if (r > cube->max.r) cube->max.r = r;
-        if (r < cube->min.r) cube->min.r = r;
-        g = colorVec[i].g;
-        if (g > cube->max.g) cube->max.g = g;
-        if (g < cube->min.g) cube->min.g = g;
-        b = colorVec[i].b;
-        if (b > cube->max.b) cube->max.b = b;
-        if (b < cube->min.b) cube->min.b = b;
+    if (p && ExprDcs(imgs, nimgs, &dcs)) {
+        out = imgCreate(imgs[0]->width, imgs[0]->height, dcs);
+        imgPointOpRun(p, imgs, k, out, 0, 0, out->width, out->height);
     }
+    imgPointOpDestroy(p);
+    return out;
 }
 
-static Image* bestColor(Image *img0, color* pal, Image* img1, int pal_size)
+int imgPointOpRect(const char* expr, Image** imgs, int nimgs, const float* k, int nk,
+                   Image* out, int x0, int y0, int rw, int rh)
 {
-    int w = imgGetWidth(img0);
-    int h = imgGetHeight(img0);
-    float rgb[3];
-    int x,y,i;
+    PointProgram* p = imgPointOpCompile(expr, nimgs, nk);
+    int ok;
 
-    for (y=0;y<h;y++){
-        for (x=0;x<w;x++){
-            int i_menor;
-            float m_menor;
-            float rgb1[3];
+    if (!p) return 0;
+    ok = imgPointOpRun(p, imgs, k, out, x0, y0, rw, rh);
+    imgPointOpDestroy(p);
+    return ok;
+}
 
-            imgGetPixel3fv(img0,x,y,rgb);
 
-            m_menor = FLT_MAX;
-            i_menor = 0;
 
-            for(i=0;i<pal_size;i++)
-            {
-                float dif[3];
-                float m;
 
-                dif[0] = rgb[0] - pal[i].r;
-                dif[1] = rgb[1] - pal[i].g;
-                dif[2] = rgb[2] - pal[i].b;
+/*- Janela de linhas com tratamento de borda -----------------------------*/
 
-                m = (float)((dif[0]*dif[0]) + (dif[1]*dif[1]) + (dif[2]*dif[2]));
+/* Mapeia a coordenada i (possivelmente fora de [0,n)) para dentro da imagem
+   segundo o tratamento da borda; devolve -1 para pixels de valor constante. */
+static int MapeiaBorda(int i, int n, int borda)
+{
+    if (i>=0 && i<n) return i;
+    switch (borda) {
+        case IMG_BORDA_REPETE:
+            return (i<0) ? 0 : n-1;
+        case IMG_BORDA_ESPELHO:
+            if (n==1) return 0;
+            while (i<0 || i>=n) i = (i<0) ? -i : 2*(n-1)-i;
+            return i;
+        case IMG_BORDA_CIRCULAR:
+            i %= n;
+            return (i<0) ? i+n : i;
+        default:
+            return -1;
+    }
+}
 
-                if (m < m_menor)
-                {
-                    i_menor = i;
-                    m_menor = m;
+/* Produz os w*dcs valores da linha y de uma imagem (por exemplo a sua luminancia). */
+typedef void (*CarregaLinha)(Image* img, int y, float* out);
 
-                    rgb1[0]=pal[i_menor].r;
-                    rgb1[1]=pal[i_menor].g;
-                    rgb1[2]=pal[i_menor].b;
-                }
-            }
+/* Janela com as linhas y-r..y+r de uma imagem, cada uma estendida com r pixels de cada
+   lado segundo o tratamento da borda. Os filtros leem os vizinhos por deslocamentos
+   fixos, sem testar coordenadas, e a borda custa apenas o preenchimento das margens.
+   Ao avancar para a linha seguinte so uma linha nova e' carregada. */
+typedef struct {
+    Image* img;
+    CarregaLinha carrega;  /* NULL: copia a linha da imagem           */
+    int dcs;               /* componentes por pixel nas linhas        */
+    int r;                 /* raio da janela                          */
+    int borda;             /* IMG_BORDA_*                             */
+    int y;                 /* linha central atual                     */
+    float* mem;
+    float** linhas;        /* 2r+1 linhas; linhas[r+dy] aponta o pixel x=0 da linha y+dy */
+} JanelaLinhas;
+
+static void JanelaCarrega(JanelaLinhas* jan, int yy, float* linha)
+{
+    Image* img = jan->img;
+    int w = img->width, dcs = jan->dcs, r = jan->r;
+    int ym = MapeiaBorda(yy, img->height, jan->borda);
+    int x, c;
+
+    if (ym<0) {
+        memset(linha - r*dcs, 0, (size_t)(w+2*r)*dcs*sizeof(float));
+        return;
+    }
+    if (jan->carrega)
+        jan->carrega(img, ym, linha);
+    else
+        memcpy(linha, img->buf + (size_t)ym*w*dcs, (size_t)w*dcs*sizeof(float));
 
-            imgSetPixel3fv(img1,x,y,rgb1);
-        }
+    for (x=-r;x<0;x++) {
+        int xm = MapeiaBorda(x, w, jan->borda);
+        for (c=0;c<dcs;c++) linha[x*dcs+c] = (xm<0) ? 0.f : linha[xm*dcs+c];
+    }
+    for (x=w;x<w+r;x++) {
+        int xm = MapeiaBorda(x, w, jan->borda);
+        for (c=0;c<dcs;c++) linha[x*dcs+c] = (xm<0) ? 0.f : linha[xm*dcs+c];
     }
-    return img1;
 }
 
-static void paleta(color* pal, colorCube* cubeVec, color* colorVec, int numCubos)
+static void JanelaCria(JanelaLinhas* jan, Image* img, CarregaLinha carrega, int dcs, int r, int borda)
 {
-    float sumvar[3];
-    int count;
-    int i,j;
-
-    for(i=0;i<numCubos;i++)
-    {
-        sumvar[0] = sumvar[1] = sumvar[2] = 0.0;
-        count = 0;
+    int i, largura = (img->width+2*r)*dcs;
+
+    jan->img = img;
+    jan->carrega = carrega;
+    jan->dcs = dcs;
+    jan->r = r;
+    jan->borda = borda;
+    jan->y = INT_MIN;
+    jan->mem = (float*)malloc((size_t)(2*r+1)*largura*sizeof(float));
+    jan->linhas = (float**)malloc((2*r+1)*sizeof(float*));
+    assert(jan->mem && jan->linhas);
+    for (i=0;i<2*r+1;i++)
+        jan->linhas[i] = jan->mem + (size_t)i*largura + r*dcs;
+}
 
-        for(j=cubeVec[i].ini;j<=cubeVec[i].fim;j++)
-        {
-            sumvar[0] += colorVec[j].r;
-            sumvar[1] += colorVec[j].g;
-            sumvar[2] += colorVec[j].b;
-            count++;
-        }
+/* Centra a janela na linha y; se y e' a linha seguinte, apenas gira as linhas. */
+static void JanelaVai(JanelaLinhas* jan, int y)
+{
+    int i, n = 2*jan->r+1;
 
-        pal[i].r = sumvar[0]/count;
-        pal[i].g = sumvar[1]/count;
-        pal[i].b = sumvar[2]/count;
+    if (y == jan->y+1) {
+        float* primeira = jan->linhas[0];
+        for (i=0;i<n-1;i++) jan->linhas[i] = jan->linhas[i+1];
+        jan->linhas[n-1] = primeira;
+        JanelaCarrega(jan, y+jan->r, primeira);
+    } else {
+        for (i=0;i<n;i++) JanelaCarrega(jan, y-jan->r+i, jan->linhas[i]);
     }
+    jan->y = y;
 }
 
-static void ordenaMaiorDim(colorCube* cubeVec, color* colorVec, int i)
+static void JanelaLibera(JanelaLinhas* jan)
 {
-    size_t numElem;
-    size_t tamElem;
-    float var[3];
+    free(jan->mem);
+    free(jan->linhas);
+}
 
-    numElem = (size_t)(cubeVec[i].fim - cubeVec[i].ini + 1);
-    tamElem = (size_t)(sizeof(color));
 
-    var[0] = cubeVec[i].max.r - cubeVec[i].min.r;
-    var[1] = cubeVec[i].max.g - cubeVec[i].min.g;
-    var[2] = cubeVec[i].max.b - cubeVec[i].min.b;
+/* Filtro 3x3 de uma linha de w pixels: b, m e c sao as linhas de cima, do meio e de
+   baixo, com um pixel de margem de cada lado */
+typedef void (*KernelLinha3x3)(float* out, const float* b, const float* m, const float* c, int w);
+
+/* kernel 1 2 1 / 2 4 2 / 1 2 1 (/16), aplicado a todas as componentes da linha */
+#define DEF_LINHA_GAUSS(D, T, nome)                                        \
+static void KERNEL_NOME(nome, D, T)(T* out, const T* b, const T* m,        \
+                                    const T* c, int w)                     \
+{                                                                          \
+    int n;                                                                 \
+    _Pragma("omp simd")                                                    \
+    for (n=0;n<w*D;n++)                                                    \
+        out[n] = ((c[n-D]+2*c[n]+c[n+D]) + 2*(m[n-D]+2*m[n]+m[n+D])        \
+                  + (b[n-D]+2*b[n]+b[n+D])) * (1.f/16);                    \
+}
 
-    /* procura a maior dimensao em um cubo */
-    if((var[0]>=var[1])&&(var[0]>=var[2])) cubeVec[i].maiorDim = 0;
-    else
-        if((var[1]>=var[0])&&(var[1]>=var[2])) cubeVec[i].maiorDim = 1;
-        else
-            if((var[2]>var[0]) && (var[2]>var[1])) cubeVec[i].maiorDim = 2;
+KERNEL_CANAIS(DEF_LINHA_GAUSS, float, LinhaGauss)
+KERNEL_SELETOR(KernelLinha3x3, EscolheLinhaGauss, LinhaGauss, float)
 
-    /* ordena de acordo com a maior dimensao da caixa */
-    if(cubeVec[i].maiorDim == 0)
-    {
-        qsort(&colorVec[cubeVec[i].ini],numElem,tamElem,comparaR);
-        cubeVec[i].var = var[0];
-    }
-    if(cubeVec[i].maiorDim == 1)
-    {
-        qsort(&colorVec[cubeVec[i].ini],numElem,tamElem,comparaG);
-        cubeVec[i].var = var[1];
-    }
-    if(cubeVec[i].maiorDim == 2)
+void imgGauss(Image* img_dst, Image* img_src, int borda)
+{
+    int w   = imgGetWidth(img_src);
+    int h   = imgGetHeight(img_src);
+    int dcs = imgGetDimColorSpace(img_src);
+    float* dst_buffer = imgGetData(img_dst);
+    KernelLinha3x3 gauss = EscolheLinhaGauss(dcs);
+    int y;
+
+#pragma omp parallel
     {
-        qsort(&colorVec[cubeVec[i].ini],numElem,tamElem,comparaB);
-        cubeVec[i].var = var[2];
+        JanelaLinhas jan;
+
+        JanelaCria(&jan, img_src, NULL, dcs, 1, borda);
+#pragma omp for schedule(static)
+        for (y=0;y<h;y++) {
+            JanelaVai(&jan, y);
+            gauss(dst_buffer + (size_t)y*w*dcs, jan.linhas[0], jan.linhas[1], jan.linhas[2], w);
+        }
+        JanelaLibera(&jan);
     }
 }
 
-static void cortaCubo(colorCube* cubeVec, int posCorte, int numCubos)
+
+
+/* Mediana 3x3 pela rede de J. L. Smith (XILINX XCELL vol. 23), a mesma do opt_med9 de
+   N. Devillard, reorganizada para varios pixels de uma vez: cada coluna da vizinhanca
+   e' ordenada (min, meio, max) e a mediana das 9 e' a mediana de tres valores:
+   o maior dos minimos, a mediana dos meios e o menor dos maximos das tres colunas.
+   A coluna n e' compartilhada pelas janelas dos pixels n-D, n e n+D, entao as colunas
+   de um bloco sao ordenadas uma unica vez; os dois lacos so' tem min/max, sem desvios,
+   e sao vetorizados (8 ou 16 componentes por instrucao em AVX2/AVX-512). */
+#define MED_MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MED_MAX(a,b) ((a)<(b) ? (b) : (a))
+#define MED_MED3(a,b,c) MED_MAX(MED_MIN(a,b), MED_MIN(MED_MAX(a,b),c))
+
+/* componentes de saida por bloco: as colunas ordenadas do bloco ficam na pilha */
+#define MEDIANA_BLOCO 512
+
+/* mediana da vizinhanca 3x3 de cada componente da linha */
+#define DEF_LINHA_MEDIANA(D, T, nome)                                      \
+static void KERNEL_NOME(nome, D, T)(T* out, const T* b, const T* m,        \
+                                    const T* c, int w)                     \
+{                                                                          \
+    T lo[MEDIANA_BLOCO+2*D], me[MEDIANA_BLOCO+2*D], hi[MEDIANA_BLOCO+2*D]; \
+    int n0, n, len;                                                        \
+                                                                           \
+    for (n0=0;n0<w*D;n0+=MEDIANA_BLOCO) {                                  \
+        const T *bb = b+n0-D, *mm = m+n0-D, *cc = c+n0-D;                  \
+        len = (w*D-n0 < MEDIANA_BLOCO) ? w*D-n0 : MEDIANA_BLOCO;           \
+                                                                           \
+        /* colunas n0-D .. n0+len+D-1 ordenadas */                          \
+        _Pragma("omp simd")                                                \
+        for (n=0;n<len+2*D;n++) {                                          \
+            T x0 = MED_MIN(bb[n],mm[n]), x1 = MED_MAX(bb[n],mm[n]);        \
+            T x2 = MED_MAX(x1,cc[n]);                                      \
+            x1 = MED_MIN(x1,cc[n]);                                        \
+            lo[n] = MED_MIN(x0,x1);                                        \
+            me[n] = MED_MAX(x0,x1);                                        \
+            hi[n] = x2;                                                    \
+        }                                                                  \
+        _Pragma("omp simd")                                                \
+        for (n=0;n<len;n++) {                                              \
+            T l = MED_MAX(MED_MAX(lo[n],lo[n+D]),lo[n+2*D]);               \
+            T h = MED_MIN(MED_MIN(hi[n],hi[n+D]),hi[n+2*D]);               \
+            T k = MED_MED3(me[n],me[n+D],me[n+2*D]);                       \
+            out[n0+n] = MED_MED3(l,k,h);                                   \
+        }                                                                  \
+    }                                                                      \
+}
+
+KERNEL_CANAIS(DEF_LINHA_MEDIANA, float, LinhaMediana)
+KERNEL_SELETOR(KernelLinha3x3, EscolheLinhaMediana, LinhaMediana, float)
+
+void imgMedian(Image* image, int borda) 
 {
-    /* divide o cubo */
-    int ini = cubeVec[posCorte].ini;
-    int fim = cubeVec[posCorte].fim;
+    int w = imgGetWidth(image);
+    int h = imgGetHeight(image);
+    int dcs = imgGetDimColorSpace(image);
+    Image* img = imgCopy(image);  
+    float* image_buf = imgGetData(image);
+    KernelLinha3x3 mediana = EscolheLinhaMediana(dcs);
+    int y;
 
-    if((fim - ini)%2 != 0) /* numero par de elementos */
-    {
-        cubeVec[numCubos].ini = ini + (fim - ini + 1)/2;
-        cubeVec[numCubos].fim = fim;
-        cubeVec[posCorte].fim = cubeVec[numCubos].ini - 1;
-    }
-    else /* numero impar de elementos */
+#pragma omp parallel
     {
-        cubeVec[numCubos].ini = ini + (fim - ini)/2;
-        cubeVec[numCubos].fim = fim;
-        cubeVec[posCorte].fim = cubeVec[numCubos].ini - 1;
+        JanelaLinhas jan;
+
+        JanelaCria(&jan, img, NULL, dcs, 1, borda);
+#pragma omp for schedule(static)
+        for (y=0;y<h;y++) {
+            JanelaVai(&jan, y);
+            mediana(image_buf + (size_t)y*w*dcs, jan.linhas[0], jan.linhas[1], jan.linhas[2], w);
+        }
+        JanelaLibera(&jan);
     }
+    imgDestroy(img);
 }
 
-static int cuboCorte(colorCube* cubeVec, int numCubos)
+/* Cada faixa de blocos e' independente: as linhas da faixa sao somadas coluna a coluna
+   (laco continuo, o mesmo das convolucoes), as colunas de cada bloco sao somadas e a
+   linha de saida, igual em toda a faixa, e' montada uma vez e copiada. Como a faixa
+   inteira e' lida antes de ser escrita, dst pode ser a propria src. */
+void imgPixelizeRect(Image* src, Image* dst, int bloco, int x, int y, int w, int h)
 {
-    /* escolhe o cubo a ser cortado */
-    float maiorVar = -1;
-    int posCorte = -1;
-    int k;
-    for(k=0;k<numCubos;k++)
+    int W = src->width, H = src->height, dcs = src->dcs;
+    int x0 = (x<0) ? 0 : x, x1 = (x+w>W) ? W : x+w;
+    int y0 = (y<0) ? 0 : y, y1 = (y+h>H) ? H : y+h;
+    KernelAcumula acumula = EscolheAcumula();
+    int ca, cb, n, by;
+    TRC_INICIO(t);
+
+    assert(bloco>=1);
+    assert(dst->width==W && dst->height==H && dst->dcs==dcs);
+    if (x0>=x1 || y0>=y1) return;
+
+    /* colunas [ca,cb) dos blocos que cortam o retangulo */
+    ca = x0/bloco*bloco;
+    cb = ((x1-1)/bloco+1)*bloco;
+    if (cb>W) cb = W;
+    n = (cb-ca)*dcs;
+
+#pragma omp parallel
     {
-        /* cubo com uma unica cor */
-        if((cubeVec[k].max.r == cubeVec[k].min.r)&&(cubeVec[k].max.g == cubeVec[k].min.g)&&(cubeVec[k].max.b == cubeVec[k].min.b))
-            continue;
+        float* col   = (float*)malloc(n*sizeof(float));   /* somas das colunas da faixa */
+        float* linha = (float*)malloc(n*sizeof(float));   /* linha de saida da faixa */
+        int yy, i, k, c;
+        assert(col && linha);
+
+#pragma omp for schedule(dynamic)
+        for (by=y0/bloco;by<=(y1-1)/bloco;by++) {
+            int ya = by*bloco, yb = (ya+bloco<H) ? ya+bloco : H;
+
+            memset(col, 0, n*sizeof(float));
+            for (yy=ya;yy<yb;yy++)
+                acumula(col, src->buf + ((size_t)yy*W+ca)*dcs, 1.f, n);
+
+            /* os blocos da direita podem ter menos de bloco colunas */
+            for (i=0;i<cb-ca;i+=bloco) {
+                int nx = (i+bloco<cb-ca) ? bloco : cb-ca-i;
+                double pontos = (double)nx*(yb-ya);
+                for (c=0;c<dcs;c++) {
+                    double soma = 0.0;
+                    float media;
+                    for (k=i;k<i+nx;k++) soma += col[k*dcs+c];
+                    media = (float)(soma/pontos);
+                    for (k=i;k<i+nx;k++) linha[k*dcs+c] = media;
+                }
+            }
 
-        if(cubeVec[k].var>maiorVar)
-        {
-            maiorVar = cubeVec[k].var;
-            posCorte = k;
+            for (yy=(ya>y0 ? ya : y0);yy<(yb<y1 ? yb : y1);yy++)
+                memcpy(dst->buf + ((size_t)yy*W+x0)*dcs, linha + (x0-ca)*dcs,
+                       (size_t)(x1-x0)*dcs*sizeof(float));
         }
+        free(col);
+        free(linha);
     }
+    dst->stats_ok = 0;
+    TRC_FIM(t, "imgPixelize");
+}
 
-    return posCorte;
+void imgPixelize(Image* src, Image* dst, int bloco)
+{
+    imgPixelizeRect(src, dst, bloco, 0, 0, src->width, src->height);
 }
 
+/* direcoes do gradiente usadas pela supressao de nao-maximos do Canny */
+#define DIR_H  0   /* gradiente horizontal: compara com os vizinhos da esquerda e da direita */
+#define DIR_D1 1   /* diagonal (+x,+y) */
+#define DIR_V  2   /* gradiente vertical: compara com os vizinhos de cima e de baixo */
+#define DIR_D2 3   /* diagonal (+x,-y) */
 
-void imgReduceColors(Image * img0, Image* img1, int maxCores)
+/* gradiente de Sobel no pixel x da linha l1 (l0 e l2 sao as linhas vizinhas) */
+KERNEL_INLINE float SobelPixel(const float* l0, const float* l1, const float* l2, int x,
+                               float* dx, float* dy)
 {
-    int w = imgGetWidth(img0);
-    int h = imgGetHeight(img0);
+	*dx = (l2[x+1]-l2[x-1]) + 2*(l1[x+1]-l1[x-1]) + (l0[x+1]-l0[x-1]);
+	*dy = (l2[x-1]+2*l2[x]+l2[x+1]) - (l0[x-1]+2*l0[x]+l0[x+1]);
+	return sqrtf((*dx)*(*dx)+(*dy)*(*dy));
+}
 
-    int x,y,i,j,numCubos = 0;
-    int posCorte = -1;
-    float rgb[3];
+/* magnitude do gradiente de Sobel nos pixels [x0,x1) de uma linha; se dir nao for NULL
+   grava tambem a direcao quantizada em 4 setores de 45 graus. Retorna a maior magnitude. */
+static float LinhaSobel(const float* l0, const float* l1, const float* l2,
+                        float* mag, unsigned char* dir, int x0, int x1)
+{
+	float max = 0;
+	int x;
+
+	if ( dir == NULL ) {
+#pragma omp simd reduction(max:max)
+		for ( x = x0; x < x1; x++ ) {
+			float dx, dy, val = SobelPixel( l0, l1, l2, x, &dx, &dy );
+			max = ( max > val ) ? max : val;
+			mag[x] = val;
+		}
+		return max;
+	}
+	for ( x = x0; x < x1; x++ ) {
+		float dx, dy, val = SobelPixel( l0, l1, l2, x, &dx, &dy );
+		float ax = fabsf( dx ), ay = fabsf( dy );
+
+		max = ( max > val ) ? max : val;
+		mag[x] = val;
+		if ( ay <= 0.41421356f*ax )      dir[x] = DIR_H;   /* tan(22.5) */
+		else if ( ay >= 2.41421356f*ax ) dir[x] = DIR_V;   /* tan(67.5) */
+		else dir[x] = ( ( dx > 0 ) == ( dy > 0 ) ) ? DIR_D1 : DIR_D2;
+	}
+	return max;
+}
 
-    colorCube* cubeVec = (colorCube*)malloc(maxCores*sizeof(colorCube)); /* vetor de cubos */
-    color* colorVec = (color*)malloc(w*h*sizeof(color)); /* vetor  de cores */
-    color* pal = (color*)malloc(maxCores*sizeof(color)); /* paleta de cores */
+Image* imgEdges(Image* imgIn, int borda)
+{
+    int w = imgGetWidth(imgIn);
+    int h = imgGetHeight(imgIn);
+    Image* imgOut = imgCreate(w,h,1);
+    float* imgOut_buf = imgOut->buf;
+    float max=0,inv;
+    long k;
+
+    /* Uma unica passada sobre a imagem de entrada: cada thread recebe uma faixa
+       de linhas consecutivas e mantem a luminancia de tres linhas numa janela
+       circular, de modo que a imagem cinza nunca e' criada. */
+#pragma omp parallel reduction(max:max)
+    {
+        JanelaLinhas jan;
+        int y;
+
+        JanelaCria(&jan, imgIn, LinhaLuminancia, 1, 1, borda);
+#pragma omp for schedule(static)
+        for (y=0;y<h;y++) {
+            float m;
+
+            JanelaVai(&jan, y);
+            m = LinhaSobel(jan.linhas[0], jan.linhas[1], jan.linhas[2],
+                           imgOut_buf + (size_t)y*w, NULL, 0, w);
+            max = (max>m)?max:m;
+        }
+        JanelaLibera(&jan);
+    }
+
+    /* normaliza para [0,1] */
+    inv = (max==0)? 1.f : 1.f/max;
+#pragma omp parallel for simd schedule(static)
+    for (k=0;k<(long)w*h;k++)
+        imgOut_buf[k] *= inv;
+
+    return imgOut;
+}
+
+/*- Convolucao generica --------------------------------------------------*/
+
+/* Copia a linha y da imagem (mapeada pela borda) para out, estendida com m pixels
+   de cada lado; out tem (w+2m)*dcs posicoes. */
+static void LinhaEstendida(Image* img, int y, int m, int borda, float* out)
+{
+    int w = img->width, dcs = img->dcs;
+    int ym = MapeiaBorda(y, img->height, borda);
+    const float* src;
+    int x, c;
+
+    if (ym<0) {
+        memset(out, 0, (size_t)(w+2*m)*dcs*sizeof(float));
+        return;
+    }
+    src = img->buf + (size_t)ym*w*dcs;
+    memcpy(out + m*dcs, src, (size_t)w*dcs*sizeof(float));
+    for (x=-m;x<0;x++) {
+        int xm = MapeiaBorda(x, w, borda);
+        for (c=0;c<dcs;c++) out[(x+m)*dcs+c] = (xm<0) ? 0.f : src[xm*dcs+c];
+    }
+    for (x=w;x<w+m;x++) {
+        int xm = MapeiaBorda(x, w, borda);
+        for (c=0;c<dcs;c++) out[(x+m)*dcs+c] = (xm<0) ? 0.f : src[xm*dcs+c];
+    }
+}
+
+/* Verifica se o kernel tem posto 1 (kernel[j][i] = col[j]*lin[i]) e calcula os fatores. */
+static int KernelSeparavel(const float* kernel, int kw, int kh, float* col, float* lin)
+{
+    int i, j, i0=0, j0=0;
+    float pivo=0, tol;
+
+    for (j=0;j<kh;j++)
+        for (i=0;i<kw;i++)
+            if (fabsf(kernel[j*kw+i])>fabsf(pivo)) {
+                pivo = kernel[j*kw+i];
+                i0 = i; j0 = j;
+            }
+    if (pivo==0) return 0;
+
+    for (j=0;j<kh;j++) col[j] = kernel[j*kw+i0];
+    for (i=0;i<kw;i++) lin[i] = kernel[j0*kw+i]/pivo;
+
+    tol = 1e-5f*fabsf(pivo);
+    for (j=0;j<kh;j++)
+        for (i=0;i<kw;i++)
+            if (fabsf(kernel[j*kw+i]-col[j]*lin[i])>tol) return 0;
+    return 1;
+}
+
+/* Soma direta: para cada linha de saida acumula, para cada peso do kernel, a linha
+   estendida deslocada e multiplicada pelo peso (laco interno continuo e sem desvios). */
+static void ConvDireta(Image* src, Image* dst, const float* kernel, int kw, int kh, int borda)
+{
+    int w = src->width, h = src->height, dcs = src->dcs;
+    int cx = kw/2, cy = kh/2;
+    KernelAcumula acumula = EscolheAcumula();
+    int y;
+
+#pragma omp parallel
+    {
+        float* linha = (float*)malloc((size_t)(w+kw)*dcs*sizeof(float));
+        int i, j;
+        assert(linha);
+
+#pragma omp for schedule(static)
+        for (y=0;y<h;y++) {
+            float* acc = dst->buf + (size_t)y*w*dcs;
+            memset(acc, 0, (size_t)w*dcs*sizeof(float));
+            for (j=0;j<kh;j++) {
+                const float* pesos = kernel + j*kw;
+                LinhaEstendida(src, y+cy-j, cx, borda, linha);
+                for (i=0;i<kw;i++)
+                    if (pesos[i]!=0)
+                        acumula(acc, linha + i*dcs, pesos[i], w*dcs);
+            }
+        }
+        free(linha);
+    }
+}
+
+/* Duas passadas 1D: horizontal com lin (para todas as linhas) e vertical com col. */
+static void ConvSeparavel(Image* src, Image* dst, const float* col, const float* lin, int kw, int kh, int borda)
+{
+    int w = src->width, h = src->height, dcs = src->dcs;
+    int cx = kw/2, cy = kh/2;
+    Image* tmp = imgCreate(w, h, dcs);
+    KernelAcumula acumula = EscolheAcumula();
+    int y;
+
+#pragma omp parallel
+    {
+        float* linha = (float*)malloc((size_t)(w+kw)*dcs*sizeof(float));
+        int i, j;
+        assert(linha);
+
+#pragma omp for schedule(static)
+        for (y=0;y<h;y++) {
+            float* acc = tmp->buf + (size_t)y*w*dcs;
+            LinhaEstendida(src, y, cx, borda, linha);
+            memset(acc, 0, (size_t)w*dcs*sizeof(float));
+            for (i=0;i<kw;i++)
+                acumula(acc, linha + i*dcs, lin[i], w*dcs);
+        }
+
+#pragma omp for schedule(static)
+        for (y=0;y<h;y++) {
+            float* acc = dst->buf + (size_t)y*w*dcs;
+            memset(acc, 0, (size_t)w*dcs*sizeof(float));
+            for (j=0;j<kh;j++) {
+                int ym = MapeiaBorda(y+cy-j, h, borda);
+                if (ym<0) continue;
+                acumula(acc, tmp->buf + (size_t)ym*w*dcs, col[j], w*dcs);
+            }
+        }
+        free(linha);
+    }
+    imgDestroy(tmp);
+}
+
+/* FFT complexa radix-2 in-place (n potencia de 2); sinal=-1 direta, +1 inversa (sem escala). */
+static void FFT(float* re, float* im, int n, const float* cs, const float* sn, int sinal)
+{
+    int i, j, k, len;
+
+    /* permutacao por inversao de bits */
+    for (i=1, j=0; i<n; i++) {
+        int bit = n>>1;
+        for (; j & bit; bit>>=1) j ^= bit;
+        j ^= bit;
+        if (i<j) {
+            float t;
+            t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    /* borboletas; cs/sn guardam cos e sen de 2*pi*k/n para k<n/2 */
+    for (len=2; len<=n; len<<=1) {
+        int meio = len>>1, passo = n/len;
+        for (i=0; i<n; i+=len)
+            for (k=0; k<meio; k++) {
+                float wr = cs[k*passo], wi = sinal*sn[k*passo];
+                float* ar = re+i+k; float* ai = im+i+k;
+                float br = re[i+k+meio]*wr - im[i+k+meio]*wi;
+                float bi = re[i+k+meio]*wi + im[i+k+meio]*wr;
+                re[i+k+meio] = *ar - br; im[i+k+meio] = *ai - bi;
+                *ar += br; *ai += bi;
+            }
+    }
+}
+
+/* FFT 2D de uma matriz n x n (linhas e depois colunas); col e' area de trabalho com 2n floats */
+static void FFT2D(float* re, float* im, int n, const float* cs, const float* sn, int sinal, float* col)
+{
+    int i, j;
+
+    for (i=0;i<n;i++) FFT(re+i*n, im+i*n, n, cs, sn, sinal);
+    for (j=0;j<n;j++) {
+        for (i=0;i<n;i++) { col[i] = re[i*n+j]; col[n+i] = im[i*n+j]; }
+        FFT(col, col+n, n, cs, sn, sinal);
+        for (i=0;i<n;i++) { re[i*n+j] = col[i]; im[i*n+j] = col[n+i]; }
+    }
+}
+
+/* Correlacao por FFT em blocos (overlap-save): cada bloco de t x t pixels de saida le
+   uma regiao de (t+kh-1) x (t+kw-1) pixels (estendida pela borda) numa FFT n x n. */
+static void ConvFFT(Image* src, Image* dst, const float* kernel, int kw, int kh, int borda)
+{
+    int w = src->width, h = src->height, dcs = src->dcs;
+    int cx = kw/2, cy = kh/2;
+    int kmax = (kw>kh) ? kw : kh;
+    int n = 32, t, nbx, nby, b, i, j;
+    float *cs, *sn, *kre, *kim;
+
+    while (n < 4*kmax) n <<= 1;
+    t = n - kmax + 1;
+    nbx = (w+t-1)/t;
+    nby = (h+t-1)/t;
+
+    cs  = (float*)malloc(n/2*sizeof(float));
+    sn  = (float*)malloc(n/2*sizeof(float));
+    kre = (float*)calloc((size_t)n*n, sizeof(float));
+    kim = (float*)calloc((size_t)n*n, sizeof(float));
+    assert(cs && sn && kre && kim);
+    for (i=0;i<n/2;i++) {
+        cs[i] = (float)cos(2*M_PI*i/n);
+        sn[i] = (float)sin(2*M_PI*i/n);
+    }
+
+    /* G[a][b] = kernel[kh-1-a][b]: linhas do kernel na ordem do buffer (y crescente) */
+    for (j=0;j<kh;j++)
+        for (i=0;i<kw;i++)
+            kre[j*n+i] = kernel[(kh-1-j)*kw+i];
+    {
+        float* col = (float*)malloc(2*n*sizeof(float));
+        assert(col);
+        FFT2D(kre, kim, n, cs, sn, -1, col);
+        free(col);
+    }
+
+#pragma omp parallel
+    {
+        float* re   = (float*)malloc((size_t)n*n*sizeof(float));
+        float* im   = (float*)malloc((size_t)n*n*sizeof(float));
+        float* col  = (float*)malloc(2*n*sizeof(float));
+        float escala = 1.f/((float)n*n);
+        int c, u, v, k;
+        assert(re && im && col);
+
+#pragma omp for schedule(dynamic)
+        for (b=0;b<nbx*nby;b++) {
+            int x0 = (b%nbx)*t, y0 = (b/nbx)*t;
+            int tw = (x0+t>w) ? w-x0 : t;
+            int th = (y0+t>h) ? h-y0 : t;
+            /* a regiao de entrada comeca em (x0-cx, y0-(kh-1-cy)) */
+            int ex = x0-cx, ey = y0-(kh-1-cy);
+
+            for (c=0;c<dcs;c++) {
+                memset(re, 0, (size_t)n*n*sizeof(float));
+                memset(im, 0, (size_t)n*n*sizeof(float));
+                for (u=0;u<th+kh-1;u++) {
+                    int ym = MapeiaBorda(ey+u, h, borda);
+                    const float* s;
+                    if (ym<0) continue;
+                    s = src->buf + (size_t)ym*w*dcs + c;
+                    for (v=0;v<tw+kw-1;v++) {
+                        int xm = MapeiaBorda(ex+v, w, borda);
+                        re[u*n+v] = (xm<0) ? 0.f : s[xm*dcs];
+                    }
+                }
+                FFT2D(re, im, n, cs, sn, -1, col);
+                /* produto pelo conjugado do kernel = correlacao */
+                for (k=0;k<n*n;k++) {
+                    float a = re[k], bb = im[k];
+                    re[k] = a*kre[k] + bb*kim[k];
+                    im[k] = bb*kre[k] - a*kim[k];
+                }
+                FFT2D(re, im, n, cs, sn, +1, col);
+                for (u=0;u<th;u++) {
+                    float* out = dst->buf + ((size_t)(y0+u)*w + x0)*dcs + c;
+                    for (v=0;v<tw;v++) out[v*dcs] = re[u*n+v]*escala;
+                }
+            }
+        }
+        free(re); free(im); free(col);
+    }
+
+    free(cs); free(sn); free(kre); free(kim);
+}
+
+Image* imgConvolve(Image* image, const float* kernel, int kw, int kh, int borda, int metodo)
+{
+    Image* dst = imgCreate(image->width, image->height, image->dcs);
+    float* col = (float*)malloc(kh*sizeof(float));
+    float* lin = (float*)malloc(kw*sizeof(float));
+    int separavel;
+
+    assert(col && lin && kw>0 && kh>0);
+    separavel = (metodo==IMG_CONV_AUTO || metodo==IMG_CONV_SEPARAVEL) &&
+                KernelSeparavel(kernel, kw, kh, col, lin);
+
+    if (metodo==IMG_CONV_AUTO)
+        metodo = separavel ? IMG_CONV_SEPARAVEL :
+                 (kw*kh <= convMaxDireta[SimdCaminho()]) ? IMG_CONV_DIRETA : IMG_CONV_FFT;
+
+    if (metodo==IMG_CONV_SEPARAVEL && separavel)
+        ConvSeparavel(image, dst, col, lin, kw, kh, borda);
+    else if (metodo==IMG_CONV_FFT)
+        ConvFFT(image, dst, kernel, kw, kh, borda);
+    else
+        ConvDireta(image, dst, kernel, kw, kh, borda);
+
+    free(col);
+    free(lin);
+    return dst;
+}
+
+/*- Sequencia de filtros executada em blocos -------------------------------*/
+
+/* bytes de cache (L2) disponiveis para os dois buffers de um bloco */
+#define PIPE_CACHE (256*1024)
+#define PIPE_BLOCO_MIN 16
+#define PIPE_MAX_ETAPAS 32
+
+#define ETAPA_CINZA      0
+#define ETAPA_GAUSS      1
+#define ETAPA_MEDIANA    2
+#define ETAPA_SOBEL      3
+#define ETAPA_CONVOLUCAO 4
+#define ETAPA_LIMIAR     5
+#define ETAPA_SAUVOLA    6
+#define ETAPA_BRADLEY    7
+
+typedef struct {
+    int tipo;
+    int r;             /* raio do stencil; 0 nas operacoes pontuais */
+    float limiar;
+    float k;           /* parametro de Sauvola e Bradley */
+    float* kernel;
+    int kw, kh;
+} Etapa;
+
+struct Pipeline_imp {
+    int borda;
+    int n;
+    Etapa etapas[PIPE_MAX_ETAPAS];
+};
+
+Pipeline* pipeCreate(int borda)
+{
+    Pipeline* pl = (Pipeline*)calloc(1, sizeof(Pipeline));
+    assert(pl);
+    pl->borda = borda;
+    return pl;
+}
+
+void pipeDestroy(Pipeline* pl)
+{
+    int i;
+    if (!pl) return;
+    for (i=0;i<pl->n;i++) free(pl->etapas[i].kernel);
+    free(pl);
+}
+
+static Etapa* NovaEtapa(Pipeline* pl, int tipo, int r)
+{
+    Etapa* e;
+    assert(pl->n < PIPE_MAX_ETAPAS);
+    e = &pl->etapas[pl->n++];
+    memset(e, 0, sizeof(Etapa));
+    e->tipo = tipo;
+    e->r = r;
+    return e;
+}
+
+void pipeGrey(Pipeline* pl)   { NovaEtapa(pl, ETAPA_CINZA, 0); }
+void pipeGauss(Pipeline* pl)  { NovaEtapa(pl, ETAPA_GAUSS, 1); }
+void pipeMedian(Pipeline* pl) { NovaEtapa(pl, ETAPA_MEDIANA, 1); }
+void pipeSobel(Pipeline* pl)  { NovaEtapa(pl, ETAPA_SOBEL, 1); }
+
+void pipeConvolve(Pipeline* pl, const float* kernel, int kw, int kh)
+{
+    Etapa* e = NovaEtapa(pl, ETAPA_CONVOLUCAO, ((kw>kh)?kw:kh)/2);
+    assert(kw>0 && kh>0);
+    e->kernel = (float*)malloc((size_t)kw*kh*sizeof(float));
+    assert(e->kernel);
+    memcpy(e->kernel, kernel, (size_t)kw*kh*sizeof(float));
+    e->kw = kw;
+    e->kh = kh;
+}
+
+void pipeThreshold(Pipeline* pl, float threshold)
+{
+    NovaEtapa(pl, ETAPA_LIMIAR, 0)->limiar = threshold;
+}
+
+void pipeSauvola(Pipeline* pl, int janela, float k)
+{
+    NovaEtapa(pl, ETAPA_SAUVOLA, (janela<1) ? 0 : janela/2)->k = k;
+}
+
+void pipeBradley(Pipeline* pl, int janela, float t)
+{
+    NovaEtapa(pl, ETAPA_BRADLEY, (janela<1) ? 0 : janela/2)->k = t;
+}
+
+/* numero de componentes na saida da etapa */
+static int EtapaDcs(const Etapa* e, int dcs)
+{
+    return (e->tipo==ETAPA_CINZA || e->tipo==ETAPA_SOBEL || e->tipo==ETAPA_LIMIAR ||
+            e->tipo==ETAPA_SAUVOLA || e->tipo==ETAPA_BRADLEY) ? 1 : dcs;
+}
+
+/* Sauvola e Bradley (como BinarizaLocal): as somas da janela de (2r+1)^2 pixels em volta
+   de cada pixel saem de uma imagem integral da luminancia da entrada com a margem r,
+   calculada para o retangulo inteiro. */
+static void EtapaLocal(const Etapa* e, const float* in, int sin, int dcs,
+                       float* out, int sout, int w, int h)
+{
+    KernelLuma luma = EscolheLinhaLuma(dcs);
+    int r = e->r, wi = w+2*r, hi = h+2*r, W = wi+1, j = 2*r+1;
+    double n = (double)j*j;
+    double* soma  = (double*)malloc((size_t)W*(hi+1)*sizeof(double));
+    double* soma2 = (double*)malloc((size_t)W*(hi+1)*sizeof(double));
+    float*  l     = (float*)malloc((size_t)wi*hi*sizeof(float));
+    int x, y;
+    assert(soma && soma2 && l);
+
+    in -= r*sin + r*dcs;
+    memset(soma, 0, W*sizeof(double));
+    memset(soma2, 0, W*sizeof(double));
+    for (y=0;y<hi;y++) {
+        const double* a  = soma  + (size_t)y*W;
+        const double* a2 = soma2 + (size_t)y*W;
+        double* s  = soma  + (size_t)(y+1)*W;
+        double* s2 = soma2 + (size_t)(y+1)*W;
+        float*  ly = l + (size_t)y*wi;
+        double  acc = 0.0, acc2 = 0.0;
+
+        luma(in + (size_t)y*sin, ly, wi);
+        s[0] = s2[0] = 0.0;
+        for (x=0;x<wi;x++) {
+            acc  += ly[x];
+            acc2 += (double)ly[x]*ly[x];
+            s[x+1]  = a[x+1] + acc;
+            s2[x+1] = a2[x+1] + acc2;
+        }
+    }
+
+    for (y=0;y<h;y++, out+=sout) {
+        const double* sa  = soma  + (size_t)y*W;
+        const double* sb  = soma  + (size_t)(y+j)*W;
+        const double* sa2 = soma2 + (size_t)y*W;
+        const double* sb2 = soma2 + (size_t)(y+j)*W;
+        const float*  ly  = l + (size_t)(y+r)*wi + r;
+
+        for (x=0;x<w;x++) {
+            double m = (sb[x+j] - sb[x] - sa[x+j] + sa[x])/n;
+            double threshold;
+
+            if (e->tipo==ETAPA_SAUVOLA) {
+                double var = (sb2[x+j] - sb2[x] - sa2[x+j] + sa2[x])/n - m*m;
+                double desvio = (var>0.0) ? sqrt(var) : 0.0;
+                threshold = m*(1.0 + e->k*(desvio/0.5 - 1.0));
+            } else
+                threshold = m*(1.0 - e->k);
+            out[x] = (ly[x] > threshold) ? 1.f : 0.f;
+        }
+    }
+    free(soma);
+    free(soma2);
+    free(l);
+}
+
+/* Aplica a etapa a um retangulo de w x h pixels. in aponta o pixel de entrada alinhado
+   com out[0]; os vizinhos estao a +-sin floats (linhas) e +-dcs floats (colunas). */
+static void EtapaExecuta(const Etapa* e, const float* in, int sin, int dcs,
+                         float* out, int sout, int w, int h)
+{
+    KernelLuma     luma  = NULL;
+    KernelLinha3x3 filtro = NULL;
+    KernelAcumula  acumula = EscolheAcumula();
+    int y, x, i, j;
+
+    if (e->tipo==ETAPA_SAUVOLA || e->tipo==ETAPA_BRADLEY) {
+        EtapaLocal(e, in, sin, dcs, out, sout, w, h);
+        return;
+    }
+
+    /* as etapas que dependem do dcs escolhem o kernel uma unica vez */
+    if (e->tipo==ETAPA_CINZA || e->tipo==ETAPA_LIMIAR)
+        luma = EscolheLinhaLuma(dcs);
+    else if (e->tipo==ETAPA_GAUSS)
+        filtro = EscolheLinhaGauss(dcs);
+    else if (e->tipo==ETAPA_MEDIANA)
+        filtro = EscolheLinhaMediana(dcs);
+
+    for (y=0;y<h;y++, in+=sin, out+=sout) {
+        const float* b = in - sin;   /* linha y-1 */
+        const float* c = in + sin;   /* linha y+1 */
+
+        switch (e->tipo) {
+        case ETAPA_CINZA:
+            luma(in, out, w);
+            break;
+
+        case ETAPA_GAUSS:
+        case ETAPA_MEDIANA:
+            filtro(out, b, in, c, w);
+            break;
+
+        case ETAPA_SOBEL:  /* dcs==1: pipeRun converte antes para luminancia */
+#pragma omp simd
+            for (x=0;x<w;x++) {
+                float dx = (c[x+1]-c[x-1]) + 2*(in[x+1]-in[x-1]) + (b[x+1]-b[x-1]);
+                float dy = (c[x-1]+2*c[x]+c[x+1]) - (b[x-1]+2*b[x]+b[x+1]);
+                out[x] = sqrtf(dx*dx+dy*dy);
+            }
+            break;
+
+        case ETAPA_CONVOLUCAO:
+            memset(out, 0, (size_t)w*dcs*sizeof(float));
+            for (j=0;j<e->kh;j++) {
+                const float* linha = in + (e->kh/2-j)*sin - (e->kw/2)*dcs;
+                for (i=0;i<e->kw;i++)
+                    if (e->kernel[j*e->kw+i]!=0)
+                        acumula(out, linha + i*dcs, e->kernel[j*e->kw+i], w*dcs);
+            }
+            break;
+
+        case ETAPA_LIMIAR:
+            luma(in, out, w);
+            for (x=0;x<w;x++)
+                out[x] = (out[x] > e->limiar) ? 1.f : 0.f;
+            break;
+        }
+    }
+}
+
+/* Refaz, num resultado intermediario que cobre [x0,x0+w) x [y0,y0+h) da imagem de
+   W x H pixels, os pixels que caem fora da imagem segundo a borda, como se a etapa
+   seguinte lesse a imagem intermediaria inteira. Os pixels de origem estao sempre
+   dentro do retangulo. Na borda circular nao ha o que refazer: a entrada ja' foi lida
+   periodicamente e o resultado tambem e' periodico. */
+static void RefazBorda(float* buf, int dcs, int x0, int y0, int w, int h, int W, int H, int borda)
+{
+    int y, x, c;
+
+    if (borda==IMG_BORDA_CIRCULAR || (x0>=0 && y0>=0 && x0+w<=W && y0+h<=H))
+        return;
+
+    for (y=0;y<h;y++) {
+        float* linha = buf + (size_t)y*w*dcs;
+        if (y0+y<0 || y0+y>=H) continue;
+        for (x=0;x<w;x++) {
+            int xm;
+            if (x0+x>=0 && x0+x<W) continue;
+            xm = MapeiaBorda(x0+x, W, borda);
+            for (c=0;c<dcs;c++)
+                linha[x*dcs+c] = (xm<0) ? 0.f : linha[(xm-x0)*dcs+c];
+        }
+    }
+    for (y=0;y<h;y++) {
+        int ym;
+        if (y0+y>=0 && y0+y<H) continue;
+        ym = MapeiaBorda(y0+y, H, borda);
+        if (ym<0)
+            memset(buf + (size_t)y*w*dcs, 0, (size_t)w*dcs*sizeof(float));
+        else
+            memcpy(buf + (size_t)y*w*dcs, buf + (size_t)(ym-y0)*w*dcs, (size_t)w*dcs*sizeof(float));
+    }
+}
+
+/* Resolve as etapas para uma entrada de dcs componentes (o Sobel trabalha sobre a
+   luminancia); devolve o numero de etapas e, em *dcs_max e *R, o maior numero de
+   componentes intermediarias e a soma dos raios. */
+static int PipeEtapas(Pipeline* pl, int dcs, Etapa* etapas, int* dcs_max, int* R)
+{
+    int n = 0, i;
+
+    *dcs_max = dcs;
+    *R = 0;
+    for (i=0;i<pl->n;i++) {
+        if (pl->etapas[i].tipo==ETAPA_SOBEL && dcs!=1) {
+            memset(&etapas[n], 0, sizeof(Etapa));
+            etapas[n++].tipo = ETAPA_CINZA;
+            dcs = 1;
+        }
+        etapas[n] = pl->etapas[i];
+        dcs = EtapaDcs(&etapas[n], dcs);
+        if (dcs>*dcs_max) *dcs_max = dcs;
+        *R += etapas[n++].r;
+    }
+    return n;
+}
+
+void pipeRunRect(Pipeline* pl, Image* image, Image* out, int x0, int y0, int rw, int rh)
+{
+    int W = image->width, H = image->height, borda = pl->borda;
+    Etapa etapas[2*PIPE_MAX_ETAPAS];
+    int n, i, dcs_max, R;
+    int lado, nbx, nby, bloco;
+    size_t tam;
+
+    assert(out->width==W && out->height==H && out->dcs==pipeGetDimColorSpace(pl, image->dcs));
+
+    /* recorta o retangulo pela imagem */
+    if (x0<0) { rw += x0; x0 = 0; }
+    if (y0<0) { rh += y0; y0 = 0; }
+    if (x0+rw>W) rw = W-x0;
+    if (y0+rh>H) rh = H-y0;
+    if (rw<=0 || rh<=0) return;
+
+    n = PipeEtapas(pl, image->dcs, etapas, &dcs_max, &R);
+    if (n==0) {
+        for (i=0;i<rh;i++)
+            memcpy(out->buf + ((size_t)(y0+i)*W + x0)*out->dcs, image->buf + ((size_t)(y0+i)*W + x0)*image->dcs,
+                   (size_t)rw*image->dcs*sizeof(float));
+        out->stats_ok = 0;
+        return;
+    }
+
+    /* lado do bloco: os dois buffers de (lado+2R)^2 pixels cabem na cache */
+    lado = (int)sqrt((double)PIPE_CACHE/(2.0*dcs_max*sizeof(float))) - 2*R;
+    if (lado<PIPE_BLOCO_MIN) lado = PIPE_BLOCO_MIN;
+    nbx = (rw+lado-1)/lado;
+    nby = (rh+lado-1)/lado;
+    tam = (size_t)(lado+2*R)*(lado+2*R)*dcs_max;
+
+#pragma omp parallel
+    {
+        float* buf[2];
+        buf[0] = (float*)malloc(tam*sizeof(float));
+        buf[1] = (float*)malloc(tam*sizeof(float));
+        assert(buf[0] && buf[1]);
+
+#pragma omp for schedule(dynamic)
+        for (bloco=0;bloco<nbx*nby;bloco++) {
+            int bx = x0 + (bloco%nbx)*lado, by = y0 + (bloco/nbx)*lado;
+            int bw = (bx+lado<=x0+rw) ? lado : x0+rw-bx;
+            int bh = (by+lado<=y0+rh) ? lado : y0+rh-by;
+            int m = R, d = image->dcs, atual = 0;
+            int wi = bw+2*m, hi = bh+2*m;
+            int x, y, c, k;
+
+            /* carrega o bloco com a margem R, mapeando os pixels de fora pela borda */
+            for (y=0;y<hi;y++) {
+                float* dst = buf[0] + (size_t)y*wi*d;
+                int ym = MapeiaBorda(by-m+y, H, borda);
+                const float* src = (ym<0) ? NULL : image->buf + (size_t)ym*W*d;
+                if (src && bx-m>=0 && bx+bw+m<=W) {
+                    memcpy(dst, src + (size_t)(bx-m)*d, (size_t)wi*d*sizeof(float));
+                    continue;
+                }
+                for (x=0;x<wi;x++) {
+                    int xm = src ? MapeiaBorda(bx-m+x, W, borda) : -1;
+                    for (c=0;c<d;c++) dst[x*d+c] = (xm<0) ? 0.f : src[xm*d+c];
+                }
+            }
+
+            /* cada etapa reduz a margem pelo seu raio */
+            for (k=0;k<n;k++) {
+                const Etapa* e = &etapas[k];
+                int dout = EtapaDcs(e, d);
+                int mo = m - e->r, wo = bw+2*mo, ho = bh+2*mo;
+                const float* in = buf[atual] + ((size_t)e->r*wi + e->r)*d;
+
+                if (k==n-1) {
+                    EtapaExecuta(e, in, wi*d, d, out->buf + ((size_t)by*W + bx)*dout, W*dout, bw, bh);
+                } else {
+                    EtapaExecuta(e, in, wi*d, d, buf[1-atual], wo*dout, wo, ho);
+                    RefazBorda(buf[1-atual], dout, bx-mo, by-mo, wo, ho, W, H, borda);
+                    atual = 1-atual;
+                }
+                m = mo; wi = wo; hi = ho; d = dout;
+            }
+        }
+        free(buf[0]);
+        free(buf[1]);
+    }
+    out->stats_ok = 0;
+}
+
+int pipeGetDimColorSpace(Pipeline* pl, int dcs)
+{
+    Etapa etapas[2*PIPE_MAX_ETAPAS];
+    int n, i, dcs_max, R;
+
+    n = PipeEtapas(pl, dcs, etapas, &dcs_max, &R);
+    for (i=0;i<n;i++) dcs = EtapaDcs(&etapas[i], dcs);
+    return dcs;
+}
+
+Image* pipeRun(Pipeline* pl, Image* image)
+{
+    Image* out;
+
+    if (pl->n==0)
+        return imgCopy(image);
+    out = imgCreate(image->width, image->height, pipeGetDimColorSpace(pl, image->dcs));
+    pipeRunRect(pl, image, out, 0, 0, image->width, image->height);
+    return out;
+}
+
+#define CANNY_NADA  0
+#define CANNY_FRACO 1
+#define CANNY_FORTE 2
+
+Bitmap* imgCanny(Image* image, float baixo, float alto)
+{
+    int w = imgGetWidth(image);
+    int h = imgGetHeight(image);
+    Bitmap* edges = bmpCreate(w,h);
+    Image *grey, *blur;
+    float *mag, max=0, tb, ta;
+    unsigned char *dir, *classe;
+    int *fila, nfila=0, y;
+    int vizinho[4];
+
+    if (w<3 || h<3) return edges;
+
+    /* 1. suavizacao da luminancia */
+    grey = (image->dcs==1) ? image : imgGrey(image);
+    blur = imgCreate(w,h,1);
+    imgGauss(blur, grey, IMG_BORDA_REPETE);
+    if (grey!=image) imgDestroy(grey);
+
+    mag    = (float*)calloc((size_t)w*h, sizeof(float));
+    dir    = (unsigned char*)calloc((size_t)w*h, 1);
+    classe = (unsigned char*)calloc((size_t)w*h, 1);
+    assert(mag && dir && classe);
+
+    /* 2. gradiente de Sobel com a direcao quantizada em 4 setores de 45 graus */
+#pragma omp parallel for schedule(static) reduction(max:max)
+    for (y=1;y<h-1;y++) {
+        const float* l0 = blur->buf + (size_t)(y-1)*w;
+        const float* l1 = l0 + w;
+        const float* l2 = l1 + w;
+        float m = LinhaSobel(l0, l1, l2, mag + (size_t)y*w, dir + (size_t)y*w, 1, w-1);
+        max = (max>m)?max:m;
+    }
+    imgDestroy(blur);
+
+    /* 3. supressao de nao-maximos e classificacao pelo threshold duplo */
+    tb = baixo*max;
+    ta = alto*max;
+    vizinho[DIR_H]  = 1;
+    vizinho[DIR_D1] = w+1;
+    vizinho[DIR_V]  = w;
+    vizinho[DIR_D2] = -w+1;
+#pragma omp parallel for schedule(static)
+    for (y=1;y<h-1;y++) {
+        int x;
+        for (x=1;x<w-1;x++) {
+            size_t k = (size_t)y*w+x;
+            int d = vizinho[dir[k]];
+            float m = mag[k];
+            if (m <= tb || m < mag[k-d] || m < mag[k+d])
+                classe[k] = CANNY_NADA;
+            else
+                classe[k] = (m > ta) ? CANNY_FORTE : CANNY_FRACO;
+        }
+    }
+    free(mag);
+    free(dir);
+
+    /* 4. histerese: uma busca (com pilha) a partir dos pixels fortes marca os fracos
+       conectados (vizinhanca 8). E' a unica etapa sequencial. */
+    fila = (int*)malloc((size_t)w*h*sizeof(int));
+    assert(fila);
+    for (y=1;y<h-1;y++) {
+        int x;
+        for (x=1;x<w-1;x++)
+            if (classe[y*w+x]==CANNY_FORTE) fila[nfila++] = y*w+x;
+    }
+    while (nfila>0) {
+        int k = fila[--nfila];
+        int x = k%w, yk = k/w, dy, dx;
+
+        edges->bits[(size_t)yk*edges->stride + (x>>3)] |= (unsigned char)(1 << (7-(x&7)));
+        for (dy=-1;dy<=1;dy++)
+            for (dx=-1;dx<=1;dx++) {
+                int n = k + dy*w + dx;
+                if (classe[n]==CANNY_FRACO) {
+                    classe[n] = CANNY_FORTE;
+                    fila[nfila++] = n;
+                }
+            }
+    }
+
+    free(fila);
+    free(classe);
+    return edges;
+}
+
+/* implementacao da reducao de cores por median cut */
+typedef struct
+{
+    float r, g, b;
+} color;
+
+typedef struct
+{
+    color max;     /* maximos R's, G's e B's */
+    color min;	   /* minimos R's, G's e B's */
+    float var;	   /* variacao em cada cubo  */
+    int ini;	   /* final do cubo  */
+    int fim;       /* inicio do cubo */
+    int maiorDim;  /* R=0, G=1, B=2  */
+    int checked;
+} colorCube;
+
+static int comparaR(const void * p1, const void * p2)
+{
+    color *color1 = (color *) p1;
+    color *color2 = (color *) p2;
+
+    color c1 = *color1;
+    color c2 = *color2;
+
+    if (c1.r < c2.r) return -1;
+    if (c1.r > c2.r) return  1;
+
+    return 0;
+}
+
+static int comparaG(const void * p1, const void * p2)
+{
+    color *color1 = (color *) p1;
+    color *color2 = (color *) p2;
+
+    color c1 = *color1;
+    color c2 = *color2;
+
+    if (c1.g < c2.g) return -1;
+    if (c1.g > c2.g) return  1;
+
+    return 0;
+}
+
+static int comparaB(const void * p1, const void * p2)
+{
+    color *color1 = (color *) p1;
+    color *color2 = (color *) p2;
+
+    color c1 = *color1;
+    color c2 = *color2;
+
+    if (c1.b < c2.b) return -1;
+    if (c1.b > c2.b) return  1;
+
+    return 0;
+}
+
+static void caixaEnvolvente(colorCube* cube, color* colorVec)
+{
+    float r,g,b;
+    int i; 
+    TRC_INICIO(t);
+
+    /* inicializa com o pior caso */
+    cube->min.r = cube->min.g = cube->min.b = 1.0; 
+    cube->max.r = cube->max.g = cube->max.b = 0.0;
+
+    /* percorre o cubo ajustando o domnio das cores */
+    for (i=cube->ini;i<=cube->fim;i++){
+        r = colorVec[i].r;
+        if (r > cube->max.r) cube->max.r = r;
+        if (r < cube->min.r) cube->min.r = r;
+        g = colorVec[i].g;
+        if (g > cube->max.g) cube->max.g = g;
+        if (g < cube->min.g) cube->min.g = g;
+        b = colorVec[i].b;
+        if (b > cube->max.b) cube->max.b = b;
+        if (b < cube->min.b) cube->min.b = b;
+    }
+    TRC_FIM(t, "caixaEnvolvente");
+}
+
+/* Troca cada pixel de uma linha de w pixels pela cor mais proxima da paleta de n cores,
+   dada por componentes (pr, pg, pb). As distancias a todas as cores sao calculadas num
+   laco vetorizavel em dist; a cor escolhida e' a primeira de distancia minima. */
+typedef void (*KernelPaleta)(const float* src, float* dst, int dcs1, const float* pr,
+                             const float* pg, const float* pb, int n, float* dist, int w);
+
+#define DEF_LINHA_PALETA(D, T, nome)                                                \
+static void KERNEL_NOME(nome, D, T)(const T* src, float* dst, int dcs1,             \
+                                    const float* pr, const float* pg,               \
+                                    const float* pb, int n, float* dist, int w)     \
+{                                                                                   \
+    int x, i;                                                                       \
+    for (x=0;x<w;x++) {                                                             \
+        const T* p = src + (size_t)x*D;                                             \
+        float r = p[0], g = p[(D>=3)?1:0], b = p[(D>=3)?2:0];                       \
+        float m_menor = FLT_MAX;                                                    \
+        float rgb1[3];                                                              \
+                                                                                    \
+        _Pragma("omp simd reduction(min:m_menor)")                                  \
+        for (i=0;i<n;i++) {                                                         \
+            float dr = r - pr[i], dg = g - pg[i], db = b - pb[i];                   \
+            dist[i] = (dr*dr) + (dg*dg) + (db*db);                                  \
+            m_menor = (dist[i] < m_menor) ? dist[i] : m_menor;                      \
+        }                                                                           \
+        for (i=0;i<n-1 && dist[i]!=m_menor;i++)                                     \
+            ;                                                                       \
+        rgb1[0] = pr[i]; rgb1[1] = pg[i]; rgb1[2] = pb[i];                          \
+        imgRowSet3fv(dst, dcs1, x, rgb1);                                           \
+    }                                                                               \
+}
+
+KERNEL_CANAIS(DEF_LINHA_PALETA, float, LinhaPaleta)
+KERNEL_SELETOR(KernelPaleta, EscolheLinhaPaleta, LinhaPaleta, float)
+
+static Image* bestColor(Image *img0, color* pal, Image* img1, int pal_size)
+{
+    int w = imgGetWidth(img0);
+    int h = imgGetHeight(img0);
+    int dcs1 = imgGetDimColorSpace(img1);
+    KernelPaleta procura = EscolheLinhaPaleta(imgGetDimColorSpace(img0));
+    float* comp = (float*)malloc(4*pal_size*sizeof(float));   /* r, g, b e distancias */
+    int y,i;
+    TRC_INICIO(t);
+
+    assert(comp);
+    for (i=0;i<pal_size;i++) {
+        comp[i]            = pal[i].r;
+        comp[pal_size+i]   = pal[i].g;
+        comp[2*pal_size+i] = pal[i].b;
+    }
+    for (y=0;y<h;y++)
+        procura(imgGetRowConst(img0,y), imgGetRow(img1,y), dcs1, comp, comp+pal_size,
+                comp+2*pal_size, pal_size, comp+3*pal_size, w);
+    free(comp);
+    TRC_FIM(t, "bestColor");
+    return img1;
+}
+
+static void paleta(color* pal, colorCube* cubeVec, color* colorVec, int numCubos)
+{
+    float sumvar[3];
+    int count;
+    int i,j;
+
+    for(i=0;i<numCubos;i++)
+    {
+        sumvar[0] = sumvar[1] = sumvar[2] = 0.0;
+        count = 0;
+
+        for(j=cubeVec[i].ini;j<=cubeVec[i].fim;j++)
+        {
+            sumvar[0] += colorVec[j].r;
+            sumvar[1] += colorVec[j].g;
+            sumvar[2] += colorVec[j].b;
+            count++;
+        }
+
+        pal[i].r = sumvar[0]/count;
+        pal[i].g = sumvar[1]/count;
+        pal[i].b = sumvar[2]/count;
+    }
+}
+
+static void ordenaMaiorDim(colorCube* cubeVec, color* colorVec, int i)
+{
+    size_t numElem;
+    size_t tamElem;
+    float var[3];
+    TRC_INICIO(t);
+
+    numElem = (size_t)(cubeVec[i].fim - cubeVec[i].ini + 1);
+    tamElem = (size_t)(sizeof(color));
+
+    var[0] = cubeVec[i].max.r - cubeVec[i].min.r;
+    var[1] = cubeVec[i].max.g - cubeVec[i].min.g;
+    var[2] = cubeVec[i].max.b - cubeVec[i].min.b;
+
+    /* procura a maior dimensao em um cubo */
+    if((var[0]>=var[1])&&(var[0]>=var[2])) cubeVec[i].maiorDim = 0;
+    else
+        if((var[1]>=var[0])&&(var[1]>=var[2])) cubeVec[i].maiorDim = 1;
+        else
+            if((var[2]>var[0]) && (var[2]>var[1])) cubeVec[i].maiorDim = 2;
+
+    /* ordena de acordo com a maior dimensao da caixa */
+    if(cubeVec[i].maiorDim == 0)
+    {
+        qsort(&colorVec[cubeVec[i].ini],numElem,tamElem,comparaR);
+        cubeVec[i].var = var[0];
+    }
+    if(cubeVec[i].maiorDim == 1)
+    {
+        qsort(&colorVec[cubeVec[i].ini],numElem,tamElem,comparaG);
+        cubeVec[i].var = var[1];
+    }
+    if(cubeVec[i].maiorDim == 2)
+    {
+        qsort(&colorVec[cubeVec[i].ini],numElem,tamElem,comparaB);
+        cubeVec[i].var = var[2];
+    }
+    TRC_FIM(t, "ordenaMaiorDim");
+    TRC_CONTA("ordenaMaiorDim.cores", (double)numElem);
+}
+
+static void cortaCubo(colorCube* cubeVec, int posCorte, int numCubos)
+{
+    /* divide o cubo */
+    int ini = cubeVec[posCorte].ini;
+    int fim = cubeVec[posCorte].fim;
+
+    if((fim - ini)%2 != 0) /* numero par de elementos */
+    {
+        cubeVec[numCubos].ini = ini + (fim - ini + 1)/2;
+        cubeVec[numCubos].fim = fim;
+        cubeVec[posCorte].fim = cubeVec[numCubos].ini - 1;
+    }
+    else /* numero impar de elementos */
+    {
+        cubeVec[numCubos].ini = ini + (fim - ini)/2;
+        cubeVec[numCubos].fim = fim;
+        cubeVec[posCorte].fim = cubeVec[numCubos].ini - 1;
+    }
+}
+
+static int cuboCorte(colorCube* cubeVec, int numCubos)
+{
+    /* escolhe o cubo a ser cortado */
+    float maiorVar = -1;
+    int posCorte = -1;
+    int k;
+    for(k=0;k<numCubos;k++)
+    {
+        /* cubo com uma unica cor */
+        if((cubeVec[k].max.r == cubeVec[k].min.r)&&(cubeVec[k].max.g == cubeVec[k].min.g)&&(cubeVec[k].max.b == cubeVec[k].min.b))
+            continue;
+
+        if(cubeVec[k].var>maiorVar)
+        {
+            maiorVar = cubeVec[k].var;
+            posCorte = k;
+        }
+    }
+
+    return posCorte;
+}
+
+
+/* Calcula a paleta de ate maxCores cores de img0 pelo corte mediano; devolve o numero de cores. */
+static int paletaCorteMediano(Image * img0, color* pal, int maxCores)
+{
+    int w = imgGetWidth(img0);
+    int h = imgGetHeight(img0);
+
+    int x,y,i,j,numCubos = 0;
+    int posCorte = -1;
+    float rgb[3];
+    const ImageStats* st;
+    TRC_INICIO(t);
+
+    colorCube* cubeVec = (colorCube*)malloc(maxCores*sizeof(colorCube)); /* vetor de cubos */
+    color* colorVec = (color*)malloc(w*h*sizeof(color)); /* vetor  de cores */
 
     /* guarda as cores nos vetores (com repeticao) */
     i = 0;
     for (y=0;y<h;y++){
+        const float* row = imgGetRowConst(img0,y);
         for (x=0;x<w;x++){
-            imgGetPixel3fv(img0,x,y,rgb);
+            imgRowGet3fv(row,img0->dcs,x,rgb);
             colorVec[i].r = rgb[0];
             colorVec[i].g = rgb[1];
             colorVec[i].b = rgb[2];
             i++;
         }
     }
+    TRC_FIM(t, "corteMediano.cores");
 
-    /* cria o cubo inicial */
-    cubeVec[0].checked = 0;
+    /* cria o cubo inicial; sua caixa envolvente e' a de toda a imagem,
+       ja disponivel no cache de estatisticas */
+    st = imgGetStats(img0);
     cubeVec[0].fim = w*h-1;
     cubeVec[0].ini = 0;
+    cubeVec[0].min.r = st->min[0]; cubeVec[0].max.r = st->max[0];
+    cubeVec[0].min.g = st->min[1]; cubeVec[0].max.g = st->max[1];
+    cubeVec[0].min.b = st->min[2]; cubeVec[0].max.b = st->max[2];
+    ordenaMaiorDim(cubeVec, colorVec, 0);
+    cubeVec[0].checked = 1;
+
+    numCubos = 1;
+
+    TRC_REINICIA(t);
+    for(j=0;j<maxCores-1;j++)
+    {
+        for(i=0;i<numCubos;i++)
+        {
+            if(cubeVec[i].checked) continue;
+
+            /* calcula os maximos e os minimos */
+            caixaEnvolvente(&cubeVec[i], colorVec);
+
+            /* ordena de acordo com a maior dimensao */
+            ordenaMaiorDim(cubeVec, colorVec, i);
+
+            cubeVec[i].checked = 1;
+        }
+
+        /* escolhe o cubo a ser cortado */
+        posCorte = cuboCorte(cubeVec, numCubos);
+
+        if(posCorte == -1) break;
+
+        /* divide o cubo */
+        cortaCubo(cubeVec, posCorte, numCubos);
+
+        cubeVec[numCubos].checked = 0;
+        cubeVec[posCorte].checked = 0;
+
+        numCubos++;
+    }
+    TRC_FIM(t, "corteMediano.cortes");
+    TRC_CONTA("corteMediano.cubos", numCubos);
+
+    /* cria a paleta de cores */
+    TRC_REINICIA(t);
+    paleta(pal, cubeVec, colorVec, numCubos);
+    TRC_FIM(t, "corteMediano.paleta");
+
+    free(colorVec);
+    free(cubeVec);
+
+    return numCubos;
+}
+
+void imgReduceColorsFrom(Image * amostra, Image * img0, Image* img1, int maxCores)
+{
+    color* pal = (color*)malloc(maxCores*sizeof(color)); /* paleta de cores */
+    int numCores = paletaCorteMediano(amostra, pal, maxCores);
+
+    /* preenche a imagem com as cores da paleta */
+    bestColor(img0,&pal[0],img1,numCores);
+
+    free(pal);
+}
+
+void imgReduceColors(Image * img0, Image* img1, int maxCores)
+{
+    imgReduceColorsFrom(img0, img0, img1, maxCores);
+}
+
+
+/******************************************************************************************************/
+/* Quantiza um valor de cor em [0,1] para um dos N_CORES niveis do histograma                         */
+/******************************************************************************************************/
+KERNEL_INLINE int Nivel( float v )
+{
+	int l = (int) ( v * MAIOR_COR );
+	return ( l < 0 ) ? 0 : ( l > MAIOR_COR ) ? MAIOR_COR : l;
+}
+
+/******************************************************************************************************/
+/* Acumula as somas, minimos, maximos e histogramas de uma linha de n pixels. Os indices 0..2 sao os  */
+/*   canais e o 3 a luminancia; imagens de uma componente so' acumulam a luminancia. As somas, os     */
+/*   minimos e os maximos sao feitos num laco separado dos histogramas para que o compilador possa    */
+/*   vetoriza-lo (a linha ja esta no cache).                                                          */
+/******************************************************************************************************/
+typedef void (*KernelEstat)( const float* row, int n, double* s, double* s2, float* mn, float* mx,
+                             int* grey, int (*rgb)[N_CORES] );
+
+#define DEF_LINHA_ESTAT( D, T, nome )                                                        \
+static void KERNEL_NOME( nome, D, T )( const T* row, int n, double* s, double* s2,           \
+                                       float* mn, float* mx, int* grey, int (*rgb)[N_CORES] )\
+{                                                                                            \
+	double a[4] = { 0, 0, 0, 0 }, a2[4] = { 0, 0, 0, 0 };                                    \
+	float  lo[4], hi[4];                                                                     \
+	int    x, c, c0 = ( D >= 3 ) ? 0 : 3;                                                    \
+                                                                                             \
+	for( c = 0; c < 4; c++ ) {                                                               \
+		lo[c] = mn[c];                                                                       \
+		hi[c] = mx[c];                                                                       \
+	}                                                                                        \
+	for( x = 0; x < n; x++ )                                                                 \
+	{                                                                                        \
+		const T* p = row + (size_t) x * D;                                                   \
+		float    v[4];                                                                       \
+		for( c = c0; c < 3; c++ )                                                            \
+			v[c] = (float) p[c];                                                             \
+		v[3] = KERNEL_LUMA( p, D );                                                          \
+		for( c = c0; c < 4; c++ )                                                            \
+		{                                                                                    \
+			a[c] += v[c]; a2[c] += v[c]*v[c];                                                \
+			lo[c] = ( v[c] < lo[c] ) ? v[c] : lo[c];                                         \
+			hi[c] = ( v[c] > hi[c] ) ? v[c] : hi[c];                                         \
+		}                                                                                    \
+	}                                                                                        \
+	for( x = 0; x < n; x++ )                                                                 \
+	{                                                                                        \
+		const T* p = row + (size_t) x * D;                                                   \
+		for( c = c0; c < 3; c++ )                                                            \
+			rgb[c][Nivel( (float) p[c] )]++;                                                 \
+		grey[Nivel( KERNEL_LUMA( p, D ) )]++;                                                \
+	}                                                                                        \
+	for( c = c0; c < 4; c++ )                                                                \
+	{                                                                                        \
+		s[c] += a[c]; s2[c] += a2[c];                                                        \
+		mn[c] = lo[c]; mx[c] = hi[c];                                                        \
+	}                                                                                        \
+}
+
+KERNEL_CANAIS( DEF_LINHA_ESTAT, float, LinhaEstat )
+KERNEL_SELETOR( KernelEstat, EscolheLinhaEstat, LinhaEstat, float )
+
+/******************************************************************************************************/
+/* Calcula, em uma unica passada sobre o retangulo [x0,x1)x[y0,y1), os histogramas de luminancia e    */
+/*   de cada canal, os minimos, maximos, medias e variancias.                                         */
+/* As linhas sao divididas entre as threads; cada thread acumula em variaveis locais que sao somadas  */
+/*   no final.                                                                                        */
+/******************************************************************************************************/
+static void CalculateStats( ImageStats* st, Image* img, int x0, int y0, int x1, int y1 )
+{
+	int    dcs = img->dcs;
+	int    c;
+	double soma[4], soma2[4];   /* canais 0..2 e luminancia (3) */
+	KernelEstat estat = EscolheLinhaEstat( dcs );
+	float  mn[4], mx[4];
+
+	memset( st, 0, sizeof(ImageStats) );
+	for( c = 0; c < 4; c++ ) {
+		soma[c] = soma2[c] = 0.0;
+		mn[c] = FLT_MAX;
+		mx[c] = -FLT_MAX;
+	}
+	st->npixels = ( x1 - x0 ) * ( y1 - y0 );
+	if( st->npixels <= 0 ) {
+		st->npixels = 0;
+		return;
+	}
+
+#pragma omp parallel
+	{
+		int    grey[N_CORES], rgb[3][N_CORES];
+		double s[4] = { 0.0, 0.0, 0.0, 0.0 }, s2[4] = { 0.0, 0.0, 0.0, 0.0 };
+		float  tmn[4] = { FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX };
+		float  tmx[4] = { -FLT_MAX, -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		int    y, k, n = x1 - x0;
+
+		memset( grey, 0, sizeof(grey) );
+		memset( rgb, 0, sizeof(rgb) );
+
+#pragma omp for schedule(static) nowait
+		for( y = y0; y < y1; y++ )
+			estat( img->buf + ( (size_t) y * img->width + x0 ) * dcs, n, s, s2, tmn, tmx, grey, rgb );
+
+#pragma omp critical
+		{
+			for( k = 0; k < N_CORES; k++ ) {
+				st->grey[k]   += grey[k];
+				st->rgb[0][k] += rgb[0][k];
+				st->rgb[1][k] += rgb[1][k];
+				st->rgb[2][k] += rgb[2][k];
+			}
+			for( k = 0; k < 4; k++ ) {
+				soma[k]  += s[k];
+				soma2[k] += s2[k];
+				if( tmn[k] < mn[k] ) mn[k] = tmn[k];
+				if( tmx[k] > mx[k] ) mx[k] = tmx[k];
+			}
+		}
+	}
+
+	/* imagens de luminancia tem os tres canais iguais a luminancia */
+	if( dcs == 1 ) {
+		for( c = 0; c < 3; c++ ) {
+			memcpy( st->rgb[c], st->grey, sizeof(st->grey) );
+			soma[c] = soma[3]; soma2[c] = soma2[3];
+			mn[c] = mn[3]; mx[c] = mx[3];
+		}
+	}
+
+	for( c = 0; c < 3; c++ ) {
+		st->min[c]  = mn[c];
+		st->max[c]  = mx[c];
+		st->mean[c] = soma[c] / st->npixels;
+		st->var[c]  = soma2[c] / st->npixels - st->mean[c] * st->mean[c];
+		if( st->var[c] < 0.0 ) st->var[c] = 0.0;
+	}
+	st->grey_min  = mn[3];
+	st->grey_max  = mx[3];
+	st->grey_mean = soma[3] / st->npixels;
+	st->grey_var  = soma2[3] / st->npixels - st->grey_mean * st->grey_mean;
+	if( st->grey_var < 0.0 ) st->grey_var = 0.0;
+}
+
+const ImageStats* imgGetStats( Image* image )
+{
+	if( !image->stats_ok )
+	{
+		if( !image->stats ) {
+			image->stats = (ImageStats*) malloc( sizeof(ImageStats) );
+			assert( image->stats );
+		}
+		CalculateStats( image->stats, image, 0, 0, image->width, image->height );
+		image->stats_ok = 1;
+	}
+	return image->stats;
+}
+
+/*- Imagem binaria (1 bit por pixel) ------------------------------------------------------------------*/
+
+Bitmap* bmpCreate( int w, int h )
+{
+	Bitmap* bmp = (Bitmap*) malloc( sizeof(Bitmap) );
+	assert( bmp );
+	bmp->width  = w;
+	bmp->height = h;
+	bmp->stride = ( w + 7 ) / 8;
+	bmp->bits   = (unsigned char*) calloc( (size_t) bmp->stride * h, 1 );
+	assert( bmp->bits );
+	return bmp;
+}
+
+void bmpDestroy( Bitmap* bmp )
+{
+	if( bmp )
+	{
+		if( bmp->bits ) free( bmp->bits );
+		free( bmp );
+	}
+}
+
+int bmpGetWidth( Bitmap* bmp )
+{
+	return bmp->width;
+}
+
+int bmpGetHeight( Bitmap* bmp )
+{
+	return bmp->height;
+}
+
+int bmpGetPixel( Bitmap* bmp, int x, int y )
+{
+	return ( bmp->bits[y * bmp->stride + x / 8] >> ( 7 - x % 8 ) ) & 1;
+}
+
+Image* bmpToImage( Bitmap* bmp )
+{
+	int    w = bmp->width, h = bmp->height;
+	Image* img = imgCreate( w, h, 1 );
+	int    y;
+
+#pragma omp parallel for schedule(static)
+	for( y = 0; y < h; y++ )
+	{
+		const unsigned char* src = bmp->bits + (size_t) y * bmp->stride;
+		float* dst = img->buf + (size_t) y * w;
+		int x;
+
+		for( x = 0; x < w; x++ )
+			dst[x] = (float) ( ( src[x >> 3] >> ( 7 - ( x & 7 ) ) ) & 1 );
+	}
+	return img;
+}
+
+int bmpWriteBMP( char *filename, Bitmap* bmp )
+{
+	FILE*          filePtr;
+	unsigned char* filedata;
+	int            linesize, x, y;
+
+	if( !bmp ) return 0;
+
+	filePtr = fopen( filename, "wb" );
+	assert( filePtr );
+
+	/* a linha deve terminar em uma double word boundary */
+	linesize = ( 3 * bmp->width + 3 ) & ~3;
+	putBMPHeader( filePtr, bmp->width, bmp->height, linesize );
+
+	filedata = (unsigned char*) calloc( linesize, 1 );
+	assert( filedata );
+
+	for( y = 0; y < bmp->height; y++ )
+	{
+		const unsigned char* src = bmp->bits + (size_t) y * bmp->stride;
+
+		for( x = 0; x < bmp->width; x++ )
+			filedata[3*x] = filedata[3*x+1] = filedata[3*x+2] =
+				( ( src[x >> 3] >> ( 7 - ( x & 7 ) ) ) & 1 ) ? 255 : 0;
+
+		if( fwrite( filedata, linesize, 1, filePtr ) != 1 ) {
+			fprintf( stderr, "bmpWriteBMP: Disk full." );
+			free( filedata );
+			fclose( filePtr );
+			return 0;
+		}
+	}
+
+	free( filedata );
+	fclose( filePtr );
+	return 1;
+}
+
+/******************************************************************************************************/
+/* Binarizacao fundida: le cada pixel uma unica vez, calcula a luminancia, compara com o threshold    */
+/*   e empacota 8 pixels por byte. Imagens RGB nao precisam passar por imgGrey antes.                 */
+/******************************************************************************************************/
+typedef void (*KernelBinariza)( const float* src, unsigned char* dst, int w, float threshold );
+
+#define DEF_LINHA_BINARIZA( D, T, nome )                                              \
+static void KERNEL_NOME( nome, D, T )( const T* src, unsigned char* dst, int w,       \
+                                       float threshold )                              \
+{                                                                                     \
+	int x, i;                                                                         \
+	for( x = 0; x + 8 <= w; x += 8 )                                                  \
+	{                                                                                 \
+		unsigned char byte = 0;                                                       \
+		for( i = 0; i < 8; i++ )                                                      \
+		{                                                                             \
+			float l = KERNEL_LUMA( src + (size_t) ( x + i ) * D, D );                 \
+			byte |= (unsigned char) ( ( l > threshold ) << ( 7 - i ) );               \
+		}                                                                             \
+		dst[x >> 3] = byte;                                                           \
+	}                                                                                 \
+	for( ; x < w; x++ )                                                               \
+		if( KERNEL_LUMA( src + (size_t) x * D, D ) > threshold )                      \
+			dst[x >> 3] |= (unsigned char) ( 1 << ( 7 - ( x & 7 ) ) );                \
+}
+
+KERNEL_CANAIS( DEF_LINHA_BINARIZA, float, LinhaBinariza )
+KERNEL_SELETOR( KernelBinariza, EscolheLinhaBinariza, LinhaBinariza, float )
+
+Bitmap* imgBinarize( Image* image, float threshold )
+{
+	int            w = image->width, h = image->height, dcs = image->dcs;
+	Bitmap*        bmp = bmpCreate( w, h );
+	KernelBinariza binariza = EscolheLinhaBinariza( dcs );
+	int            y;
+
+#pragma omp parallel for schedule(static)
+	for( y = 0; y < h; y++ )
+		binariza( image->buf + (size_t) y * w * dcs, bmp->bits + (size_t) y * bmp->stride, w, threshold );
+
+	return bmp;
+}
+
+/* binariza e expande, para as funcoes que devolvem Image */
+static Image* Binariza( Image* greyImage, float thresholdF )
+{
+	Bitmap* bmp = imgBinarize( greyImage, thresholdF );
+	Image*  img = bmpToImage( bmp );
+	bmpDestroy( bmp );
+	return img;
+}
+
+/******************************************************************************************************/
+/* Baseado no artigo "A Threshold Selection Method from Gray-Level Histograms",
+/*   de N. Otsu, disponvel em http://ieeexplore.ieee.org/stamp/stamp.jsp?arnumber=04310076
+/* Artigo citado em "Automatic Recognition Algorithm of Quick Response Code Based on Embedded System",
+/*   de Y. Liu e M. Liu, disponvel em http://portal.acm.org/citation.cfm?id=1173502
+/******************************************************************************************************/
+static int OtsuNivel( const int* histograma, int numberOfPixels )
+{
+	float  probabilidade[N_CORES], omega[N_CORES], mu[N_CORES];
+	int    threshold;
+	int    i;
+	float  maxSigma, sigma, numerador, quociente;
+
+	/* Calculando a probabilidade (eq. 1) */
+	for( i = 0; i < N_CORES; i++ )
+		probabilidade[i] =  (float) histograma[i] / (float) numberOfPixels;
+
+	/* Calculando omega e mu (eqs. 6 e 7)  */
+	omega[0] = probabilidade[0];
+	mu[0]    = 0.0;
+	for( i = 1; i < N_CORES; i++ )
+	{
+		omega[i] = omega[i-1] + probabilidade[i];
+		mu[i]    = mu[i-1] + (i * probabilidade[i]);
+	}
+
+	/* Calculando e achando o maior sigma (eq. 18) */
+	threshold = 0;
+	maxSigma  = 0.0;
+	for( i = 0; i < MAIOR_COR; i++ ) {
+		sigma = 0.0;
+
+		if( omega[i] >= 0.0 && omega[i] <= 1.0 )
+		{
+			numerador = mu[MAIOR_COR] * omega[i] - mu[i];
+			quociente = omega[i] * (1.0f - omega[i]);
+			sigma = (numerador * numerador) / quociente;
+		}
+
+		if( sigma > maxSigma )
+		{
+			maxSigma  = sigma;
+			threshold = i;
+		}
+	}
+
+	return threshold;
+}
+
+float imgOtsuThreshold( Image* greyImage )
+{
+	/* O histograma vem do cache de estatisticas da imagem */
+	const int* histograma = imgGetStats( greyImage )->grey;
+	int threshold = OtsuNivel( histograma, imgGetWidth( greyImage ) * imgGetHeight( greyImage ) );
+
+	return (float) threshold / (float) MAIOR_COR;
+}
+
+Image* imgBinOtsu( Image* greyImage )
+{
+	return Binariza( greyImage, imgOtsuThreshold( greyImage ) );
+}
+
+/******************************************************************************************************/
+/* Baseado no artigo "Barcode Readers using the Camera Device in Mobile Phones", de E. Ohbuchi,       */
+/*   disponvel em http://portal.acm.org/citation.cfm?id=1033123                                      */
+/* Artigo citado em "Automatic Recognition Algorithm of Quick Response Code Based on Embedded System",*/
+/* de Y. Liu e M. Liu, disponvel em http://portal.acm.org/citation.cfm?id=1173502                    */
+/******************************************************************************************************/
+float imgOhbuchiThreshold( Image* greyImage )
+{
+	int    i;
+	int    x, y, x0, y0;
+	int    w, h, dcs;
+	int    tamanhoQuadradoCentral, tamanhoBloco;
+	int    thresholdGlobal, valorMedio;
+	long   soma[9];
+	float* luma;
+
+	/* Como o algoritmo original de Ohbuchi considera o quadrado central de dimensoes 60x60   */
+	/*   para uma imagem de tamanho 320x240, para generalizar o algoritmo, pega-se o quadrado */
+	/*   central cujas dimenses sejam 1/4 da menor dimenso da imagem.                       */
+	w   = imgGetWidth( greyImage );
+	h   = imgGetHeight( greyImage );
+	dcs = imgGetDimColorSpace( greyImage );
+	if( w > h )
+		tamanhoQuadradoCentral = h;
+	else
+		tamanhoQuadradoCentral = w;
+
+	tamanhoQuadradoCentral  = tamanhoQuadradoCentral / 4; /* tamanho da area central  */
+
+	/* Tendo o quadrado central, cada um dos 9 blocos a serem analisados tem dimensao igual a 1/3 */
+	/*   do quadrado central.                */                                                  
+	tamanhoBloco = tamanhoQuadradoCentral / 3; /* tamanho de cada bloco */
+
+	/* Imagem pequena demais para os 9 blocos: usa a media global do cache de estatisticas */
+	if( tamanhoBloco == 0 )
+	{
+		thresholdGlobal = (int) ( imgGetStats( greyImage )->grey_mean * MAIOR_COR );
+		return (float) thresholdGlobal / (float) MAIOR_COR;
+	}
+
+	/* Os 9 blocos sao acumulados numa unica passada sobre o quadrado central: a media de cada    */
+	/*   bloco (media ponderada do seu histograma) e' a soma dos niveis dividida pelo numero de pontos */
+	x0 = ( w - tamanhoQuadradoCentral ) / 2; /* ponto inicial do 1o bloco na coordenada X */
+	y0 = ( h - tamanhoQuadradoCentral ) / 2; /* ponto inicial do 1o bloco na coordenada Y  */
+	for( i = 0; i < 9; i++ )
+		soma[i] = 0;
+
+	luma = (float*) malloc( 3 * tamanhoBloco * sizeof(float) );
+	assert( luma );
+	for( y = 0; y < 3 * tamanhoBloco; y++ )
+	{
+		long* somaLinha = &soma[3 * ( y / tamanhoBloco )];
+
+		EscolheLinhaLuma( dcs )( greyImage->buf + ( (size_t) ( y0 + y ) * w + x0 ) * dcs, luma, 3 * tamanhoBloco );
+		for( x = 0; x < 3 * tamanhoBloco; x++ )
+			somaLinha[x / tamanhoBloco] += Nivel( luma[x] );
+	}
+	free( luma );
+
+	/* A menor das medias sera o threshold global da imagem  */
+	thresholdGlobal = MAIOR_COR + 1;         /*  inicia a variavel com o maior valor  */
+	for( i = 0; i < 9; i++ )
+	{
+		valorMedio = (int) ( soma[i] / ( tamanhoBloco * tamanhoBloco ) );
+
+		if( valorMedio < thresholdGlobal )
+			thresholdGlobal = valorMedio;
+	}
+
+	return (float) thresholdGlobal / (float) MAIOR_COR;
+}
+
+Image* imgBinOhbuchi( Image* greyImage )
+{
+	/* Tendo o valor threshold, cria-se a nova imagem, resultante da binarizacao */
+	return Binariza( greyImage, imgOhbuchiThreshold( greyImage ) );
+}
+
+/******************************************************************************************************/
+/* Otsu multi-nivel. Com omega[i] e mu[i] acumulados (como em imgOtsuThreshold), a contribuicao de    */
+/*   uma classe com os niveis (a,b] para a variancia entre classes e' (mu[b]-mu[a])^2/(omega[b]-      */
+/*   omega[a]) (a menos de uma constante). melhor[c][b] guarda a maior soma possivel dividindo os      */
+/*   niveis [0,b] em c+1 classes e corte[c][b] o ultimo threshold que a atinge.                        */
+/******************************************************************************************************/
+static double VarianciaClasse( const double* omega, const double* mu, int a, int b )
+{
+	double w = omega[b] - ( ( a < 0 ) ? 0.0 : omega[a] );
+	double m = mu[b]    - ( ( a < 0 ) ? 0.0 : mu[a] );
+	return ( w > 0.0 ) ? m * m / w : 0.0;
+}
 
-    numCubos = 1;
+static void OtsuMultiNiveis( Image* greyImage, int n, int* niveis )
+{
+	const int* histograma = imgGetStats( greyImage )->grey;
+	double  omega[N_CORES], mu[N_CORES];
+	double* melhor;
+	int*    corte;
+	double  total;
+	int     c, a, b;
+
+	total = (double) imgGetWidth( greyImage ) * imgGetHeight( greyImage );
+	omega[0] = histograma[0] / total;
+	mu[0]    = 0.0;
+	for( b = 1; b < N_CORES; b++ )
+	{
+		omega[b] = omega[b-1] + histograma[b] / total;
+		mu[b]    = mu[b-1] + b * ( histograma[b] / total );
+	}
 
-    for(j=0;j<maxCores-1;j++)
-    {
-        for(i=0;i<numCubos;i++)
-        {
-            if(cubeVec[i].checked) continue;
+	melhor = (double*) malloc( (size_t) ( n + 1 ) * N_CORES * sizeof(double) );
+	corte  = (int*)    malloc( (size_t) ( n + 1 ) * N_CORES * sizeof(int) );
+	assert( melhor && corte );
 
-            /* calcula os maximos e os minimos */
-            caixaEnvolvente(&cubeVec[i], colorVec);
+	for( b = 0; b < N_CORES; b++ )
+		melhor[b] = VarianciaClasse( omega, mu, -1, b );
 
-            /* ordena de acordo com a maior dimensao */
-            ordenaMaiorDim(cubeVec, colorVec, i);
+	/* c thresholds: o ultimo threshold a separa [0,a] (c-1 thresholds) de (a,b] */
+	for( c = 1; c <= n; c++ )
+	{
+		double* ant = melhor + (size_t) ( c - 1 ) * N_CORES;
+		double* cur = melhor + (size_t) c * N_CORES;
+		int*    cut = corte  + (size_t) c * N_CORES;
 
-            cubeVec[i].checked = 1;
-        }
+		for( b = c; b < N_CORES; b++ )
+		{
+			double max = -1.0;
+			int    amax = c - 1;
+
+			for( a = c - 1; a < b; a++ )
+			{
+				double v = ant[a] + VarianciaClasse( omega, mu, a, b );
+				if( v > max )
+				{
+					max  = v;
+					amax = a;
+				}
+			}
+			cur[b] = max;
+			cut[b] = amax;
+		}
+	}
 
-        /* escolhe o cubo a ser cortado */
-        posCorte = cuboCorte(cubeVec, numCubos);
+	/* recupera os thresholds a partir da ultima classe, que termina em MAIOR_COR */
+	b = MAIOR_COR;
+	for( c = n; c >= 1; c-- )
+	{
+		niveis[c-1] = corte[(size_t) c * N_CORES + b];
+		b = niveis[c-1];
+	}
 
-        if(posCorte == -1) break;
+	free( melhor );
+	free( corte );
+}
 
-        /* divide o cubo */
-        cortaCubo(cubeVec, posCorte, numCubos);
+void imgOtsuMultiThresholds( Image* image, int n, float* thresholds )
+{
+	int niveis[MAIOR_COR];
+	int i;
 
-        cubeVec[numCubos].checked = 0;
-        cubeVec[posCorte].checked = 0;
+	assert( n >= 1 && n <= MAIOR_COR );
+	OtsuMultiNiveis( image, n, niveis );
+	for( i = 0; i < n; i++ )
+		thresholds[i] = (float) niveis[i] / (float) MAIOR_COR;
+}
 
-        numCubos++;
-    }
+Image* imgOtsuMulti( Image* image, int n, int labels )
+{
+	const int* histograma;
+	int    niveis[MAIOR_COR];
+	float  tabela[N_CORES];         /* valor de saida de cada nivel de luminancia */
+	int    w = image->width, h = image->height, dcs = image->dcs;
+	KernelLuma luma = EscolheLinhaLuma( dcs );
+	Image* imgFinal;
+	int    c, i, ini, y;
 
-    /* cria a paleta de cores */
-    paleta(pal, cubeVec, colorVec, numCubos);
+	assert( n >= 1 && n <= MAIOR_COR );
+	OtsuMultiNiveis( image, n, niveis );
+	histograma = imgGetStats( image )->grey;
 
-    /* preenche a imagem com as cores da paleta */
-    bestColor(img0,&pal[0],img1,maxCores);
+	/* monta a tabela nivel -> classe (ou -> luminancia media da classe) */
+	for( c = 0, ini = 0; c <= n; c++ )
+	{
+		int    fim = ( c < n ) ? niveis[c] : MAIOR_COR;
+		double soma = 0.0, pontos = 0.0;
 
-    free(colorVec);
-    free(cubeVec);
-    free(pal);
+		for( i = ini; i <= fim; i++ )
+		{
+			soma   += (double) i * histograma[i];
+			pontos += histograma[i];
+		}
+		for( i = ini; i <= fim; i++ )
+		{
+			if( labels )
+				tabela[i] = (float) c;
+			else
+				tabela[i] = ( pontos > 0.0 ) ? (float) ( soma / pontos / MAIOR_COR ) : (float) i / MAIOR_COR;
+		}
+		ini = fim + 1;
+	}
 
-    printf("fim\n");
+	imgFinal = imgCreate( w, h, 1 );
 
-    return;
-}
+#pragma omp parallel for schedule(static)
+	for( y = 0; y < h; y++ )
+	{
+		float* dst = imgFinal->buf + (size_t) y * w;
+		int x;
 
+		/* a luminancia e' calculada na propria linha de saida e trocada pelo valor da tabela */
+		luma( image->buf + (size_t) y * w * dcs, dst, w );
+		for( x = 0; x < w; x++ )
+			dst[x] = tabela[Nivel( dst[x] )];
+	}
 
-static float  MAX_LUM[] = { 1.0, 1.0, 1.0 };
-static float  MIN_LUM[] = { 0.0, 0.0, 0.0 };
+	return imgFinal;
+}
 
 /******************************************************************************************************/
-/* A partir de uma imagem, calcula o histograma correspondente ao retangulo delimitado pelos pontos
-/*   (x0, y0) e (x1, y1), onde x1 > x0 e y1 > y0                                                   
+/* Imagens integrais (summed-area tables) da luminancia e do seu quadrado. S[y][x] guarda a soma dos  */
+/*   pixels do retangulo [0,x)x[0,y), logo as tabelas tem (w+1)x(h+1) entradas e a soma de qualquer  */
+/*   retangulo sai de 4 acessos.                                                                      */
 /******************************************************************************************************/
-static void CalculateGreyHistogram( int histograma[], Image* greyImage, int x0, int y0, int x1, int y1 )
+static void CalculateIntegral( Image* greyImage, double* soma, double* soma2 )
 {
-	int   i, x, y;
-	float cor[3];
-	int   luminosidade;
+	int w = greyImage->width, h = greyImage->height, dcs = greyImage->dcs;
+	int W = w + 1;
+	int x, y;
 
-	for( i = 0; i < N_CORES; i++ )
-		histograma[i] = 0;
+	KernelLuma luma = EscolheLinhaLuma( dcs );
+
+	memset( soma, 0, W * sizeof(double) );
+	memset( soma2, 0, W * sizeof(double) );
 
-	for( y = y0; y < y1; y++ ) 
+	/* somas acumuladas em cada linha (independentes entre si) */
+#pragma omp parallel private(x)
 	{
-		for( x = x0; x < x1; x++ )
+		float* l = (float*) malloc( w * sizeof(float) );
+		assert( l );
+
+#pragma omp for schedule(static)
+		for( y = 0; y < h; y++ )
 		{
-			imgGetPixel3fv( greyImage, x, y, cor );
-			luminosidade = (int) ( cor[0] * MAIOR_COR );
+			double* s  = soma  + (size_t) ( y + 1 ) * W;
+			double* s2 = soma2 + (size_t) ( y + 1 ) * W;
+			double  acc = 0.0, acc2 = 0.0;
+
+			luma( greyImage->buf + (size_t) y * w * dcs, l, w );
+			s[0] = s2[0] = 0.0;
+			for( x = 0; x < w; x++ )
+			{
+				acc  += l[x];
+				acc2 += (double) l[x] * l[x];
+				s[x+1]  = acc;
+				s2[x+1] = acc2;
+			}
+		}
+		free( l );
+	}
+
+	/* acumula as linhas verticalmente */
+	for( y = 1; y <= h; y++ )
+	{
+		const double* a  = soma  + (size_t) ( y - 1 ) * W;
+		const double* a2 = soma2 + (size_t) ( y - 1 ) * W;
+		double* s  = soma  + (size_t) y * W;
+		double* s2 = soma2 + (size_t) y * W;
 
-			histograma[luminosidade]++;
+		for( x = 0; x < W; x++ )
+		{
+			s[x]  += a[x];
+			s2[x] += a2[x];
 		}
 	}
 }
 
 /******************************************************************************************************/
-/* Calcula o valor medio de um histograma, usando uma media ponderada                                 */
+/* Binarizacao local: para cada pixel calcula a media e o desvio padrao da janela centrada nele       */
+/*   (recortada pela borda da imagem) e compara a luminancia com o threshold do metodo escolhido.    */
 /******************************************************************************************************/
-static int GetMiddleValue( int histograma[] )
+#define ADAPT_SAUVOLA 0
+#define ADAPT_BRADLEY 1
+
+static Bitmap* BinarizaLocal( Image* greyImage, int janela, float k, int metodo )
 {
-	int soma   = 0;
-	int pontos = 0;
-	int i;
+	int     w = greyImage->width, h = greyImage->height, dcs = greyImage->dcs;
+	int     W = w + 1, r;
+	double* soma;
+	double* soma2;
+	Bitmap* bmp;
+	int     y;
 
-	for( i = 0; i < N_CORES; i++ )
+	if( janela < 1 ) janela = 1;
+	r = janela / 2;
+
+	soma  = (double*) malloc( (size_t) W * ( h + 1 ) * sizeof(double) );
+	soma2 = (double*) malloc( (size_t) W * ( h + 1 ) * sizeof(double) );
+	assert( soma && soma2 );
+	CalculateIntegral( greyImage, soma, soma2 );
+
+	bmp = bmpCreate( w, h );
+
+#pragma omp parallel
 	{
-		soma   += i * histograma[i];
-		pontos += histograma[i];
+		KernelLuma luma = EscolheLinhaLuma( dcs );
+		float*     l    = (float*) malloc( w * sizeof(float) );
+		assert( l );
+
+#pragma omp for schedule(static)
+		for( y = 0; y < h; y++ )
+		{
+			int ya = ( y - r < 0 ) ? 0 : y - r;
+			int yb = ( y + r + 1 > h ) ? h : y + r + 1;
+			const double* sa  = soma  + (size_t) ya * W;
+			const double* sb  = soma  + (size_t) yb * W;
+			const double* sa2 = soma2 + (size_t) ya * W;
+			const double* sb2 = soma2 + (size_t) yb * W;
+			unsigned char* dst = bmp->bits + (size_t) y * bmp->stride;
+			int x;
+
+			luma( greyImage->buf + (size_t) y * w * dcs, l, w );
+			for( x = 0; x < w; x++ )
+			{
+				int    xa = ( x - r < 0 ) ? 0 : x - r;
+				int    xb = ( x + r + 1 > w ) ? w : x + r + 1;
+				double n  = (double) ( xb - xa ) * ( yb - ya );
+				double m  = ( sb[xb] - sb[xa] - sa[xb] + sa[xa] ) / n;
+				double threshold;
+
+				if( metodo == ADAPT_SAUVOLA )
+				{
+					double var = ( sb2[xb] - sb2[xa] - sa2[xb] + sa2[xa] ) / n - m * m;
+					double desvio = ( var > 0.0 ) ? sqrt( var ) : 0.0;
+					threshold = m * ( 1.0 + k * ( desvio / 0.5 - 1.0 ) );
+				}
+				else
+					threshold = m * ( 1.0 - k );
+
+				if( l[x] > threshold )
+					dst[x >> 3] |= (unsigned char) ( 1 << ( 7 - ( x & 7 ) ) );
+			}
+		}
+		free( l );
 	}
 
-	return soma / pontos;
+	free( soma );
+	free( soma2 );
+	return bmp;
 }
 
-/******************************************************************************************************/
-/* Baseado no artigo "A Threshold Selection Method from Gray-Level Histograms",
-/*   de N. Otsu, disponvel em http://ieeexplore.ieee.org/stamp/stamp.jsp?arnumber=04310076
-/* Artigo citado em "Automatic Recognition Algorithm of Quick Response Code Based on Embedded System",
-/*   de Y. Liu e M. Liu, disponvel em http://portal.acm.org/citation.cfm?id=1173502
-/******************************************************************************************************/
-Image* imgBinOtsu( Image* greyImage )
+Bitmap* imgBinSauvola( Image* greyImage, int janela, float k )
 {
-	float  probabilidade[N_CORES], omega[N_CORES], mu[N_CORES];
-	int    histograma[N_CORES];
-	int    w, h, numberOfPixels;
-	int    threshold;
-	float  thresholdF;
-	float  cor[3];
-	int    i, x, y;
-	float  maxSigma, sigma, numerador, quociente;
-	Image* imgFinal;
+	return BinarizaLocal( greyImage, janela, k, ADAPT_SAUVOLA );
+}
 
-	/* Calculando o histograma */
-	w = imgGetWidth( greyImage );
-	h = imgGetHeight( greyImage );
-	CalculateGreyHistogram( histograma, greyImage, 0, 0, w, h );
+Bitmap* imgBinBradley( Image* greyImage, int janela, float t )
+{
+	return BinarizaLocal( greyImage, janela, t, ADAPT_BRADLEY );
+}
 
-	/* Calculando a probabilidade (eq. 1) */
-	numberOfPixels = w * h;
-	for( i = 0; i < N_CORES; i++ )
-		probabilidade[i] =  (float) histograma[i] / (float) numberOfPixels;
 
-	/* Calculando omega e mu (eqs. 6 e 7)  */
-	omega[0] = probabilidade[0];
-	mu[0]    = 0.0;
-	for( i = 1; i < N_CORES; i++ )
+/*- Imagens de 8 bits --------------------------------------------------------------------------------*/
+
+/* luminancia em ponto fixo: coeficientes de luminance() multiplicados por 2^16 (somam 65536) */
+#define LUMA_R 13933
+#define LUMA_G 46871
+#define LUMA_B  4732
+
+static unsigned int luminance16( unsigned int r, unsigned int g, unsigned int b )
+{
+	return LUMA_R * r + LUMA_G * g + LUMA_B * b;   /* luminancia*2^16, em [0,255*2^16] */
+}
+
+static unsigned char luminance8( unsigned int r, unsigned int g, unsigned int b )
+{
+	return (unsigned char) ( luminance16( r, g, b ) >> 16 );
+}
+
+/* inverte a ordem dos bits de um byte (_mm_movemask_epi8 gera o pixel 0 no bit 0) */
+static unsigned char InverteBits( unsigned int b )
+{
+	b = ( ( b & 0xF0 ) >> 4 ) | ( ( b & 0x0F ) << 4 );
+	b = ( ( b & 0xCC ) >> 2 ) | ( ( b & 0x33 ) << 2 );
+	b = ( ( b & 0xAA ) >> 1 ) | ( ( b & 0x55 ) << 1 );
+	return (unsigned char) b;
+}
+
+Image8* img8Create( int w, int h, int dcs )
+{
+	Image8* image = (Image8*) malloc( sizeof(Image8) );
+	assert( image );
+	image->width  = w;
+	image->height = h;
+	image->dcs    = dcs;
+	image->buf    = (unsigned char*) calloc( (size_t) w * h * dcs, 1 );
+	assert( image->buf );
+	return image;
+}
+
+void img8Destroy( Image8* image )
+{
+	if( image )
 	{
-		omega[i] = omega[i-1] + probabilidade[i];
-		mu[i]    = mu[i-1] + (i * probabilidade[i]);
+		if( image->buf ) free( image->buf );
+		free( image );
 	}
+}
 
-	/* Calculando e achando o maior sigma (eq. 18) */
-	threshold = 0;
-	maxSigma  = 0.0;
-	for( i = 0; i < MAIOR_COR; i++ ) {
-		sigma = 0.0;
+int img8GetWidth( Image8* image )
+{
+	return image->width;
+}
 
-		if( omega[i] >= 0.0 && omega[i] <= 1.0 )
-		{
-			numerador = mu[MAIOR_COR] * omega[i] - mu[i];
-			quociente = omega[i] * (1.0f - omega[i]);
-			sigma = (numerador * numerador) / quociente;
-		}
+int img8GetHeight( Image8* image )
+{
+	return image->height;
+}
 
-		if( sigma > maxSigma )
+int img8GetDimColorSpace( Image8* image )
+{
+	return image->dcs;
+}
+
+unsigned char* img8GetData( Image8* image )
+{
+	return image->buf;
+}
+
+Image8* img8ReadBMP( char *filename )
+{
+	FILE*   filePtr;
+	Image8* image;
+	BYTE*   linedata;
+	LONG    biWidth, biHeight;
+	int     linesize, x, y;
+	TRC_INICIO( t );
+
+	filePtr = getBMPHeader( filename, &biWidth, &biHeight );
+	TRC_FIM( t, "bmp8.cabecalho" );
+	if( !filePtr ) return NULL;
+
+	image = img8Create( biWidth, biHeight, 3 );
+
+	/* a linha deve terminar em uma fronteira de dword */
+	linesize = ( 3 * image->width + 3 ) & ~3;
+	linedata = (BYTE*) malloc( linesize );
+	assert( linedata );
+
+	/* troca BGR por RGB, sem conversao para float */
+	TRC_REINICIA( t );
+	for( y = 0; y < image->height; y++ )
+	{
+		unsigned char* dst = image->buf + (size_t) y * image->width * 3;
+
+		if( fread( linedata, linesize, 1, filePtr ) != 1 ) {
+			fprintf( stderr, "img8ReadBMP: Unexpected end of file.\n" );
+			break;
+		}
+		for( x = 0; x < image->width; x++ )
 		{
-			maxSigma  = sigma;
-			threshold = i;
+			dst[3*x  ] = linedata[3*x+2];
+			dst[3*x+1] = linedata[3*x+1];
+			dst[3*x+2] = linedata[3*x  ];
 		}
 	}
+	TRC_FIM( t, "bmp8.pixels" );
 
-	/* Criando a nova imagem  */
-	imgFinal   = imgCreate(w, h, 3);
-	thresholdF = (float) threshold / (float) MAIOR_COR;
-	for( y = 0; y < h; y++ ) 
-	{
-		for( x = 0; x < w; x++ )
-		{
-			imgGetPixel3fv( greyImage, x, y, cor );
+	free( linedata );
+	fclose( filePtr );
+	return image;
+}
 
-			if( cor[0] > thresholdF )
-				imgSetPixel3fv( imgFinal, x, y, MAX_LUM );
-			else
-				imgSetPixel3fv( imgFinal, x, y, MIN_LUM );
+int img8WriteBMP( char *filename, Image8* image )
+{
+	FILE*          filePtr;
+	unsigned char* filedata;
+	int            linesize, x, y;
+	TRC_INICIO( t );
+
+	if( !image ) return 0;
+
+	filePtr = fopen( filename, "wb" );
+	assert( filePtr );
+
+	linesize = ( 3 * image->width + 3 ) & ~3;
+	putBMPHeader( filePtr, image->width, image->height, linesize );
+
+	filedata = (unsigned char*) calloc( linesize, 1 );
+	assert( filedata );
+	TRC_FIM( t, "bmp8.cabecalho" );
+
+	TRC_REINICIA( t );
+	for( y = 0; y < image->height; y++ )
+	{
+		const unsigned char* src = image->buf + (size_t) y * image->width * image->dcs;
+
+		if( image->dcs == 3 )
+			for( x = 0; x < image->width; x++ )
+			{
+				filedata[3*x  ] = src[3*x+2];
+				filedata[3*x+1] = src[3*x+1];
+				filedata[3*x+2] = src[3*x  ];
+			}
+		else
+			for( x = 0; x < image->width; x++ )
+				filedata[3*x] = filedata[3*x+1] = filedata[3*x+2] = src[x];
+
+		if( fwrite( filedata, linesize, 1, filePtr ) != 1 ) {
+			fprintf( stderr, "img8WriteBMP: Disk full." );
+			free( filedata );
+			fclose( filePtr );
+			return 0;
 		}
 	}
+	TRC_FIM( t, "bmp8.pixels" );
 
-	return imgFinal;
+	free( filedata );
+	TRC_REINICIA( t );
+	fclose( filePtr );
+	TRC_FIM( t, "bmp8.fechamento" );
+	return 1;
 }
 
-/******************************************************************************************************/
-/* Baseado no artigo "Barcode Readers using the Camera Device in Mobile Phones", de E. Ohbuchi,       */
-/*   disponvel em http://portal.acm.org/citation.cfm?id=1033123                                      */
-/* Artigo citado em "Automatic Recognition Algorithm of Quick Response Code Based on Embedded System",*/
-/* de Y. Liu e M. Liu, disponvel em http://portal.acm.org/citation.cfm?id=1173502                    */
-/******************************************************************************************************/
-Image* imgBinOhbuchi( Image* greyImage )
+Image8* imgToImage8( Image* image )
 {
-	int    i, j;
-	int    x, y, x0;
-	int    w, h;
-	int    tamanhoQuadradoCentral, tamanhoBloco;
-	int    thresholdGlobal, valorMedio;
-	float  thresholdGlobalF;
-	Image* imgFinal;
-	int    histograma[256];
-	float  cor[3];
+	size_t  n = (size_t) image->width * image->height * image->dcs;
+	Image8* img8 = img8Create( image->width, image->height, image->dcs );
+	long    i;
 
-	/* Como o algoritmo original de Ohbuchi considera o quadrado central de dimensoes 60x60   */
-	/*   para uma imagem de tamanho 320x240, para generalizar o algoritmo, pega-se o quadrado */
-	/*   central cujas dimenses sejam 1/4 da menor dimenso da imagem.                       */
-	w = imgGetWidth( greyImage );
-	h = imgGetHeight( greyImage );
-	if( w > h )
-		tamanhoQuadradoCentral = h;
-	else
-		tamanhoQuadradoCentral = w;
+#pragma omp parallel for simd schedule(static)
+	for( i = 0; i < (long) n; i++ )
+	{
+		float v = image->buf[i] * 255.f + 0.5f;
+		img8->buf[i] = (unsigned char) ( ( v < 0.f ) ? 0.f : ( v > 255.f ) ? 255.f : v );
+	}
+	return img8;
+}
 
-	tamanhoQuadradoCentral  = tamanhoQuadradoCentral / 4; /* tamanho da area central  */
+Image* img8ToImage( Image8* image )
+{
+	size_t n = (size_t) image->width * image->height * image->dcs;
+	Image* img = imgCreate( image->width, image->height, image->dcs );
+	long   i;
+
+#pragma omp parallel for simd schedule(static)
+	for( i = 0; i < (long) n; i++ )
+		img->buf[i] = image->buf[i] / 255.f;
+	return img;
+}
 
-	/* Tendo o quadrado central, cada um dos 9 blocos a serem analisados tem dimensao igual a 1/3 */
-	/*   do quadrado central.                */                                                  
-	tamanhoBloco = tamanhoQuadradoCentral / 3; /* tamanho de cada bloco */
+Image8* img8Grey( Image8* image )
+{
+	int     w = image->width, h = image->height;
+	Image8* grey = img8Create( w, h, 1 );
+	int     y;
 
-	/* Percorre-se os 9 blocos, montando o histograma para cada um deles e calculando a media.
-	/* A menor das medias sera o histograma global da imagem  */
-	thresholdGlobal = MAIOR_COR + 1;         /*  inicia a variavel com o maior valor  */
-		x0 = ( w - tamanhoQuadradoCentral ) / 2; /* ponto inicial do 1o bloco na coordenada X */
-	y  = ( h - tamanhoQuadradoCentral ) / 2; /* ponto inicial do 1o bloco na coordenada Y  */
-	for( i = 0; i < 3; i++ )                 /* percorrendo na coordenada Y, incrementando y com tamanhoBloco a cada iterao */
+	if( image->dcs == 1 ) {
+		memcpy( grey->buf, image->buf, (size_t) w * h );
+		return grey;
+	}
+
+#pragma omp parallel for schedule(static)
+	for( y = 0; y < h; y++ )
 	{
-		x = x0;                              /* x inicia sempre no valor menor  */
-		for( j = 0; j < 3; j++ )             /* percorrendo na coordenada X, incrementando x com tamanhoBloco a cada iterao  */
-		{
-			CalculateGreyHistogram( histograma, greyImage, x, y, x + tamanhoBloco, y + tamanhoBloco );
-			valorMedio = GetMiddleValue( histograma );
+		const unsigned char* src = image->buf + (size_t) y * w * 3;
+		unsigned char*       dst = grey->buf  + (size_t) y * w;
+		int x;
+
+#pragma omp simd
+		for( x = 0; x < w; x++ )
+			dst[x] = luminance8( src[3*x], src[3*x+1], src[3*x+2] );
+	}
+	return grey;
+}
+
+void img8Histogram( Image8* image, int histograma[256] )
+{
+	int w = image->width, h = image->height, dcs = image->dcs;
+	int y;
+
+	memset( histograma, 0, N_CORES * sizeof(int) );
+
+#pragma omp parallel
+	{
+		/* quatro histogramas parciais evitam que pixels iguais em sequencia serializem os incrementos */
+		int parcial[4][N_CORES];
+		int i;
 
-			if( valorMedio < thresholdGlobal )
-				thresholdGlobal = valorMedio;
+		memset( parcial, 0, sizeof(parcial) );
 
-			x += tamanhoBloco;
+#pragma omp for schedule(static)
+		for( y = 0; y < h; y++ )
+		{
+			const unsigned char* src = image->buf + (size_t) y * w * dcs;
+			int x = 0;
+
+			if( dcs == 1 )
+			{
+				for( ; x + 4 <= w; x += 4 )
+				{
+					parcial[0][src[x  ]]++;
+					parcial[1][src[x+1]]++;
+					parcial[2][src[x+2]]++;
+					parcial[3][src[x+3]]++;
+				}
+				for( ; x < w; x++ )
+					parcial[0][src[x]]++;
+			}
+			else
+			{
+				for( ; x + 2 <= w; x += 2 )
+				{
+					parcial[0][luminance8( src[3*x  ], src[3*x+1], src[3*x+2] )]++;
+					parcial[1][luminance8( src[3*x+3], src[3*x+4], src[3*x+5] )]++;
+				}
+				for( ; x < w; x++ )
+					parcial[2][luminance8( src[3*x], src[3*x+1], src[3*x+2] )]++;
+			}
 		}
-		y += tamanhoBloco;
+
+#pragma omp critical
+		for( i = 0; i < N_CORES; i++ )
+			histograma[i] += parcial[0][i] + parcial[1][i] + parcial[2][i] + parcial[3][i];
 	}
+}
 
-	/* Tendo o valor threshold, cria-se a nova imagem, resultante da binarizacao */
-	imgFinal = imgCreate(w, h, 3);
-	thresholdGlobalF = (float) thresholdGlobal / (float) MAIOR_COR;
-	for( y = 0; y < h; y++ ) 
+int img8OtsuThreshold( Image8* image )
+{
+	int histograma[N_CORES];
+
+	img8Histogram( image, histograma );
+	return OtsuNivel( histograma, image->width * image->height );
+}
+
+Bitmap* img8Binarize( Image8* image, int threshold )
+{
+	int     w = image->width, h = image->height, dcs = image->dcs;
+	Bitmap* bmp = bmpCreate( w, h );
+	int     y;
+
+	if( threshold >= MAIOR_COR ) return bmp;   /* nenhum pixel acima do threshold */
+
+#pragma omp parallel for schedule(static)
+	for( y = 0; y < h; y++ )
 	{
-		for( x = 0; x < w; x++ )
-		{
-			imgGetPixel3fv( greyImage, x, y, cor );
+		const unsigned char* src = image->buf + (size_t) y * w * dcs;
+		unsigned char*       dst = bmp->bits  + (size_t) y * bmp->stride;
+		int x = 0, i;
 
-			if( cor[0] > thresholdGlobalF )
-				imgSetPixel3fv( imgFinal, x, y, MAX_LUM );
-			else
-				imgSetPixel3fv( imgFinal, x, y, MIN_LUM );
+		if( dcs == 1 )
+		{
+#ifdef __SSE2__
+			/* x > t  <=>  max(x, t+1) == x, com bytes sem sinal */
+			__m128i t1 = _mm_set1_epi8( (char) ( threshold + 1 ) );
+			for( ; x + 16 <= w; x += 16 )
+			{
+				__m128i v = _mm_loadu_si128( (const __m128i*) ( src + x ) );
+				int mask = _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_max_epu8( v, t1 ), v ) );
+				dst[x >> 3]       = InverteBits( mask & 0xFF );
+				dst[( x >> 3 ) + 1] = InverteBits( ( mask >> 8 ) & 0xFF );
+			}
+#endif
+			for( ; x + 8 <= w; x += 8 )
+			{
+				unsigned char byte = 0;
+				for( i = 0; i < 8; i++ )
+					byte |= (unsigned char) ( ( src[x+i] > threshold ) << ( 7 - i ) );
+				dst[x >> 3] = byte;
+			}
+			for( ; x < w; x++ )
+				if( src[x] > threshold )
+					dst[x >> 3] |= (unsigned char) ( 1 << ( 7 - ( x & 7 ) ) );
+		}
+		else
+		{
+			/* compara a luminancia antes do truncamento, como imgBinarize faz em float */
+			unsigned int t16 = (unsigned int) threshold << 16;
+
+			for( ; x + 8 <= w; x += 8 )
+			{
+				unsigned char byte = 0;
+				for( i = 0; i < 8; i++ )
+				{
+					const unsigned char* p = src + 3 * ( x + i );
+					byte |= (unsigned char) ( ( luminance16( p[0], p[1], p[2] ) > t16 ) << ( 7 - i ) );
+				}
+				dst[x >> 3] = byte;
+			}
+			for( ; x < w; x++ )
+			{
+				const unsigned char* p = src + 3 * x;
+				if( luminance16( p[0], p[1], p[2] ) > t16 )
+					dst[x >> 3] |= (unsigned char) ( 1 << ( 7 - ( x & 7 ) ) );
+			}
 		}
 	}
 
-	return imgFinal;
+	return bmp;
+}
+
+
+/*- Instrumentacao ------------------------------------------------------*/
+
+#define TRC_MAX_EVENTOS (1<<18)   /* acima disso os eventos sao descartados */
+#define TRC_MAX_NOMES   64        /* nomes distintos considerados no resumo */
+
+typedef struct {
+    const char* nome;
+    double t0;       /* inicio (intervalos) ou instante (contadores), em segundos */
+    double dur;      /* duracao em segundos; negativa nos contadores             */
+    double valor;    /* valor do contador                                         */
+    int tid;         /* thread que registrou                                      */
+} TrcEvento;
+
+int trcAtivo = 0;
+
+static TrcEvento* trcEventos;
+static int trcNum, trcCap, trcPerdidos;
+static double trcOrigem;
+
+double trcNow(void)
+{
+#ifdef _OPENMP
+    return omp_get_wtime();
+#else
+    return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+
+void trcReset(void)
+{
+#pragma omp critical (trc)
+    {
+        trcNum = trcPerdidos = 0;
+        trcOrigem = trcNow();
+    }
+}
+
+void trcEnable(int on)
+{
+    if (on && !trcAtivo) trcReset();
+    trcAtivo = on;
+}
+
+static void TrcRegistra(const char* nome, double t0, double dur, double valor)
+{
+    int tid = 0;
+#ifdef _OPENMP
+    tid = omp_get_thread_num();
+#endif
+#pragma omp critical (trc)
+    {
+        if (trcNum == trcCap && trcCap < TRC_MAX_EVENTOS) {
+            int cap = trcCap ? 2*trcCap : 1024;
+            TrcEvento* ev = (TrcEvento*)realloc(trcEventos, cap*sizeof(TrcEvento));
+            if (ev) {
+                trcEventos = ev;
+                trcCap = cap;
+            }
+        }
+        if (trcNum < trcCap) {
+            TrcEvento* e = &trcEventos[trcNum++];
+            e->nome = nome;
+            e->t0 = t0 - trcOrigem;
+            e->dur = dur;
+            e->valor = valor;
+            e->tid = tid;
+        } else
+            trcPerdidos++;
+    }
+}
+
+void trcSpan(const char* nome, double t0)
+{
+    TrcRegistra(nome, t0, trcNow() - t0, 0.0);
+}
+
+void trcCounter(const char* nome, double valor)
+{
+    TrcRegistra(nome, trcNow(), -1.0, valor);
+}
+
+int trcWriteJSON(const char* filename)
+{
+    FILE* fp = fopen(filename, "w");
+    int i;
+
+    if (!fp) return 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+#pragma omp critical (trc)
+    for (i=0; i<trcNum; i++) {
+        const TrcEvento* e = &trcEventos[i];
+        if (e->dur >= 0)
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    i ? "," : "", e->nome, e->tid, e->t0*1e6, e->dur*1e6);
+        else
+            fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"valor\":%g}}",
+                    i ? "," : "", e->nome, e->tid, e->t0*1e6, e->valor);
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return 1;
 }
 
+typedef struct {
+    const char* nome;
+    double total;    /* soma das duracoes dos intervalos */
+    double valor;    /* ultimo valor dos contadores      */
+    int n;           /* numero de eventos                */
+    int contador;    /* 1 para contadores                */
+} TrcResumo;
 
+/* intervalos do mais demorado para o menos demorado, contadores no fim */
+static int comparaResumo(const void* p1, const void* p2)
+{
+    const TrcResumo* a = (const TrcResumo*)p1;
+    const TrcResumo* b = (const TrcResumo*)p2;
 
+    if (a->contador != b->contador) return a->contador - b->contador;
+    if (a->total > b->total) return -1;
+    if (a->total < b->total) return  1;
+    return 0;
+}
 
+int trcSummary(char* buf, int len)
+{
+    TrcResumo tab[TRC_MAX_NOMES];
+    int ntab = 0, i, j, pos = 0;
+
+    if (len <= 0) return 0;
+    buf[0] = 0;
+
+    /* agrupa os eventos pelo nome */
+#pragma omp critical (trc)
+    for (i=0; i<trcNum; i++) {
+        const TrcEvento* e = &trcEventos[i];
+        for (j=0; j<ntab; j++)
+            if (tab[j].nome == e->nome || !strcmp(tab[j].nome, e->nome)) break;
+        if (j == ntab) {
+            if (ntab == TRC_MAX_NOMES) continue;
+            tab[j].nome = e->nome;
+            tab[j].total = tab[j].valor = 0.0;
+            tab[j].n = 0;
+            tab[j].contador = e->dur < 0;
+            ntab++;
+        }
+        tab[j].n++;
+        if (e->dur >= 0) tab[j].total += e->dur;
+        else tab[j].valor = e->valor;
+    }
 
+    qsort(tab, ntab, sizeof(TrcResumo), comparaResumo);
 
+    for (i=0; i<ntab && pos < len-1; i++) {
+        int n;
+        if (tab[i].contador)
+            n = snprintf(buf+pos, len-pos, "%s%s=%g", pos ? "  " : "", tab[i].nome, tab[i].valor);
+        else
+            n = snprintf(buf+pos, len-pos, "%s%s %.1f ms (%d)", pos ? "  " : "",
+                    tab[i].nome, tab[i].total*1e3, tab[i].n);
+        if (n < 0) break;
+        pos += n;
+    }
+    if (trcPerdidos && pos < len-1)
+        snprintf(buf+pos, len-pos, "  (%d eventos descartados)", trcPerdidos);
+    return ntab;
+}
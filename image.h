@@ -35,6 +35,8 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <math.h>
+
 
 /************************************************************************/
 /* Tipos Exportados                                                     */
@@ -45,6 +47,94 @@
 
 typedef struct Image_imp Image;
 
+/**
+ *   Imagem binaria (B&W) com 1 bit por pixel, empacotada em bytes.
+ */
+typedef struct Bitmap_imp Bitmap;
+
+/**
+ *   Imagem com componentes de cor de 8 bits (unsigned char [0,255]).
+ */
+typedef struct Image8_imp Image8;
+
+/**
+ *   Sequencia de filtros executada bloco a bloco (ver pipeCreate).
+ */
+typedef struct Pipeline_imp Pipeline;
+
+/**
+ *   Piramide de imagens: a imagem original e suas reducoes sucessivas pela metade.
+ */
+typedef struct Pyramid_imp Pyramid;
+
+/**
+ *   Expressao de imgPointOp ja compilada, para ser executada muitas vezes (ver imgPointOpCompile).
+ */
+typedef struct PointProgram_imp PointProgram;
+
+/**
+ *   Estatisticas de uma imagem, calculadas em uma unica passada
+ *   e mantidas em cache junto da imagem (ver imgGetStats).
+ *   Os histogramas quantizam cada componente em 256 niveis
+ *   (nivel = (int)(valor*255)).
+ */
+typedef struct {
+   int    npixels;        /* numero de pixels considerados               */
+   int    grey[256];      /* histograma de luminancia                    */
+   int    rgb[3][256];    /* histograma de cada canal (R,G,B)            */
+   float  min[3];         /* menor valor de cada canal                   */
+   float  max[3];         /* maior valor de cada canal                   */
+   double mean[3];        /* media de cada canal                         */
+   double var[3];         /* variancia de cada canal                     */
+   float  grey_min;       /* menor luminancia                            */
+   float  grey_max;       /* maior luminancia                            */
+   double grey_mean;      /* media da luminancia                         */
+   double grey_var;       /* variancia da luminancia                     */
+} ImageStats;
+
+/**
+ *   Medidas da diferenca entre duas imagens (ver imgCompare). Os erros sao
+ *   calculados por componente, com os valores em [0,1].
+ */
+typedef struct {
+   double mae;            /* erro absoluto medio                          */
+   double mse;            /* erro quadratico medio                        */
+   double psnr;           /* 10*log10(1/mse), em dB (HUGE_VAL se mse = 0) */
+   double max_err;        /* maior erro absoluto                          */
+   double ssim;           /* SSIM medio da luminancia, em janelas 8x8     */
+} ImageMetrics;
+
+
+/**
+ *   Tratamento da borda nos filtros: como sao obtidos os pixels fora da imagem.
+ */
+#define IMG_BORDA_CONSTANTE 0   /* pixels fora da imagem valem zero            */
+#define IMG_BORDA_REPETE    1   /* repete o pixel mais proximo da borda (clamp) */
+#define IMG_BORDA_ESPELHO   2   /* reflete a imagem na borda (mirror)          */
+#define IMG_BORDA_CIRCULAR  3   /* a imagem se repete periodicamente (wrap)    */
+
+/**
+ *   Metodo de calculo de imgConvolve.
+ */
+#define IMG_CONV_AUTO       0   /* escolhe pelo tamanho e pela separabilidade do kernel */
+#define IMG_CONV_DIRETA     1   /* soma direta sobre o kernel                           */
+#define IMG_CONV_SEPARAVEL  2   /* duas passadas 1D (apenas kernels de posto 1)         */
+#define IMG_CONV_FFT        3   /* produto no dominio da frequencia, por blocos         */
+
+/**
+ *   Filtro de reconstrucao de imgResize.
+ */
+#define IMG_FILTRO_VIZINHO  0   /* vizinho mais proximo                                  */
+#define IMG_FILTRO_BILINEAR 1   /* interpolacao linear em cada eixo                      */
+#define IMG_FILTRO_BICUBICO 2   /* cubica de Keys (a=-0.5)                               */
+#define IMG_FILTRO_AREA     3   /* media ponderada pela area coberta (para reducoes)     */
+
+/**
+ *   Filtro de reducao entre os niveis de uma piramide (pyrCreate).
+ */
+#define IMG_PIRAMIDE_CAIXA  0   /* media de cada bloco 2x2                               */
+#define IMG_PIRAMIDE_GAUSS  1   /* kernel 1 3 3 1 (/8) em cada eixo                      */
+
 
 /************************************************************************/
 /* Funcoes Exportadas                                                   */
@@ -86,6 +176,101 @@ Image* imgCopy(Image* image);
  */
 Image* imgGrey(Image* image);
 
+/**
+ *	Cria uma copia da imagem reamostrada para outras dimensoes. Os pesos sao
+ *  calculados uma vez por eixo e o filtro e' aplicado em duas passadas 1D.
+ *  Na reducao os filtros sao alargados pela escala, evitando aliasing.
+ *
+ *	@param image  imagem de entrada.
+ *	@param w      largura da nova imagem.
+ *	@param h      altura da nova imagem.
+ *	@param filtro filtro de reconstrucao (IMG_FILTRO_*).
+ *
+ *	@return Handle da imagem criada.
+ */
+Image* imgResize(Image* image, int w, int h, int filtro);
+
+/**
+ *	Cria uma copia da imagem com largura e altura aumentadas ate a proxima
+ *  potencia de 2, completando com preto a direita e em cima.
+ *
+ *	@param image imagem de entrada.
+ *
+ *	@return Handle da imagem criada.
+ */
+Image* imgAdjust2eN(Image* image);
+
+/**
+ *	Cria a piramide de uma imagem: o nivel 0 e' a propria imagem (que nao e' copiada)
+ *  e cada nivel seguinte tem metade da largura e da altura do anterior (arredondadas
+ *  para cima), ate 1x1.
+ *
+ *	@param image  imagem do nivel 0; deve existir enquanto a piramide existir.
+ *	@param filtro filtro de reducao (IMG_PIRAMIDE_*).
+ *
+ *	@return Handle da piramide criada.
+ */
+Pyramid* pyrCreate(Image* image, int filtro);
+
+/**
+ *	Destroi a piramide e os niveis reduzidos (o nivel 0 nao e' destruido).
+ *
+ *	@param pyr piramide a ser destruida.
+ */
+void pyrDestroy(Pyramid* pyr);
+
+/**
+ *	Obtem o numero de niveis da piramide.
+ *
+ *	@param pyr Handle para uma piramide.
+ *
+ *	@return numero de niveis, incluindo o nivel 0.
+ */
+int pyrGetLevels(Pyramid* pyr);
+
+/**
+ *	Refaz, depois de uma alteracao no retangulo [x,x+w)x[y,y+h) do nivel 0, os pixels
+ *  dos niveis reduzidos que dependem dele. Os niveis sao reescritos no lugar e ficam
+ *  iguais aos de uma piramide criada de novo.
+ *
+ *	@param pyr  Handle para uma piramide.
+ *	@param x, y canto inferior esquerdo do retangulo alterado, no nivel 0.
+ *	@param w, h largura e altura do retangulo (e' recortado pela imagem).
+ */
+void pyrUpdateRect(Pyramid* pyr, int x, int y, int w, int h);
+
+/**
+ *	Obtem um nivel da piramide.
+ *
+ *	@param pyr   Handle para uma piramide.
+ *	@param nivel nivel desejado (0 e' a imagem original).
+ *
+ *	@return Handle para a imagem do nivel (pertence a piramide).
+ */
+Image* pyrGetLevel(Pyramid* pyr, int nivel);
+
+/**
+ *	Escolhe o nivel para exibir a imagem numa escala (tamanho na tela/tamanho da imagem):
+ *  o nivel mais reduzido que ainda tem pelo menos a resolucao da tela.
+ *
+ *	@param pyr    Handle para uma piramide.
+ *	@param escala escala de exibicao.
+ *
+ *	@return indice do nivel.
+ */
+int pyrLevelForScale(Pyramid* pyr, float escala);
+
+/**
+ *	Obtem o nivel mais detalhado com no maximo maxPixels pixels, para estimar
+ *  parametros (thresholds, paletas) antes de processar a imagem completa.
+ *
+ *	@param pyr       Handle para uma piramide.
+ *	@param maxPixels numero maximo de pixels.
+ *
+ *	@return Handle para a imagem do nivel (pertence a piramide).
+ */
+Image* pyrGetCoarse(Pyramid* pyr, int maxPixels);
+
 /**
  *	Obtem a largura (width) de uma imagem.
  *
@@ -119,6 +304,17 @@ int imgGetDimColorSpace(Image* image);
  */
 float*  imgGetData(Image* image);
 
+/**
+ *	Obtem as estatisticas (histogramas, minimo, maximo, media e variancia)
+ *  da imagem. Sao calculadas em uma unica passada paralela na primeira
+ *  chamada e reaproveitadas nas seguintes, ate que a imagem seja alterada
+ *  (imgSetPixel*, imgGetData ou imgGetRow invalidam o cache).
+ *
+ *	@param image Handle para uma imagem.
+ *	@return estatisticas da imagem (pertencem a imagem, nao liberar).
+ */
+const ImageStats* imgGetStats(Image* image);
+
 /**
  *	Ajusta o pixel de uma imagem com a cor especificada.
  *
@@ -161,6 +357,99 @@ void imgGetPixel3f(Image* image, int x, int y, float* R, float* G, float* B);
  */
 void imgGetPixel3ubv(Image* image, int x, int y, unsigned char *color);
 
+/**
+ *	Obtem a linha y de uma imagem para escrita direta. A linha tem imgGetStride floats:
+ *  as imgGetDimColorSpace componentes de cada pixel, da esquerda para a direita. Como
+ *  imgGetData, invalida o cache de estatisticas.
+ *
+ *	@param image Handle para uma imagem.
+ *	@param y Linha desejada (0 e' a de baixo).
+ *	@return  ponteiro para o primeiro componente do pixel (0,y).
+ */
+float* imgGetRow(Image* image, int y);
+
+/**
+ *	Obtem a linha y de uma imagem apenas para leitura (nao invalida o cache de estatisticas).
+ *
+ *	@param image Handle para uma imagem.
+ *	@param y Linha desejada (0 e' a de baixo).
+ *	@return  ponteiro para o primeiro componente do pixel (0,y).
+ */
+const float* imgGetRowConst(Image* image, int y);
+
+/**
+ *	Obtem a distancia, em floats, entre o inicio de duas linhas consecutivas.
+ *
+ *	@param image Handle para uma imagem.
+ *	@return  width*dcs.
+ */
+int imgGetStride(Image* image);
+
+/**
+ *	 Acesso aos pixels de uma linha obtida com imgGetRow/imgGetRowConst, definidos aqui
+ *  para serem expandidos no laco do chamador. Equivalem a imgGetPixel3fv, imgSetPixel3fv,
+ *  imgGetPixel3ubv e imgSetPixel3ubv: em imagens de luminancia a leitura repete o valor
+ *  nas tres componentes e a escrita guarda a luminancia da cor.
+ *
+ *	@param row   Linha da imagem.
+ *	@param dcs   Dimensao do espaco de cor da imagem.
+ *	@param x     Posicao x na linha.
+ *	@param color Cor do pixel.
+ */
+#ifdef _MSC_VER
+#define IMG_INLINE static __inline
+#else
+#define IMG_INLINE static inline
+#endif
+
+IMG_INLINE float imgLuminance(float r, float g, float b)
+{
+   return 0.2126f*r + 0.7152f*g + 0.0722f*b;
+}
+
+IMG_INLINE void imgRowGet3fv(const float* row, int dcs, int x, float* color)
+{
+   const float* p = row + x*dcs;
+   color[0] = p[0];
+   color[1] = p[dcs == 3 ? 1 : 0];
+   color[2] = p[dcs == 3 ? 2 : 0];
+}
+
+IMG_INLINE void imgRowSet3fv(float* row, int dcs, int x, const float* color)
+{
+   float* p = row + x*dcs;
+   if (dcs == 3) {
+      p[0] = color[0];
+      p[1] = color[1];
+      p[2] = color[2];
+   } else
+      p[0] = imgLuminance(color[0], color[1], color[2]);
+}
+
+/* como imgGetPixel3ubv: arredonda 255*v e satura em 255 */
+IMG_INLINE unsigned char imgToByte(float v)
+{
+   int i = (int)floor(255*v + 0.5);
+   return (unsigned char)(i < 256 ? i : 255);
+}
+
+IMG_INLINE void imgRowGet3ubv(const float* row, int dcs, int x, unsigned char* color)
+{
+   const float* p = row + x*dcs;
+   color[0] = imgToByte(p[0]);
+   color[1] = dcs == 3 ? imgToByte(p[1]) : color[0];
+   color[2] = dcs == 3 ? imgToByte(p[2]) : color[0];
+}
+
+IMG_INLINE void imgRowSet3ubv(float* row, int dcs, int x, const unsigned char* color)
+{
+   float rgb[3];
+   rgb[0] = (float)(color[0]/255.);
+   rgb[1] = (float)(color[1]/255.);
+   rgb[2] = (float)(color[2]/255.);
+   imgRowSet3fv(row, dcs, x, rgb);
+}
+
 /**
 *	Calcula a diferenca entre duas imagens.
 *
@@ -183,6 +472,102 @@ float imgDif(Image*img0, Image*img1, float gamma);
 */
 float imgErr(Image*img0, Image*img1);
 
+/**
+*	Compara duas imagens do mesmo tamanho e espaco de cor, sem altera-las. Os erros
+*  sao somados em double por linha e as somas das linhas em pares, de modo que o
+*  resultado nao perde precisao em imagens grandes e nao depende do numero de threads.
+*  O SSIM e' a media sobre janelas de 8x8 pixels, com passo de 4, da luminancia.
+*
+*	@param img0 Imagem de referencia.
+*	@param img1 Imagem comparada.
+*	@param m    [out] Medidas da diferenca.
+*	@param diff Se nao for NULL, recebe |img0-img1| em cada componente; deve ter o
+*	            tamanho e o espaco de cor das imagens comparadas.
+*
+*	@return 1 se comparou, 0 se as imagens (ou diff) tem tamanhos ou espacos de cor diferentes.
+*/
+int imgCompare(Image* img0, Image* img1, ImageMetrics* m, Image* diff);
+
+/**
+*	Calcula uma imagem aplicando uma expressao a cada componente de cada pixel.
+*  As imagens de entrada sao chamadas a, b, c, ... e as constantes k0..k9; imagens de
+*  uma componente sao repetidas nas tres componentes quando alguma entrada e' RGB.
+*  Operadores: + - * / < > <= >= (comparacoes valem 1 ou 0) e parenteses.
+*  Funcoes: min(x,y), max(x,y), pow(x,y), abs(x), sqrt(x), clamp(x,lo,hi),
+*  select(cond,x,y) e luma(a) (luminancia do pixel da imagem a).
+*  Exemplo: "clamp(a - k0*b, 0, 1)".
+*
+*	@param expr  Expressao.
+*	@param imgs  Vetor com as imagens de entrada, todas do mesmo tamanho.
+*	@param nimgs Numero de imagens.
+*	@param k     Vetor com os valores das constantes k0, k1, ...
+*	@param nk    Numero de constantes (ate 10).
+*
+*	@return Handle para a imagem resultante, com 3 componentes se alguma entrada tiver 3,
+*	        ou NULL se a expressao for invalida.
+*
+*/
+Image* imgPointOp(const char* expr, Image** imgs, int nimgs, const float* k, int nk);
+
+/**
+*	Como imgPointOp, mas escreve numa imagem existente e so calcula os pixels
+*  de um retangulo (por exemplo a parte visivel na tela).
+*
+*	@param expr  Expressao.
+*	@param imgs  Vetor com as imagens de entrada, todas do mesmo tamanho.
+*	@param nimgs Numero de imagens.
+*	@param k     Vetor com os valores das constantes k0, k1, ...
+*	@param nk    Numero de constantes (ate 10).
+*	@param out   Imagem de saida, do tamanho das entradas e com o numero de componentes
+*	             do resultado.
+*	@param x, y  Canto inferior esquerdo do retangulo.
+*	@param w, h  Largura e altura do retangulo (e' recortado pela imagem).
+*
+*	@return 1, ou 0 se a expressao for invalida.
+*
+*/
+int imgPointOpRect(const char* expr, Image** imgs, int nimgs, const float* k, int nk,
+                   Image* out, int x, int y, int w, int h);
+
+/**
+*	Compila uma expressao de imgPointOp uma unica vez, com as pilhas de execucao de todas
+*  as threads ja alocadas, para quem a refaz muitas vezes (por exemplo com outros valores
+*  das constantes a cada movimento de um slider).
+*
+*	@param expr  Expressao (a mesma sintaxe de imgPointOp).
+*	@param nimgs Numero de imagens de entrada.
+*	@param nk    Numero de constantes (ate 10).
+*
+*	@return Handle para o programa, ou NULL se a expressao for invalida.
+*
+*/
+PointProgram* imgPointOpCompile(const char* expr, int nimgs, int nk);
+
+/**
+*	Executa um programa compilado por imgPointOpCompile sobre um retangulo de uma imagem
+*  existente, sem alocar memoria.
+*
+*	@param p     Handle para o programa.
+*	@param imgs  Vetor com as nimgs imagens de entrada, todas do mesmo tamanho.
+*	@param k     Vetor com os valores das nk constantes k0, k1, ...
+*	@param out   Imagem de saida, do tamanho das entradas e com o numero de componentes
+*	             do resultado.
+*	@param x, y  Canto inferior esquerdo do retangulo.
+*	@param w, h  Largura e altura do retangulo (e' recortado pela imagem).
+*
+*	@return 1, ou 0 se as imagens tiverem tamanhos diferentes.
+*
+*/
+int imgPointOpRun(PointProgram* p, Image** imgs, const float* k, Image* out, int x, int y, int w, int h);
+
+/**
+*	Destroi um programa compilado por imgPointOpCompile.
+*
+*	@param p Handle para o programa (pode ser NULL).
+*
+*/
+void imgPointOpDestroy(PointProgram* p);
+
 /**
  *	Le a imagem a partir do arquivo especificado.
  *
@@ -255,31 +640,214 @@ int imgCountColor(Image* image, float);
 
 /**
  *	 Aplica o filtro de Gauss para eliminar o ruido branco
- *  da imagem.
+ *  da imagem. Todos os pixels sao filtrados, inclusive os da borda.
  *
- *	@param image Handle para uma imagem a ser filtrada.
+ *	@param img_dst Handle para a imagem que recebe o resultado (diferente de img_src).
+ *	@param img_src Handle para uma imagem a ser filtrada.
+ *	@param borda   Tratamento da borda (IMG_BORDA_*).
  *
  */
-void imgGauss(Image* img_dst, Image* img_src);
+void imgGauss(Image* img_dst, Image* img_src, int borda);
 
 /**
  *	 Aplica o filtro de Mediana para eliminar o ruido sal e pimenta
- *  da imagem.
+ *  da imagem. Todos os pixels sao filtrados, inclusive os da borda.
  *
  *	@param image Handle para uma imagem a ser filtrada.
+ *	@param borda Tratamento da borda (IMG_BORDA_*).
+ *
+ */
+void imgMedian(Image* image, int borda);
+
+/**
+ *	 Pixeliza (mosaico): cada bloco de bloco x bloco pixels, alinhado ao canto (0,0) da
+ *  imagem, recebe a media das suas cores. Os blocos da direita e de cima podem ser
+ *  menores; a media e' so' dos pixels que estao na imagem.
  *
+ *	@param src   Handle para a imagem de entrada.
+ *	@param dst   Imagem de saida, do tamanho e com o numero de componentes de src
+ *	             (pode ser a propria src).
+ *	@param bloco Lado dos blocos em pixels (1 ou mais).
  */
-void imgMedian(Image* image);
+void imgPixelize(Image* src, Image* dst, int bloco);
+
+/**
+ *	 Como imgPixelize, mas so escreve os pixels de um retangulo (por exemplo a parte
+ *  visivel na tela). Os blocos que cortam o retangulo sao lidos inteiros, entao o
+ *  resultado e' o mesmo da imagem inteira; os pixels de fora nao sao alterados.
+ *
+ *	@param src   Handle para a imagem de entrada.
+ *	@param dst   Imagem de saida, do tamanho e com o numero de componentes de src.
+ *	@param bloco Lado dos blocos em pixels (1 ou mais).
+ *	@param x, y  Canto inferior esquerdo do retangulo.
+ *	@param w, h  Largura e altura do retangulo (e' recortado pela imagem).
+ */
+void imgPixelizeRect(Image* src, Image* dst, int bloco, int x, int y, int w, int h);
 
 /**
  *	 Calcula uma imagem com pixels nas arestas 
  *  da imagem dada.
  *
  *	@param image Handle para uma imagem.
+ *	@param borda Tratamento da borda (IMG_BORDA_*).
  *
  * @return Handle para a image de luminosidade onde o branco destaca as arestas.
  */
-Image* imgEdges(Image* image);
+Image* imgEdges(Image* image, int borda);
+
+/**
+ *	 Aplica um kernel arbitrario de kw x kh elementos (ate 63x63 ou mais) a imagem.
+ *  Como nos filtros 3x3, e' feita a correlacao (o kernel nao e' invertido): a linha 0
+ *  do kernel corresponde a linha de cima (y maior) e o centro e' o elemento (kw/2,kh/2).
+ *  Em IMG_CONV_AUTO, kernels de posto 1 sao aplicados em duas passadas 1D; os demais
+ *  por soma direta ou, quando grandes, por FFT; o ponto de troca depende da variante
+ *  SIMD em uso (ver imgSimdPath e "bench conv").
+ *
+ *	@param image   Handle para a imagem de entrada (nao e' alterada).
+ *	@param kernel  Vetor com kw*kh pesos, linha a linha.
+ *	@param kw      Largura do kernel.
+ *	@param kh      Altura do kernel.
+ *	@param borda   Tratamento da borda (IMG_BORDA_*).
+ *	@param metodo  Metodo de calculo (IMG_CONV_*).
+ *
+ * @return Handle para a imagem filtrada, com o mesmo espaco de cor da entrada.
+ */
+Image* imgConvolve(Image* image, const float* kernel, int kw, int kh, int borda, int metodo);
+
+/**
+ *	 Cria uma sequencia vazia de filtros. As etapas sao acrescentadas com as funcoes
+ *  pipe* abaixo e executadas por pipeRun bloco a bloco: cada bloco (com a margem exigida
+ *  pelos raios dos filtros) passa por todas as etapas enquanto esta na cache, e as imagens
+ *  intermediarias nunca sao criadas. O resultado e' igual ao das funcoes img* equivalentes
+ *  aplicadas uma apos a outra com o mesmo tratamento de borda.
+ *
+ *	@param borda Tratamento da borda (IMG_BORDA_*), usado por todas as etapas.
+ *
+ * @return Handle para a sequencia.
+ */
+Pipeline* pipeCreate(int borda);
+
+/**
+ *	 Destroi a sequencia.
+ *
+ *	@param pl Handle para a sequencia.
+ */
+void pipeDestroy(Pipeline* pl);
+
+/**
+ *	 Acrescenta a conversao para luminancia (como imgGrey, mas com uma componente).
+ *
+ *	@param pl Handle para a sequencia.
+ */
+void pipeGrey(Pipeline* pl);
+
+/**
+ *	 Acrescenta o filtro de Gauss 3x3 (como imgGauss).
+ *
+ *	@param pl Handle para a sequencia.
+ */
+void pipeGauss(Pipeline* pl);
+
+/**
+ *	 Acrescenta o filtro de mediana 3x3 (como imgMedian).
+ *
+ *	@param pl Handle para a sequencia.
+ */
+void pipeMedian(Pipeline* pl);
+
+/**
+ *	 Acrescenta o modulo do gradiente de Sobel da luminancia. Ao contrario de imgEdges
+ *  o resultado nao e' normalizado pelo maior gradiente, o que exigiria a imagem inteira.
+ *
+ *	@param pl Handle para a sequencia.
+ */
+void pipeSobel(Pipeline* pl);
+
+/**
+ *	 Acrescenta uma correlacao com um kernel de kw x kh pesos (como imgConvolve por soma
+ *  direta). O kernel e' copiado.
+ *
+ *	@param pl     Handle para a sequencia.
+ *	@param kernel Vetor com kw*kh pesos, linha a linha.
+ *	@param kw     Largura do kernel.
+ *	@param kh     Altura do kernel.
+ */
+void pipeConvolve(Pipeline* pl, const float* kernel, int kw, int kh);
+
+/**
+ *	 Acrescenta a binarizacao: 1 onde a luminancia e' maior que o threshold, 0 no resto.
+ *
+ *	@param pl        Handle para a sequencia.
+ *	@param threshold Threshold de luminancia.
+ */
+void pipeThreshold(Pipeline* pl, float threshold);
+
+/**
+ *	 Acrescenta a binarizacao local de Sauvola (como imgBinSauvola, mas numa componente de 0 e 1).
+ *  A etapa tem raio janela/2: perto da borda a janela e' completada segundo o tratamento
+ *  de borda da sequencia, enquanto imgBinSauvola a recorta pela imagem.
+ *
+ *	@param pl     Handle para a sequencia.
+ *	@param janela Lado da janela em pixels.
+ *	@param k      Peso do desvio padrao (tipicamente 0.2 a 0.5).
+ */
+void pipeSauvola(Pipeline* pl, int janela, float k);
+
+/**
+ *	 Acrescenta a binarizacao local de Bradley (como imgBinBradley, mas numa componente de 0 e 1),
+ *  com o mesmo tratamento da borda de pipeSauvola.
+ *
+ *	@param pl     Handle para a sequencia.
+ *	@param janela Lado da janela em pixels.
+ *	@param t      Fracao abaixo da media local que torna o pixel preto (tipicamente 0.15).
+ */
+void pipeBradley(Pipeline* pl, int janela, float t);
+
+/**
+ *	 Executa a sequencia sobre uma imagem.
+ *
+ *	@param pl    Handle para a sequencia.
+ *	@param image Handle para a imagem de entrada (nao e' alterada).
+ *
+ * @return Handle para a imagem resultante da ultima etapa.
+ */
+Image* pipeRun(Pipeline* pl, Image* image);
+
+/**
+ *	 Executa a sequencia apenas num retangulo, escrevendo numa imagem existente. So
+ *  o retangulo e a margem exigida pelos raios dos filtros sao lidos da entrada; os
+ *  pixels de fora do retangulo nao sao alterados.
+ *
+ *	@param pl    Handle para a sequencia.
+ *	@param image Handle para a imagem de entrada (nao e' alterada).
+ *	@param out   Imagem de saida, do tamanho da entrada e com pipeGetDimColorSpace componentes.
+ *	@param x, y  Canto inferior esquerdo do retangulo.
+ *	@param w, h  Largura e altura do retangulo (e' recortado pela imagem).
+ */
+void pipeRunRect(Pipeline* pl, Image* image, Image* out, int x, int y, int w, int h);
+
+/**
+ *	 Numero de componentes do resultado da sequencia para uma entrada com dcs componentes.
+ *
+ *	@param pl  Handle para a sequencia.
+ *	@param dcs Componentes da entrada.
+ *
+ * @return Componentes da saida.
+ */
+int pipeGetDimColorSpace(Pipeline* pl, int dcs);
+
+/**
+ *	 Detector de arestas de Canny: suaviza a luminancia com imgGauss, calcula o gradiente
+ *  de Sobel com direcao, afina as arestas por supressao de nao-maximos e liga os pixels
+ *  fracos aos fortes por histerese (threshold duplo).
+ *
+ *	@param image  Handle para uma imagem (RGB ou luminancia).
+ *	@param baixo  Threshold fraco, relativo ao maior gradiente da imagem ([0,1]).
+ *	@param alto   Threshold forte, relativo ao maior gradiente da imagem ([0,1]).
+ *
+ * @return Handle para a imagem binaria com as arestas em 1.
+ */
+Bitmap* imgCanny(Image* image, float baixo, float alto);
 
 /**
 *	Reduz o numero de cores distintas de uma imagem utilizando
@@ -292,6 +860,87 @@ Image* imgEdges(Image* image);
 */
 void imgReduceColors(Image* image, Image* img_new, int ncolors);
 
+/**
+*	Como imgReduceColors, mas a paleta e' calculada a partir de outra imagem,
+*      tipicamente um nivel reduzido da piramide (pyrGetCoarse), e depois
+*      aplicada a imagem completa.
+*
+*	@param amostra Handle para a imagem usada no calculo da paleta.
+*	@param image Handle para uma imagem.
+*	@param img_new Handle para a imagem que vai ter as cores reduzidas.
+*	@param ncolors numero de cores distintas que a nova imagem deve ter.
+*
+*/
+void imgReduceColorsFrom(Image* amostra, Image* image, Image* img_new, int ncolors);
+
+
+/**
+ *	Cria uma imagem binaria com todos os pixels pretos (0).
+ *
+ *	@param w Largura da imagem.
+ *	@param h Altura da imagem.
+ *
+ *	@return Handle da imagem binaria criada.
+ */
+Bitmap* bmpCreate(int w, int h);
+
+/**
+ *	Destroi a imagem binaria.
+ *
+ *	@param bmp imagem binaria a ser destruida.
+ */
+void bmpDestroy(Bitmap* bmp);
+
+int bmpGetWidth(Bitmap* bmp);
+int bmpGetHeight(Bitmap* bmp);
+
+/**
+ *	Obtem o pixel (0 ou 1) de uma imagem binaria na posicao especificada.
+ */
+int bmpGetPixel(Bitmap* bmp, int x, int y);
+
+/**
+ *	Expande a imagem binaria para uma imagem de luminancia (dcs=1) com tons 0 e 1,
+ *  para exibicao.
+ *
+ *	@param bmp Handle para uma imagem binaria.
+ *
+ *	@return Handle da imagem criada.
+ */
+Image* bmpToImage(Bitmap* bmp);
+
+/**
+ *	Salva a imagem binaria no arquivo especificado em formato BMP (24 bits),
+ *  expandindo uma linha de cada vez.
+ *
+ *	@param filename Nome do arquivo de imagem.
+ *	@param bmp Handle para uma imagem binaria.
+ *
+ *	@return retorna 1 caso nao haja erros.
+ */
+int bmpWriteBMP(char *filename, Bitmap* bmp);
+
+/**
+*	Binariza a imagem numa unica passada: calcula a luminancia de cada pixel
+*   (imagens RGB nao precisam ser convertidas antes com imgGrey) e a compara
+*   com o threshold, escrevendo diretamente a imagem binaria empacotada.
+*
+*	@param image      Handle para uma imagem (RGB ou luminancia).
+*	@param threshold  Pixels com luminancia maior que threshold ficam brancos (1).
+*
+*   @return Handle para a imagem binaria.
+**/
+Bitmap* imgBinarize(Image* image, float threshold);
+
+/**
+*	Calcula os thresholds de imgBinOtsu e imgBinOhbuchi sem binarizar a imagem.
+*
+*	@param image Handle para uma imagem (RGB ou luminancia).
+*
+*   @return threshold em [0,1], para uso em imgBinarize.
+**/
+float imgOtsuThreshold(Image* image);
+float imgOhbuchiThreshold(Image* image);
 
 /**
 *	Reduz a imagem colorida para 2 tons (B&W ou Preto e Branco). 
@@ -321,5 +970,242 @@ Image* imgBinOtsu(Image* img_cgrey);
 **/
 Image* imgBinOhbuchi(Image* img_cgrey);
 
+/**
+*	Calcula n thresholds de Otsu (multi-nivel), que dividem os niveis de luminancia em
+*   n+1 classes maximizando a variancia entre classes. Usa as tabelas acumuladas omega/mu
+*   do metodo original e programacao dinamica, com custo O(n*256^2) em vez de testar todas
+*   as combinacoes de thresholds.
+*
+*	@param image       Handle para uma imagem (RGB ou luminancia).
+*	@param n           Numero de thresholds (entre 1 e 255).
+*	@param thresholds  [out] Vetor com n thresholds crescentes em [0,1]; um pixel esta na
+*                      classe c se thresholds[c-1] < luminancia <= thresholds[c].
+**/
+void imgOtsuMultiThresholds(Image* image, int n, float* thresholds);
+
+/**
+*	Segmenta a imagem em n+1 classes com os thresholds de imgOtsuMultiThresholds.
+*
+*	@param image   Handle para uma imagem (RGB ou luminancia).
+*	@param n       Numero de thresholds.
+*	@param labels  Se diferente de zero, cada pixel recebe o indice da sua classe (0..n);
+*                  caso contrario recebe a luminancia media da classe (imagem posterizada).
+*
+*   @return Handle para a imagem de luminancia resultante.
+**/
+Image* imgOtsuMulti(Image* image, int n, int labels);
+
+/**
+*	Reduz a imagem para 2 tons (B&W) com um threshold local (adaptativo), calculado
+*   para cada pixel a partir da media m e do desvio padrao s da luminancia numa janela
+*   centrada nele: T = m*(1 + k*(s/R - 1)), com R = 0.5 (metade da faixa dinamica).
+*   A media e a variancia vem de imagens integrais (summed-area tables), de modo que o
+*   custo por pixel nao depende do tamanho da janela.
+*
+*   Baseado no artigo "Adaptive document image binarization", de J. Sauvola e M. Pietikainen,
+*   Pattern Recognition 33 (2000).
+*
+*	@param greyImage  Handle para uma imagem em tons de cinza.
+*	@param janela     Lado da janela (em pixels) usada para o threshold local.
+*	@param k          Sensibilidade ao desvio padrao (tipicamente entre 0.2 e 0.5).
+*
+*   @return Handle para a imagem binaria (bit 1 onde a luminancia passa do threshold local).
+**/
+Bitmap* imgBinSauvola(Image* greyImage, int janela, float k);
+
+/**
+*	Reduz a imagem para 2 tons (B&W) com um threshold local: um pixel e' preto quando
+*   sua luminancia e' menor que (1-t) vezes a media da janela centrada nele.
+*   Usa a mesma imagem integral de imgBinSauvola.
+*
+*   Baseado no artigo "Adaptive Thresholding Using the Integral Image", de D. Bradley
+*   e G. Roth, Journal of Graphics Tools 12 (2007).
+*
+*	@param greyImage  Handle para uma imagem em tons de cinza.
+*	@param janela     Lado da janela (em pixels) usada para o threshold local.
+*	@param t          Fracao abaixo da media local para um pixel ser considerado preto.
+*
+*   @return Handle para a imagem binaria (bit 1 onde a luminancia passa do threshold local).
+**/
+Bitmap* imgBinBradley(Image* greyImage, int janela, float t);
+
+/*- Imagens de 8 bits ---------------------------------------------------*/
+
+/**
+ *	Cria uma nova imagem de 8 bits (componentes zeradas).
+ *
+ *	@param w Largura da imagem.
+ *	@param h Altura da imagem.
+ *	@param dcs Dimensao do espaco de cor de cada pixel (1=luminancia ou 3=RGB).
+ *
+ *	@return Handle da imagem criada.
+ */
+Image8* img8Create(int w, int h, int dcs);
+void    img8Destroy(Image8* image);
+int     img8GetWidth(Image8* image);
+int     img8GetHeight(Image8* image);
+int     img8GetDimColorSpace(Image8* image);
+unsigned char* img8GetData(Image8* image);
+
+/**
+ *	Le um BMP de 24 bits diretamente para 8 bits por componente, sem passar por float.
+ *
+ *	@param filename Nome do arquivo de imagem.
+ *
+ *	@return imagem criada (NULL se o arquivo nao for um BMP de 24 bits).
+ */
+Image8* img8ReadBMP(char *filename);
+
+/**
+ *	Salva a imagem de 8 bits no arquivo especificado em formato BMP (24 bits).
+ *
+ *	@return retorna 1 caso nao haja erros.
+ */
+int img8WriteBMP(char *filename, Image8* image);
+
+/**
+ *	Converte entre imagens de 8 bits e imagens em float ([0,255] <-> [0,1]).
+ */
+Image8* imgToImage8(Image* image);
+Image*  img8ToImage(Image8* image);
+
+/**
+ *	Cria uma copia em tons de cinza da imagem de 8 bits. A luminancia e' calculada
+ *  em ponto fixo com coeficientes de 16 bits, (13933*R + 46871*G + 4732*B) >> 16,
+ *  truncada como em imgGetStats.
+ *
+ *	@param image imagem a ser copiada em tons de cinza.
+ *
+ *	@return Handle da imagem de luminancia (dcs=1) criada.
+ */
+Image8* img8Grey(Image8* image);
+
+/**
+ *	Calcula o histograma de luminancia da imagem de 8 bits (inteiro).
+ *
+ *	@param image      Handle para uma imagem de 8 bits (RGB ou luminancia).
+ *	@param histograma [out] Vetor com 256 posicoes.
+ */
+void img8Histogram(Image8* image, int histograma[256]);
+
+/**
+ *	Calcula o threshold de Otsu da imagem de 8 bits (mesmo criterio de imgOtsuThreshold).
+ *
+ *	@return nivel de luminancia em [0,255]; pixels acima dele ficam brancos.
+ */
+int img8OtsuThreshold(Image8* image);
+
+/**
+ *	Binariza a imagem de 8 bits numa unica passada (ver imgBinarize), com comparacoes
+ *  de bytes em SIMD para imagens de luminancia. Em imagens RGB a luminancia em ponto
+ *  fixo e' comparada antes de ser truncada, dando o mesmo resultado de imgBinarize.
+ *
+ *	@param image      Handle para uma imagem de 8 bits (RGB ou luminancia).
+ *	@param threshold  Pixels com luminancia maior que threshold (em [0,255]) ficam brancos.
+ *
+ *   @return Handle para a imagem binaria.
+ */
+Bitmap* img8Binarize(Image8* image, int threshold);
+
+
+/************************************************************************/
+/* Conjunto de instrucoes                                               */
+/************************************************************************/
+
+/**
+ *	 Os lacos internos mais pesados (convolucao, mediana, luminancia, estatisticas e
+ *  busca na paleta) sao compilados tambem para AVX2 e AVX-512 e a variante e' escolhida
+ *  na primeira chamada, pelo que o processador suporta. A variavel de ambiente IMG_SIMD
+ *  (sse2, avx2 ou avx512) forca uma variante, se o processador a suportar.
+ *
+ * @return Nome da variante em uso: "sse2", "avx2", "avx512" ("generico" fora do x86-64).
+ */
+const char* imgSimdPath(void);
+
+
+/************************************************************************/
+/* Instrumentacao                                                       */
+/************************************************************************/
+
+/**
+ *	 Medidas de tempo das etapas internas (leitura e escrita de arquivos, corte mediano
+ *  etc.), registradas quando trcAtivo e' diferente de zero. Cada intervalo guarda o nome,
+ *  o inicio, a duracao e a thread (omp_get_thread_num) que o executou. Desativada, cada
+ *  medida custa um teste de trcAtivo; compilando com IMG_NO_TRACE nem isso.
+ *
+ *	  TRC_INICIO(t);              declara t e marca o inicio do intervalo
+ *	  TRC_FIM(t, "nome");         registra o intervalo de t ate agora
+ *	  TRC_REINICIA(t);            marca em t o inicio de um novo intervalo
+ *	  TRC_CONTA("nome", valor);   registra o valor de um contador
+ */
+extern int trcAtivo;
+
+#ifdef IMG_NO_TRACE
+#define TRC_INICIO(t)        double t = 0.0
+#define TRC_REINICIA(t)      ((void)0)
+#define TRC_FIM(t, nome)     ((void)(t))
+#define TRC_CONTA(nome, v)   ((void)0)
+#else
+#define TRC_INICIO(t)        double t = trcAtivo ? trcNow() : 0.0
+#define TRC_REINICIA(t)      ((t) = trcAtivo ? trcNow() : 0.0)
+#define TRC_FIM(t, nome)     do { if (trcAtivo) trcSpan(nome, t); } while (0)
+#define TRC_CONTA(nome, v)   do { if (trcAtivo) trcCounter(nome, v); } while (0)
 #endif
 
+/**
+ *	 Liga ou desliga o registro. Ao ligar, descarta o que foi registrado antes.
+ *
+ *	@param on 1 para ligar, 0 para desligar.
+ */
+void trcEnable(int on);
+
+/**
+ *	 Descarta os intervalos e contadores registrados e reinicia a contagem do tempo.
+ */
+void trcReset(void);
+
+/**
+ *	 Relogio usado pelos intervalos.
+ *
+ * @return Tempo em segundos (a origem e' arbitraria).
+ */
+double trcNow(void);
+
+/**
+ *	 Registra um intervalo que comecou em t0 e termina agora.
+ *
+ *	@param nome Nome do intervalo; o ponteiro e' guardado, use uma constante.
+ *	@param t0   Inicio do intervalo, obtido de trcNow.
+ */
+void trcSpan(const char* nome, double t0);
+
+/**
+ *	 Registra o valor atual de um contador.
+ *
+ *	@param nome  Nome do contador; o ponteiro e' guardado, use uma constante.
+ *	@param valor Valor do contador.
+ */
+void trcCounter(const char* nome, double valor);
+
+/**
+ *	 Escreve o que foi registrado no formato de trace do Chrome (chrome://tracing,
+ *  ui.perfetto.dev).
+ *
+ *	@param filename Nome do arquivo JSON.
+ *
+ * @return 1 se escreveu o arquivo, 0 se nao conseguiu.
+ */
+int trcWriteJSON(const char* filename);
+
+/**
+ *	 Resumo em uma linha: o tempo total e o numero de chamadas de cada intervalo, do
+ *  mais demorado para o menos demorado, e o ultimo valor de cada contador.
+ *
+ *	@param buf Texto do resumo (sempre terminado em zero).
+ *	@param len Tamanho de buf.
+ *
+ * @return Numero de nomes distintos registrados.
+ */
+int trcSummary(char* buf, int len);
+
+#endif
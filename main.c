@@ -26,6 +26,8 @@
 /*- Include lib interfaces: ANSI C, IUP and OpenGL ------*/
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <string.h>
 #include <iup.h>        /* IUP functions*/
 #include <iupgl.h>      /* IUP functions related to OpenGL (IupGLCanvasOpen,IupGLMakeCurrent and IupGLSwapBuffers) */
 #include "image.h"
@@ -42,20 +44,74 @@
 /*- Program context: -------------------------------------------------*/
 static Image* cur_img;
 static Image* orig_img;
-static Image* myeffect_img;
 static Image* sobel_img;
-static Image* high_img;
 static Image* grey_img;
-static Image* gauss_img;
-static Image* median_img;
 static Image* reduce_img;
-static Image* otsu_img;
-static Image* ohbuchi_img;
+static Image* bin_img;      /* expansion of the bitmap being shown */
+static Bitmap* otsu_bmp;
+static Bitmap* ohbuchi_bmp;
+static Bitmap* canny_bmp;
+static Bitmap* sauvola_bmp;
+static Bitmap* bradley_bmp;
+static Image* multiotsu_img;
+static Pyramid* orig_pyr;   /* reductions of orig_img, built once after loading */
+static Pyramid* view_pyr;   /* reductions of cur_img when it is another image   */
+
+#define COARSE_PIXELS (256*256)    /* level used to estimate thresholds and palettes */
+#define TRACE_FILE "trace.json"    /* written when the Trace button stops tracing */
+#define PIXELIZE_BLOCK 3           /* block side of the Pixelize effect */
 
 static Ihandle* dialog;
 static Ihandle *canvas;                    /* canvas handle */
 static Ihandle *msgbar;                    /* message bar  handle */
 static int width=640,height=480;           /* width and height of the canvas  */
+static float zoom=1.f;                     /* canvas pixels per image pixel   */
+static float view_x=0.f, view_y=0.f;       /* image point at the canvas origin */
+static int drag_x, drag_y;                 /* mouse position when a drag began */
+static float drag_vx, drag_vy;             /* view_x, view_y when a drag began */
+static int sel_ax, sel_ay;                 /* image point where a selection began */
+static int sel_x0, sel_y0, sel_x1, sel_y1; /* selected region, empty if x0 >= x1 */
+
+/* The canvas draws cur_img as textured tiles of TILE x TILE pixels of the
+ * pyramid level matching the zoom. Only visible tiles are drawn; their
+ * textures are kept in a cache and the least recently used one is replaced
+ * when a new tile is needed. */
+#define TILE 256
+#define ZOOM_MIN (1.f/1024)
+#define ZOOM_MAX 32.f
+
+typedef struct {
+	GLuint tex;
+	Image *img;            /* image (or pyramid level) of the tile; NULL: free entry */
+	int tx, ty;
+	unsigned long used;    /* frame in which it was last drawn */
+} TileTexture;
+
+/* pyrLevelForScale keeps the scale of the drawn level in (0.5,1], so a tile
+ * covers at least TILE/2 canvas pixels; the cache holds every tile that fits
+ * in the canvas at that scale plus a ring around it for panning */
+static TileTexture *tiles;
+static int tile_cache;
+static unsigned long frame;
+
+/* Effects computed on demand, tile by tile: the tiles on screen are computed
+ * right before they are drawn and the others while the program is idle, so a
+ * result shows up without waiting for the whole image. */
+typedef void (*ComputeRect)(Image *dst, int x, int y, int w, int h);
+
+typedef struct {
+	Image *img;            /* result; NULL until the effect is started */
+	unsigned char *done;   /* one flag per TILE x TILE tile of img */
+	int ntx, nty;          /* tiles per row and per column */
+	int pending;           /* tiles not computed yet */
+	ComputeRect compute;
+} LazyEffect;
+
+static LazyEffect gauss_fx, median_fx, myeffect_fx, high_fx;
+static LazyEffect *lazy_fx[] = { &gauss_fx, &median_fx, &myeffect_fx, &high_fx };
+static Pipeline *gauss_pl, *median_pl;
+static PointProgram *high_prog; /* Highlight, compiled once and rerun by its slider */
+static float high_th = 0.1f;    /* edge weight of Highlight, set by its slider */
 
 int param_action(Ihandle *_dialog, int param_index, void *user_data)
 {
@@ -63,74 +119,55 @@ int param_action(Ihandle *_dialog, int param_index, void *user_data)
 }
 
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(*x))
-Image *do_highlight(Image *orig, Image *sobel)
-{
-	int x,y;
-	float th = 0;
-	float ro,go,bo;
-	float rs,gs,bs;
-	Image *high;
-	high = imgCopy(orig);
-
-	if (!IupGetParam("set threshold", param_action, 0,
-				"threshold: %r\n", &th, NULL))
-		th = 0.1;
-
-	for(y=0; y<imgGetHeight(orig); y++){
-		for(x=0; x<imgGetWidth(orig); x++){
-			imgGetPixel3f(orig, x, y, &ro, &go, &bo);
-			imgGetPixel3f(sobel, x, y, &rs, &gs, &bs);
-
-			rs = ro - th*rs;
-			gs = go - th*gs;
-			bs = bo - th*bs;
-			/* clipping img */
-			if (rs < 0) rs = 0; if (rs > 1) rs = 1;
-			if (gs < 0) gs = 0; if (gs > 1) rs = 1;
-			if (bs < 0) bs = 0; if (bs > 1) rs = 1;
-
-			imgSetPixel3f(high, x, y, rs, gs, bs);
-		}
-	}
 
-	return high;
+void compute_gauss(Image *dst, int x, int y, int w, int h)
+{
+	pipeRunRect(gauss_pl, orig_img, dst, x, y, w, h);
 }
 
-Image *do_myeffect(Image *orig)
+void compute_median(Image *dst, int x, int y, int w, int h)
 {
-	int x,y,z;
-	Image *high;
-	high = imgCopy(orig);
-	int remap[][2] = {
-		{-1, -1},	{ 0, -1},	{ 1, -1},
-		{-1,  0},	{ 0,  0},	{ 1,  0},
-		{-1,  1},	{ 0,  1},	{ 1,  1},
-	};
+	pipeRunRect(median_pl, orig_img, dst, x, y, w, h);
+}
 
-	for(y=1; y<imgGetHeight(orig)-1; y+=3){
-		for(x=1; x<imgGetWidth(orig)-1; x+=3){
-			float ro = 0,go = 0,bo = 0;
-			float rs = 0,gs = 0,bs = 0;
+void compute_myeffect(Image *dst, int x, int y, int w, int h)
+{
+	imgPixelizeRect(orig_img, dst, PIXELIZE_BLOCK, x, y, w, h);
+}
 
-			for(z=0; z<ARRAY_SIZE(remap); z++){
-				imgGetPixel3f(orig, x+remap[z][0],
-						y+remap[z][1],
-						&ro, &go, &bo);
-				rs += ro;
-				gs += go;
-				bs += bo;
-			}
-			rs = rs/ARRAY_SIZE(remap);
-			gs = gs/ARRAY_SIZE(remap);
-			bs = bs/ARRAY_SIZE(remap);
-
-			for(z=0; z<ARRAY_SIZE(remap); z++)
-				imgSetPixel3f(high, x+remap[z][0],
-						y+remap[z][1],
-						rs, gs, bs);
-		}
-	}
-	return high;
+/* darkens the edges: orig - th*sobel, clamped to [0,1] per channel */
+void compute_highlight(Image *dst, int x, int y, int w, int h)
+{
+	Image *in[2];
+
+	in[0] = orig_img;
+	in[1] = sobel_img;
+	imgPointOpRun(high_prog, in, &high_th, dst, x, y, w, h);
+}
+
+/* largest zoom (at most 1:1) that fits the image in a w x h canvas */
+float fit_zoom(Image *img, int w, int h)
+{
+	float z = 1.f;
+	if (!img) return z;
+	if (w < z*imgGetWidth(img)) z = (float)w/imgGetWidth(img);
+	if (h < z*imgGetHeight(img)) z = (float)h/imgGetHeight(img);
+	return z;
+}
+
+/* shrinks w x h, keeping the aspect, so the dialog fits in the screen with
+ * room for the toolbar, the message bar and the window decorations */
+void fit_to_screen(int *w, int *h)
+{
+	int sw, sh;
+	char *screen = IupGetGlobal("SCREENSIZE");
+
+	if (!screen || sscanf(screen, "%dx%d", &sw, &sh) != 2)
+		return;
+	sw -= 50;
+	sh -= 150;
+	if (*w > sw) { *h = *h*sw/(*w); *w = sw; }
+	if (*h > sh) { *w = *w*sh/(*h); *h = sh; }
 }
 
 void update_dialog_size(Ihandle* _dialog, Ihandle* _canvas, int w, int h )
@@ -176,33 +213,298 @@ char* get_new_file_name( void )
 /* IUP Callbacks                            */
 /*------------------------------------------*/
 
+/* while tracing, shows in the message bar where the time went */
+void show_trace(void)
+{
+	char summary[1024];
+	if (trcAtivo && trcSummary(summary, sizeof(summary)))
+		IupSetfAttribute(msgbar, "TITLE", "%s", summary);
+}
+
+/* drops the cached tiles of img, or every tile if img is NULL */
+void flush_tiles(Image *img)
+{
+	int i;
+	for (i=0; i < tile_cache; i++)
+		if (tiles[i].img && (!img || tiles[i].img == img))
+			tiles[i].img = NULL;
+}
+
+/* makes room in the tile cache for the canvas size; it never shrinks, so
+ * the textures already created are kept */
+void grow_tile_cache(void)
+{
+	int n = (width/(TILE/2) + 4) * (height/(TILE/2) + 4);
+	if (n <= tile_cache) return;
+	tiles = realloc(tiles, n*sizeof(TileTexture));
+	memset(tiles + tile_cache, 0, (n - tile_cache)*sizeof(TileTexture));
+	tile_cache = n;
+}
+
+/* texture with tile (tx,ty) of img, uploaded if not cached */
+GLuint tile_texture(Image *img, int tx, int ty)
+{
+	static unsigned char rgb[TILE*TILE*3];
+	TileTexture *t = &tiles[0];
+	int w = imgGetWidth(img), h = imgGetHeight(img), dcs = imgGetDimColorSpace(img);
+	int i, x, y, c, tw, th;
+	TRC_INICIO(t0);
+
+	for (i=0; i < tile_cache; i++) {
+		TileTexture *e = &tiles[i];
+		if (e->img == img && e->tx == tx && e->ty == ty) {
+			e->used = frame;
+			return e->tex;
+		}
+		if (!e->img) {
+			if (t->img) t = e;
+		} else if (t->img && e->used < t->used)
+			t = e;
+	}
+	/* t is a free entry or the least recently used one */
+	TRC_REINICIA(t0);
+	tw = (tx+1)*TILE <= w ? TILE : w - tx*TILE;
+	th = (ty+1)*TILE <= h ? TILE : h - ty*TILE;
+	for (y=0; y < th; y++) {
+		const float *src = imgGetRowConst(img, ty*TILE+y) + (size_t)tx*TILE*dcs;
+		unsigned char *dst = rgb + y*TILE*3;
+		for (x=0; x < tw; x++)
+			for (c=0; c < 3; c++) {
+				float v = src[x*dcs + (dcs == 3 ? c : 0)];
+				dst[3*x+c] = v <= 0.f ? 0 : v >= 1.f ? 255 : (unsigned char)(v*255.f + 0.5f);
+			}
+	}
+
+	/* textures are allocated once and then only overwritten */
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (!t->tex) {
+		glGenTextures(1, &t->tex);
+		glBindTexture(GL_TEXTURE_2D, t->tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, TILE, TILE, 0, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+	} else {
+		glBindTexture(GL_TEXTURE_2D, t->tex);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, TILE, TILE, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+	}
+
+	t->img = img;
+	t->tx = tx;
+	t->ty = ty;
+	t->used = frame;
+	TRC_FIM(t0, "texture upload");
+	return t->tex;
+}
+
+/* started effect whose result is img, if any */
+LazyEffect *lazy_effect_of(Image *img)
+{
+	int i;
+	for (i=0; i < ARRAY_SIZE(lazy_fx); i++)
+		if (img && lazy_fx[i]->img == img)
+			return lazy_fx[i];
+	return NULL;
+}
+
+/* drops the cached tiles of the reduced levels of pyr */
+void flush_levels(Pyramid *pyr)
+{
+	int i;
+	for (i=1; i < pyrGetLevels(pyr); i++)
+		flush_tiles(pyrGetLevel(pyr, i));
+}
+
+/* computes the tile (tx,ty) of the effect if it was not computed yet; if the
+ * effect is shown zoomed out, its levels are updated over the tile */
+void fx_tile(LazyEffect *fx, int tx, int ty)
+{
+	int i = ty*fx->ntx + tx;
+	TRC_INICIO(t);
+	if (fx->done[i]) return;
+	fx->compute(fx->img, tx*TILE, ty*TILE, TILE, TILE);
+	if (fx->img == cur_img && view_pyr) {
+		pyrUpdateRect(view_pyr, tx*TILE, ty*TILE, TILE, TILE);
+		flush_levels(view_pyr);
+	}
+	fx->done[i] = 1;
+	fx->pending--;
+	TRC_FIM(t, "effect tile");
+	TRC_CONTA("pending tiles", fx->pending);
+}
+
+/* computes the tiles of the effect that intersect [x0,x1) x [y0,y1) */
+void fx_rect(LazyEffect *fx, int x0, int y0, int x1, int y1)
+{
+	int tx, ty;
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	for (ty=y0/TILE; ty < fx->nty && ty*TILE < y1; ty++)
+		for (tx=x0/TILE; tx < fx->ntx && tx*TILE < x1; tx++)
+			fx_tile(fx, tx, ty);
+}
+
+/* while idle, computes one tile of the shown effect or, after it, of the others */
+int idle_cb(void)
+{
+	LazyEffect *fx = lazy_effect_of(cur_img);
+	int i, t;
+
+	for (i=-1; i < (int)ARRAY_SIZE(lazy_fx); i++) {
+		if (i >= 0) fx = lazy_fx[i];
+		if (!fx || !fx->img || !fx->pending) continue;
+		for (t=0; fx->done[t]; t++)
+			;
+		fx_tile(fx, t % fx->ntx, t / fx->ntx);
+		return IUP_DEFAULT;
+	}
+	IupSetFunction("IDLE_ACTION", NULL);
+	return IUP_DEFAULT;
+}
+
+/* (re)starts an effect over orig_img; nothing is computed until it is needed */
+void fx_start(LazyEffect *fx, ComputeRect compute)
+{
+	int w = imgGetWidth(orig_img), h = imgGetHeight(orig_img);
+
+	flush_tiles(fx->img);
+	imgDestroy(fx->img);
+	free(fx->done);
+	fx->img = imgCreate(w, h, imgGetDimColorSpace(orig_img));
+	fx->ntx = (w+TILE-1)/TILE;
+	fx->nty = (h+TILE-1)/TILE;
+	fx->done = calloc(fx->ntx*fx->nty, 1);
+	fx->pending = fx->ntx*fx->nty;
+	fx->compute = compute;
+	IupSetFunction("IDLE_ACTION", (Icallback)idle_cb);
+}
+
+/* recomputes a started effect after one of its parameters changed: the
+ * result image is kept and its tiles only marked as not computed, so the
+ * visible ones are redone on the next repaint and nothing is allocated */
+void fx_restart(LazyEffect *fx)
+{
+	if (!fx->img) return;
+	flush_tiles(fx->img);
+	memset(fx->done, 0, fx->ntx*fx->nty);
+	fx->pending = fx->ntx*fx->nty;
+	IupSetFunction("IDLE_ACTION", (Icallback)idle_cb);
+}
+
+/* pyramid used to draw img: orig_pyr for the original, view_pyr (built on
+ * first use) for anything else */
+Pyramid *pyramid_of(Image *img)
+{
+	if (img == orig_img)
+		return orig_pyr;
+	if (!view_pyr)
+		view_pyr = pyrCreate(img, IMG_PIRAMIDE_GAUSS);
+	return view_pyr;
+}
+
 /* function called when the canvas is exposed in the screen */
 int repaint_cb(Ihandle *self)
 {
-	int x,y;
+	Image *shown;
+	LazyEffect *fx;
+	int w, h, tx, ty, tx0, tx1, ty0, ty1, margin;
+	float sx, sy;   /* canvas pixels per pixel of the level */
+	TRC_INICIO(t);
+
 	IupGLMakeCurrent(self);
 	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);  /* black */
 	glClear(GL_COLOR_BUFFER_BIT);          /* clear the color buffer */
 
-	/* assing to each pixel of the canvas a red-green color in a given blue value (global variable) */
 	if (!cur_img) return IUP_DEFAULT;
-
-	glBegin(GL_POINTS);
-	for (y=0; y < imgGetHeight(cur_img); y++) {
-		for (x=0; x < imgGetWidth(cur_img); x++) {
-			float r,g,b;
-			imgGetPixel3f(cur_img, x, y, &r, &g, &b);
-			glColor3f(r,g,b);        /* define a current color */
-			glVertex2i(x,y);                  /* paint a point in the position (x,y,0) */
+	grow_tile_cache();
+
+	/* an effect computed on demand is computed over the selection and the
+	 * visible region first; zoomed out, the level closest to the screen
+	 * resolution is drawn, and the reductions of level n read up to 2^n
+	 * pixels around what is visible */
+	fx = lazy_effect_of(cur_img);
+	shown = cur_img;
+	margin = 0;
+	if (zoom <= 0.5f) {
+		Pyramid *pyr = pyramid_of(cur_img);
+		int level = pyrLevelForScale(pyr, zoom);
+		shown = pyrGetLevel(pyr, level);
+		margin = 1 << level;
+	}
+	if (fx) {
+		fx_rect(fx, sel_x0, sel_y0, sel_x1, sel_y1);
+		fx_rect(fx, (int)floor(view_x) - margin, (int)floor(view_y) - margin,
+				(int)ceil(view_x + width/zoom) + margin,
+				(int)ceil(view_y + height/zoom) + margin);
+	}
+	w = imgGetWidth(shown);
+	h = imgGetHeight(shown);
+	sx = zoom*imgGetWidth(cur_img)/w;
+	sy = zoom*imgGetHeight(cur_img)/h;
+
+	/* tiles that intersect the canvas */
+	tx0 = (int)floor(view_x*zoom/sx/TILE);
+	ty0 = (int)floor(view_y*zoom/sy/TILE);
+	tx1 = (int)floor((view_x*zoom + width)/sx/TILE);
+	ty1 = (int)floor((view_y*zoom + height)/sy/TILE);
+	if (tx0 < 0) tx0 = 0;
+	if (ty0 < 0) ty0 = 0;
+	if (tx1 > (w-1)/TILE) tx1 = (w-1)/TILE;
+	if (ty1 > (h-1)/TILE) ty1 = (h-1)/TILE;
+
+	frame++;
+	glEnable(GL_TEXTURE_2D);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+	for (ty=ty0; ty <= ty1; ty++) {
+		for (tx=tx0; tx <= tx1; tx++) {
+			int tw = (tx+1)*TILE <= w ? TILE : w - tx*TILE;
+			int th = (ty+1)*TILE <= h ? TILE : h - ty*TILE;
+			float x0 = tx*TILE*sx - view_x*zoom, y0 = ty*TILE*sy - view_y*zoom;
+			float x1 = x0 + tw*sx, y1 = y0 + th*sy;
+			float u = (float)tw/TILE, v = (float)th/TILE;
+
+			glBindTexture(GL_TEXTURE_2D, tile_texture(shown, tx, ty));
+			glBegin(GL_QUADS);
+			glTexCoord2f(0, 0); glVertex2f(x0, y0);
+			glTexCoord2f(u, 0); glVertex2f(x1, y0);
+			glTexCoord2f(u, v); glVertex2f(x1, y1);
+			glTexCoord2f(0, v); glVertex2f(x0, y1);
+			glEnd();
 		}
 	}
-	glEnd();
+	glDisable(GL_TEXTURE_2D);
+
+	if (sel_x0 < sel_x1) {
+		glColor3f(1.f, 1.f, 0.f);
+		glBegin(GL_LINE_LOOP);
+		glVertex2f((sel_x0 - view_x)*zoom, (sel_y0 - view_y)*zoom);
+		glVertex2f((sel_x1 - view_x)*zoom, (sel_y0 - view_y)*zoom);
+		glVertex2f((sel_x1 - view_x)*zoom, (sel_y1 - view_y)*zoom);
+		glVertex2f((sel_x0 - view_x)*zoom, (sel_y1 - view_y)*zoom);
+		glEnd();
+	}
 
 	IupGLSwapBuffers(self);  /* change the back buffer with the front buffer */
+	TRC_FIM(t, "repaint");
 
 	return IUP_DEFAULT; /* returns the control to the main loop */
 }
 
+/* shows img in the canvas; the view pyramid may be of an image that has
+ * since been replaced, so it is rebuilt on demand, and so are the tiles of
+ * anything but the original */
+void show_image(Image *img)
+{
+	int i;
+	for (i=0; i < tile_cache; i++)
+		if (tiles[i].img && tiles[i].img != orig_img)
+			tiles[i].img = NULL;
+	pyrDestroy(view_pyr);
+	view_pyr = NULL;
+	cur_img = img;
+	repaint_cb(canvas);
+	show_trace();
+}
+
 
 /* function called in the event of changes in the width or in the height of the canvas */
 int resize_cb(Ihandle *self, int new_width, int new_height)
@@ -231,26 +533,66 @@ int resize_cb(Ihandle *self, int new_width, int new_height)
 
 int open_file_cb(void)
 {
+	int w, h;
+	Image *coarse;
 	char *fname = get_file_name();
+	TRC_INICIO(t);
 	if (!fname) /*TODO show dialog de erro. */
 		printf ("invalid file name: %s\n", fname);
 
+	flush_tiles(NULL);
+	pyrDestroy(view_pyr);
+	pyrDestroy(orig_pyr);
+	view_pyr = NULL;
 	cur_img = orig_img = imgReadBMP(fname);
-	update_dialog_size(dialog, canvas, imgGetWidth(orig_img), imgGetHeight(orig_img));
-
-	sobel_img = imgEdges(orig_img);
-	myeffect_img = do_myeffect(orig_img);
+	TRC_FIM(t, "open: read");
+	TRC_REINICIA(t);
+	orig_pyr = pyrCreate(orig_img, IMG_PIRAMIDE_GAUSS);
+	coarse = pyrGetCoarse(orig_pyr, COARSE_PIXELS);
+	TRC_FIM(t, "open: pyramid");
+
+	w = imgGetWidth(orig_img);
+	h = imgGetHeight(orig_img);
+	fit_to_screen(&w, &h);
+	update_dialog_size(dialog, canvas, w, h);
+
+	TRC_REINICIA(t);
+	sobel_img = imgEdges(orig_img, IMG_BORDA_REPETE);
 	grey_img = imgGrey(orig_img);
-	gauss_img = imgCopy(orig_img);
-	imgGauss(gauss_img, orig_img);
-	median_img = imgCopy(orig_img);
-	imgMedian(median_img);
+	TRC_FIM(t, "open: sobel, grey");
+
+	/* these are only computed as they are shown or while idle */
+	if (!gauss_pl) {
+		gauss_pl = pipeCreate(IMG_BORDA_REPETE);
+		pipeGauss(gauss_pl);
+		median_pl = pipeCreate(IMG_BORDA_REPETE);
+		pipeMedian(median_pl);
+		high_prog = imgPointOpCompile("clamp(a - k0*b, 0, 1)", 2, 1);
+	}
+	fx_start(&gauss_fx, compute_gauss);
+	fx_start(&median_fx, compute_median);
+	fx_start(&myeffect_fx, compute_myeffect);
+	fx_start(&high_fx, compute_highlight);
+
+	TRC_REINICIA(t);
 	reduce_img = imgCopy(orig_img);
-	imgReduceColors(orig_img, reduce_img, 255);
-	otsu_img = imgBinOtsu(orig_img);
-	ohbuchi_img = imgBinOhbuchi(orig_img);
-	resize_cb(canvas, imgGetWidth(cur_img), imgGetHeight(cur_img));
-	repaint_cb(canvas);
+	/* the palette and the Otsu threshold are estimated on a reduced level */
+	imgReduceColorsFrom(coarse, orig_img, reduce_img, 255);
+	TRC_FIM(t, "open: reduce");
+	TRC_REINICIA(t);
+	otsu_bmp = imgBinarize(orig_img, imgOtsuThreshold(coarse));
+	ohbuchi_bmp = imgBinarize(orig_img, imgOhbuchiThreshold(orig_img));
+	sauvola_bmp = imgBinSauvola(grey_img, 31, 0.2f);
+	bradley_bmp = imgBinBradley(grey_img, 31, 0.15f);
+	TRC_FIM(t, "open: binarize");
+	/* canny is computed on demand, with the thresholds from its dialog */
+	bmpDestroy(canny_bmp);
+	canny_bmp = NULL;
+	zoom = fit_zoom(orig_img, w, h);
+	view_x = view_y = 0.f;
+	sel_x0 = sel_y0 = sel_x1 = sel_y1 = 0;
+	resize_cb(canvas, w, h);
+	show_trace();
 	return IUP_DEFAULT;
 }
 
@@ -260,68 +602,70 @@ int save_file_cb(void)
 	if (!fname) /*TODO show dialog de erro. */
 		printf ("invalid file name: %s\n", fname);
 
+	if (lazy_effect_of(cur_img))
+		fx_rect(lazy_effect_of(cur_img), 0, 0, imgGetWidth(cur_img), imgGetHeight(cur_img));
 	imgWriteBMP(fname, cur_img);
+	show_trace();
 
 	return IUP_DEFAULT;
 }
 
 int show_orig_cb(Ihandle *ih, int state)
 {
-	cur_img = orig_img;
-
-	repaint_cb(canvas);
+	show_image(orig_img);
 	return IUP_DEFAULT;
 }
 
 int highlight_cb(Ihandle *ih, int state)
 {
-	imgDestroy(high_img);
-	high_img = do_highlight(orig_img, sobel_img);
-	cur_img = high_img;
+	show_image(high_fx.img);
+	return IUP_DEFAULT;
+}
 
-	repaint_cb(canvas);
+/* the Highlight slider: redoes the effect in place and shows it */
+int highlight_th_cb(Ihandle *ih)
+{
+	high_th = IupGetFloat(ih, "VALUE");
+	if (!high_fx.img) return IUP_DEFAULT;
+	fx_restart(&high_fx);
+	/* the repaint redoes the visible tiles; zoomed out, each of them also
+	 * updates the levels of the view pyramid in place */
+	if (cur_img != high_fx.img)
+		show_image(high_fx.img);
+	else
+		repaint_cb(canvas);
 	return IUP_DEFAULT;
 }
 
 
 int sobel_cb(Ihandle *ih, int state)
 {
-	cur_img = sobel_img;
-
-	repaint_cb(canvas);
+	show_image(sobel_img);
 	return IUP_DEFAULT;
 }
 
 int myeffect_cb(Ihandle *ih, int state)
 {
-	cur_img = myeffect_img;
-
-	repaint_cb(canvas);
+	show_image(myeffect_fx.img);
 	return IUP_DEFAULT;
 }
 
 
 int  grey_cb(Ihandle *ih, int state)
 {
-	cur_img = grey_img;
-
-	repaint_cb(canvas);
+	show_image(grey_img);
 	return IUP_DEFAULT;
 }
 
 int  gauss_cb(Ihandle *ih, int state)
 {
-	cur_img = gauss_img;
-
-	repaint_cb(canvas);
+	show_image(gauss_fx.img);
 	return IUP_DEFAULT;
 }
 
 int  median_cb(Ihandle *ih, int state)
 {
-	cur_img = median_img;
-
-	repaint_cb(canvas);
+	show_image(median_fx.img);
 	return IUP_DEFAULT;
 }
 
@@ -337,48 +681,193 @@ int  reduce_cb(Ihandle *ih, int state)
 	reduce_img = imgCopy(orig_img);
 	imgReduceColors(orig_img, reduce_img, num);
 	
-	cur_img = reduce_img;
-
-	repaint_cb(canvas);
+	show_image(reduce_img);
 	return IUP_DEFAULT;
 }
 
-int  otsu_cb(Ihandle *ih, int state)
+/* binary results are kept packed and only expanded while shown */
+void show_bitmap(Bitmap *bmp)
 {
-	cur_img = otsu_img;
+	imgDestroy(bin_img);
+	bin_img = bmpToImage(bmp);
+	show_image(bin_img);
+}
 
-	repaint_cb(canvas);
+int  otsu_cb(Ihandle *ih, int state)
+{
+	show_bitmap(otsu_bmp);
 	return IUP_DEFAULT;
 }
 
 int  ohbuchi_cb(Ihandle *ih, int state)
 {
-	cur_img = ohbuchi_img;
+	show_bitmap(ohbuchi_bmp);
+	return IUP_DEFAULT;
+}
 
-	repaint_cb(canvas);
+int  canny_cb(Ihandle *ih, int state)
+{
+	float low = 0.1f, high = 0.3f;
+
+	if (IupGetParam("set canny thresholds", param_action, 0,
+				"low: %r\n"
+				"high: %r\n", &low, &high, NULL) || !canny_bmp) {
+		bmpDestroy(canny_bmp);
+		canny_bmp = imgCanny(orig_img, low, high);
+	}
+	show_bitmap(canny_bmp);
+	return IUP_DEFAULT;
+}
+
+int  multiotsu_cb(Ihandle *ih, int state)
+{
+	int num = 2;
+	imgDestroy(multiotsu_img);
+
+	if (!IupGetParam("set number of thresholds", param_action, 0,
+				"Number of thresholds: %i\n", &num, NULL))
+		num = 2;
+	if (num < 1) num = 1;
+	if (num > 255) num = 255;
+
+	multiotsu_img = imgOtsuMulti(orig_img, num, 0);
+	show_image(multiotsu_img);
+	return IUP_DEFAULT;
+}
+
+int  sauvola_cb(Ihandle *ih, int state)
+{
+	int win = 31;
+	float k = 0.2f;
+
+	if (IupGetParam("set adaptive threshold", param_action, 0,
+				"window: %i\n"
+				"k: %r\n", &win, &k, NULL)) {
+		bmpDestroy(sauvola_bmp);
+		sauvola_bmp = imgBinSauvola(grey_img, win, k);
+	}
+	show_bitmap(sauvola_bmp);
 	return IUP_DEFAULT;
 }
 
+int  bradley_cb(Ihandle *ih, int state)
+{
+	int win = 31;
+	float t = 0.15f;
+
+	if (IupGetParam("set adaptive threshold", param_action, 0,
+				"window: %i\n"
+				"t: %r\n", &win, &t, NULL)) {
+		bmpDestroy(bradley_bmp);
+		bradley_bmp = imgBinBradley(grey_img, win, t);
+	}
+	show_bitmap(bradley_bmp);
+	return IUP_DEFAULT;
+}
+
+/* the selection goes from where the right button was pressed to (x,y),
+ * both pixels included, clipped to the image */
+void select_to(int x, int y)
+{
+	sel_x0 = (x < sel_ax ? x : sel_ax);
+	sel_y0 = (y < sel_ay ? y : sel_ay);
+	sel_x1 = (x > sel_ax ? x : sel_ax) + 1;
+	sel_y1 = (y > sel_ay ? y : sel_ay) + 1;
+	if (sel_x0 < 0) sel_x0 = 0;
+	if (sel_y0 < 0) sel_y0 = 0;
+	if (sel_x1 > imgGetWidth(cur_img)) sel_x1 = imgGetWidth(cur_img);
+	if (sel_y1 > imgGetHeight(cur_img)) sel_y1 = imgGetHeight(cur_img);
+	if (sel_x0 >= sel_x1 || sel_y0 >= sel_y1)
+		sel_x0 = sel_y0 = sel_x1 = sel_y1 = 0;
+}
+
+/* dragging with the left button pans the image; dragging with the right
+ * one selects a region, which effects compute before the rest, and a right
+ * click without dragging clears it */
 int motion_cb(Ihandle *self, int xm, int ym, char *status){
 	int x=xm;
 	int y=height-ym;
-	IupSetfAttribute(msgbar, "TITLE", "Motion: x = %d, y=%d",x,y);
+
+	if (iup_isbutton1(status) && cur_img) {
+		view_x = drag_vx - (xm - drag_x)/zoom;
+		view_y = drag_vy + (ym - drag_y)/zoom;
+		repaint_cb(canvas);
+	} else if (iup_isbutton3(status) && cur_img) {
+		select_to((int)floor(view_x + x/zoom), (int)floor(view_y + y/zoom));
+		repaint_cb(canvas);
+	}
+	IupSetfAttribute(msgbar, "TITLE", "Motion: x = %d, y=%d",
+			(int)floor(view_x + x/zoom), (int)floor(view_y + y/zoom));
 	return IUP_DEFAULT;
 }
 
 int button_cb(Ihandle* self, int button, int pressed, int xm, int ym, char* status){
 	int x=xm;
 	int y=height-ym;
+
+	if (button == IUP_BUTTON1 && pressed) {
+		drag_x = xm;
+		drag_y = ym;
+		drag_vx = view_x;
+		drag_vy = view_y;
+	} else if (button == IUP_BUTTON3 && cur_img) {
+		int ix = (int)floor(view_x + x/zoom), iy = (int)floor(view_y + y/zoom);
+		if (pressed) {
+			sel_ax = ix;
+			sel_ay = iy;
+		} else if (ix == sel_ax && iy == sel_ay)
+			sel_x0 = sel_y0 = sel_x1 = sel_y1 = 0;
+		else
+			select_to(ix, iy);
+		repaint_cb(canvas);
+	}
 	IupSetfAttribute(msgbar, "TITLE", "pressed=%d, x=%d, y=%d, status=%s",
-			pressed, x, y, status);
+			pressed, (int)floor(view_x + x/zoom), (int)floor(view_y + y/zoom), status);
 	return IUP_DEFAULT;
 }
 
+/* the mouse wheel zooms around the point under the cursor */
+int wheel_cb(Ihandle *self, float delta, int xm, int ym, char *status){
+	float x = (float)xm, y = (float)(height-ym);
+	float ix = view_x + x/zoom, iy = view_y + y/zoom;
+
+	zoom *= (float)pow(1.25, delta);
+	if (zoom < ZOOM_MIN) zoom = ZOOM_MIN;
+	if (zoom > ZOOM_MAX) zoom = ZOOM_MAX;
+	view_x = ix - x/zoom;
+	view_y = iy - y/zoom;
+
+	IupSetfAttribute(msgbar, "TITLE", "zoom %.0f%%", zoom*100);
+	repaint_cb(canvas);
+	return IUP_DEFAULT;
+}
+
+
+/* starts tracing image.c and the viewer; the second press writes TRACE_FILE,
+ * which chrome://tracing or ui.perfetto.dev can open, and stops */
+int trace_cb(Ihandle *ih, int state)
+{
+	char summary[1024];
+
+	if (!trcAtivo) {
+		trcEnable(1);
+		IupSetAttribute(msgbar, "TITLE", "tracing...");
+		return IUP_DEFAULT;
+	}
+	trcEnable(0);
+	if (trcWriteJSON(TRACE_FILE))
+		printf("trace written to %s\n", TRACE_FILE);
+	trcSummary(summary, sizeof(summary));
+	IupSetfAttribute(msgbar, "TITLE", "%s", summary);
+	return IUP_DEFAULT;
+}
 
 int exit_cb(void)
 {
 	printf("Function to free memory and do finalizations...\n");
 	imgDestroy(sobel_img);
+	pyrDestroy(view_pyr);
+	pyrDestroy(orig_pyr);
 
 	sobel_img = cur_img = NULL;
 	return IUP_CLOSE;
@@ -397,6 +886,7 @@ Ihandle* InitToolbar(void)
 	Ihandle* hopen_file = IupButton("Open", "open_file_action");
 	Ihandle* hsave_file = IupButton("Save", "save_file_action");
 	Ihandle* hhighlight_img = IupButton("Highlight", "highlight_img_action");
+	Ihandle* hhighlight_th = IupVal("HORIZONTAL");
 	Ihandle* horig_img = IupButton("Original", "orig_img_action");
 	Ihandle* hsobel_img = IupButton("Sobel", "sobel_img_action");
 	Ihandle* hmyeffect_img = IupButton("Pixelize", "myeffect_img_action");
@@ -406,6 +896,11 @@ Ihandle* InitToolbar(void)
 	Ihandle* hreduce_img = IupButton("Reduce", "reduce_img_action");
 	Ihandle* hotsu_img = IupButton("Otsu", "otsu_img_action");
 	Ihandle* hohbuchi_img = IupButton("Ohbuchi", "ohbuchi_img_action");
+	Ihandle* hmultiotsu_img = IupButton("Multi-Otsu", "multiotsu_img_action");
+	Ihandle* hcanny_img = IupButton("Canny", "canny_img_action");
+	Ihandle* hsauvola_img = IupButton("Sauvola", "sauvola_img_action");
+	Ihandle* hbradley_img = IupButton("Bradley", "bradley_img_action");
+	Ihandle* htrace = IupButton("Trace", "trace_action");
 
 	/* Associate images with this buttons */
 	IupSetAttribute(hopen_file,"IMAGE","IUP_FileOpen");
@@ -414,6 +909,14 @@ Ihandle* InitToolbar(void)
 	/* Associate tip's (text that appear when the mouse is over) */
 	IupSetAttribute(hopen_file,"TIP","go to open_file");
 
+	/* the threshold of Highlight, applied while it is dragged */
+	IupSetAttribute(hhighlight_th, "MIN", "0");
+	IupSetAttribute(hhighlight_th, "MAX", "1");
+	IupSetfAttribute(hhighlight_th, "VALUE", "%g", high_th);
+	IupSetAttribute(hhighlight_th, "RASTERSIZE", "100x");
+	IupSetAttribute(hhighlight_th, "TIP", "highlight threshold");
+	IupSetCallback(hhighlight_th, "VALUECHANGED_CB", (Icallback)highlight_th_cb);
+
 	/* Associate function callbacks to the button actions */
 	IupSetFunction("open_file_action", (Icallback)open_file_cb);
 	IupSetFunction("save_file_action", (Icallback)save_file_cb);
@@ -427,11 +930,17 @@ Ihandle* InitToolbar(void)
 	IupSetFunction("reduce_img_action", (Icallback)reduce_cb);
 	IupSetFunction("otsu_img_action", (Icallback)otsu_cb);
 	IupSetFunction("ohbuchi_img_action", (Icallback)ohbuchi_cb);
+	IupSetFunction("multiotsu_img_action", (Icallback)multiotsu_cb);
+	IupSetFunction("canny_img_action", (Icallback)canny_cb);
+	IupSetFunction("sauvola_img_action", (Icallback)sauvola_cb);
+	IupSetFunction("bradley_img_action", (Icallback)bradley_cb);
+	IupSetFunction("trace_action", (Icallback)trace_cb);
 
 	toolbar=IupHbox(hopen_file, hsave_file, horig_img, hhighlight_img,
-			hsobel_img, hmyeffect_img, hgrey_img, hgauss_img,
+			hhighlight_th, hsobel_img, hmyeffect_img, hgrey_img, hgauss_img,
 			hmedian_img, hreduce_img, hotsu_img,
-			hohbuchi_img, IupFill(),NULL);
+			hohbuchi_img, hmultiotsu_img, hsauvola_img, hbradley_img,
+			hcanny_img, IupFill(), htrace, NULL);
 
 	return toolbar;
 }
@@ -445,12 +954,14 @@ Ihandle* InitCanvas(void)
 	IupSetAttribute(_canvas, "RESIZE_CB", "resize_cb");  /* define callback action associate with the change in size of the _canvas */
 	IupSetAttribute(_canvas, "BUTTON_CB","button_cb");
 	IupSetAttribute(_canvas, "MOTION_CB","motion_cb");
+	IupSetAttribute(_canvas, "WHEEL_CB","wheel_cb");
 
 	/* bind callback actions with callback functions */
 	IupSetFunction("repaint_cb", (Icallback) repaint_cb);
 	IupSetFunction("resize_cb", (Icallback) resize_cb);
 	IupSetFunction("button_cb",(Icallback) button_cb);
 	IupSetFunction("motion_cb",(Icallback) motion_cb);
+	IupSetFunction("wheel_cb",(Icallback) wheel_cb);
 	return _canvas;
 }
 